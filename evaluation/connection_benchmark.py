@@ -0,0 +1,83 @@
+import socket
+import struct
+import sys
+import threading
+import time
+
+# usage: python3 connection_benchmark.py [connections] [searches per client] [clients] [port]
+# holds many idle peer connections open against a running indexing server while a few
+# clients issue searches, then reports how many connections were held and search latency
+connections = int(sys.argv[1]) if len(sys.argv) > 1 else 2000
+searches = int(sys.argv[2]) if len(sys.argv) > 2 else 500
+clients = int(sys.argv[3]) if len(sys.argv) > 3 else 8
+port = int(sys.argv[4]) if len(sys.argv) > 4 else 9999
+
+MAX_FILENAME_SIZE = 256
+MAX_MSG_SIZE = 4096
+
+
+def connect(client_id):
+    s = socket.create_connection(('localhost', port))
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    s.sendall(struct.pack('i', client_id))
+    return s
+
+
+def request(s, request, filename):
+    s.sendall(request + filename.encode().ljust(MAX_FILENAME_SIZE, b'\0'))
+
+
+def recv_reply(s):
+    reply = b''
+    while len(reply) < MAX_MSG_SIZE:
+        data = s.recv(MAX_MSG_SIZE - len(reply))
+        if not data:
+            raise ConnectionError('server closed connection')
+        reply += data
+    return reply
+
+
+idle = list()
+start = time.perf_counter()
+for i in range(connections):
+    s = connect(20000 + i)
+    request(s, b'1', 'idle-{}.txt'.format(i))
+    idle.append(s)
+connect_elapsed = time.perf_counter() - start
+
+latencies = list()
+latencies_m = threading.Lock()
+
+
+def run_client(client_id):
+    s = connect(client_id)
+    request(s, b'1', 'a.txt')
+    local = list()
+    for _ in range(searches):
+        start = time.perf_counter()
+        request(s, b'3', 'a.txt')
+        recv_reply(s)
+        local.append(time.perf_counter() - start)
+    s.close()
+    with latencies_m:
+        latencies.extend(local)
+
+
+threads = [threading.Thread(target=run_client, args=(10000 + i,)) for i in range(clients)]
+start = time.perf_counter()
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+elapsed = time.perf_counter() - start
+
+latencies.sort()
+def percentile(p):
+    return latencies[min(len(latencies) - 1, int(p * len(latencies)))] * 1e6
+
+print('connections held: {} (opened in {:.2f}s)'.format(len(idle), connect_elapsed))
+print('searches: {} in {:.2f}s ({:.0f}/s)'.format(len(latencies), elapsed, len(latencies) / elapsed))
+print('search latency us: p50 {:.0f} p99 {:.0f} p999 {:.0f}'.format(percentile(0.5), percentile(0.99), percentile(0.999)))
+
+for s in idle:
+    s.close()
@@ -0,0 +1,283 @@
+// microbenchmarks for the indexing server's files index
+// build with `make index_benchmark` from src/
+//
+// usage: ./index_benchmark mixed [threads] [seconds] [write percent] [files]
+//     runs threads that mix registrations/deregistrations with searches against both the sharded
+//     FilesIndex and a single-mutex map (the original indexing server layout) and reports
+//     throughput and search latency for each
+//
+// usage: ./index_benchmark cleanup [files] [peers] [samples]
+//     fills the index with files spread over peers and times disconnect cleanup for a sample of peers,
+//     compared with the original copy-and-filter cleanup over the whole map
+//
+// usage: ./index_benchmark memory [files] [peers] [searches]
+//     fills the index with files spread over peers, most with one or two holders and a few popular ones
+//     with many, then reports heap bytes per file and single-threaded search latency, next to the
+//     original unsharded map
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+#include <malloc.h>
+
+#include "files_index.h"
+
+
+typedef std::chrono::steady_clock bench_clock;
+
+
+// the index layout used before sharding, every operation takes one global lock
+class GlobalMutexIndex {
+    private:
+        std::unordered_map<std::string, std::vector<int>> files;
+        std::mutex m;
+
+    public:
+        void add(const std::string &filename, int client_id) {
+            std::lock_guard<std::mutex> guard(m);
+            std::vector<int> &client_ids = files[filename];
+            if (std::find(client_ids.begin(), client_ids.end(), client_id) == client_ids.end())
+                client_ids.push_back(client_id);
+        }
+
+        void remove(const std::string &filename, int client_id) {
+            std::lock_guard<std::mutex> guard(m);
+            auto file_index = files.find(filename);
+            if (file_index == files.end())
+                return;
+            std::vector<int> &client_ids = file_index->second;
+            client_ids.erase(std::remove(client_ids.begin(), client_ids.end(), client_id), client_ids.end());
+            if (client_ids.empty())
+                files.erase(file_index);
+        }
+
+        std::vector<int> find(const std::string &filename) {
+            std::lock_guard<std::mutex> guard(m);
+            auto file_index = files.find(filename);
+            if (file_index == files.end())
+                return std::vector<int>();
+            return file_index->second;
+        }
+
+        void remove_client(int client_id) {
+            std::unordered_map<std::string, std::vector<int>> tmp_files;
+
+            std::lock_guard<std::mutex> guard(m);
+            for (auto const &file_index : files) {
+                std::vector<int> tmp_client_ids = file_index.second;
+                tmp_client_ids.erase(std::remove(tmp_client_ids.begin(), tmp_client_ids.end(), client_id), tmp_client_ids.end());
+                if (tmp_client_ids.size() > 0)
+                    tmp_files[file_index.first] = tmp_client_ids;
+            }
+            files = tmp_files;
+        }
+};
+
+
+std::vector<std::string> make_filenames(size_t count) {
+    std::vector<std::string> filenames;
+    filenames.reserve(count);
+    for (size_t i = 0; i < count; i++)
+        filenames.push_back("file-" + std::to_string(i) + ".txt");
+    return filenames;
+}
+
+
+long percentile(std::vector<long> &samples, double p) {
+    if (samples.empty())
+        return 0;
+    size_t idx = std::min(samples.size() - 1, (size_t)(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+    return samples[idx];
+}
+
+
+template<typename Index>
+void run_mixed(const char *name, Index &index, int threads, int seconds, int write_percent, const std::vector<std::string> &filenames) {
+    // prepopulate so searches mostly hit
+    for (size_t i = 0; i < filenames.size(); i++)
+        index.add(filenames[i], 50000 + (int)(i % 1000));
+
+    std::atomic<bool> running(true);
+    std::atomic<long> searches(0), writes(0);
+    std::vector<std::vector<long>> latencies(threads);
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            std::mt19937 rng(t);
+            std::uniform_int_distribution<size_t> pick(0, filenames.size() - 1);
+            std::uniform_int_distribution<int> percent(0, 99);
+            long local_searches = 0, local_writes = 0;
+            int client_id = 10000 + t;
+            while (running.load(std::memory_order_relaxed)) {
+                const std::string &filename = filenames[pick(rng)];
+                if (percent(rng) < write_percent) {
+                    if (local_writes & 1)
+                        index.remove(filename, client_id);
+                    else
+                        index.add(filename, client_id);
+                    local_writes++;
+                }
+                else {
+                    bench_clock::time_point start = bench_clock::now();
+                    volatile size_t found = index.find(filename).size();
+                    (void)found;
+                    // sample latencies to keep the vector small
+                    if ((local_searches & 15) == 0)
+                        latencies[t].push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count());
+                    local_searches++;
+                }
+            }
+            searches += local_searches;
+            writes += local_writes;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    running = false;
+    for (auto &&worker : workers)
+        worker.join();
+
+    std::vector<long> all;
+    for (auto &&samples : latencies)
+        all.insert(all.end(), samples.begin(), samples.end());
+
+    std::cout << name << ": " << (searches + writes) / seconds << " ops/s ("
+              << searches / seconds << " searches/s, " << writes / seconds << " writes/s), search ns p50 "
+              << percentile(all, 0.5) << " p99 " << percentile(all, 0.99) << " p999 " << percentile(all, 0.999) << std::endl;
+}
+
+
+template<typename Index>
+void run_cleanup(const char *name, Index &index, int peers, int samples, const std::vector<std::string> &filenames) {
+    // every file has one holder and every tenth file a second one, spread evenly across peers
+    for (size_t i = 0; i < filenames.size(); i++) {
+        index.add(filenames[i], (int)(i % peers));
+        if (i % 10 == 0)
+            index.add(filenames[i], (int)((i / 10) % peers));
+    }
+
+    std::vector<long> latencies;
+    for (int i = 0; i < samples; i++) {
+        int client_id = (int)((long)i * peers / samples);
+        bench_clock::time_point start = bench_clock::now();
+        index.remove_client(client_id);
+        latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - start).count());
+    }
+    long max = *std::max_element(latencies.begin(), latencies.end());
+
+    std::cout << name << ": " << samples << " cleanups, us p50 " << percentile(latencies, 0.5)
+              << " p99 " << percentile(latencies, 0.99) << " max " << max << std::endl;
+}
+
+
+// bytes currently allocated from the heap, including allocator headers and mmapped blocks
+size_t heap_in_use() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+
+template<typename Index>
+void run_memory(const char *name, int peers, size_t searches, const std::vector<std::string> &filenames) {
+    size_t before = heap_in_use();
+    size_t entries = 0;
+    std::unique_ptr<Index> index(new Index);
+    // seven in ten files have one holder, most others two and one in a thousand is held by a hundred peers
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> peer(0, peers - 1);
+    for (size_t i = 0; i < filenames.size(); i++) {
+        size_t holders = i % 1000 == 0 ? 100 : i % 10 < 7 ? 1 : i % 10 < 9 ? 2 : 3;
+        for (size_t j = 0; j < holders; j++)
+            index->add(filenames[i], peer(rng));
+        entries += holders;
+    }
+    malloc_trim(0);
+    size_t bytes = heap_in_use() - before;
+
+    std::uniform_int_distribution<size_t> pick(0, filenames.size() - 1);
+    std::vector<long> latencies;
+    latencies.reserve(searches);
+    size_t found = 0;
+    for (size_t i = 0; i < searches; i++) {
+        const std::string &filename = filenames[pick(rng)];
+        bench_clock::time_point start = bench_clock::now();
+        found += index->find(filename).size();
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count());
+    }
+    long total = 0;
+    for (auto &&latency : latencies)
+        total += latency;
+
+    std::cout << name << ": " << bytes / filenames.size() << " bytes/file, " << bytes / entries << " bytes/entry, "
+              << bytes / (1 << 20) << " MiB total, search ns mean " << total / (long)std::max<size_t>(searches, 1)
+              << " p50 " << percentile(latencies, 0.5) << " p99 " << percentile(latencies, 0.99)
+              << " (" << found << " holders found)" << std::endl;
+}
+
+
+int main(int argc, char *argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "mixed";
+
+    if (mode == "mixed") {
+        int threads = argc > 2 ? atoi(argv[2]) : 4;
+        int seconds = argc > 3 ? atoi(argv[3]) : 3;
+        int write_percent = argc > 4 ? atoi(argv[4]) : 10;
+        size_t files = argc > 5 ? atol(argv[5]) : 100000;
+        std::vector<std::string> filenames = make_filenames(files);
+
+        std::cout << threads << " threads, " << write_percent << "% writes, " << files << " files" << std::endl;
+        {
+            GlobalMutexIndex index;
+            run_mixed("global mutex", index, threads, seconds, write_percent, filenames);
+        }
+        {
+            FilesIndex index;
+            run_mixed("sharded", index, threads, seconds, write_percent, filenames);
+        }
+    }
+    else if (mode == "cleanup") {
+        size_t files = argc > 2 ? atol(argv[2]) : 1000000;
+        int peers = argc > 3 ? atoi(argv[3]) : 10000;
+        int samples = argc > 4 ? atoi(argv[4]) : 1000;
+        std::vector<std::string> filenames = make_filenames(files);
+
+        std::cout << files << " files, " << peers << " peers" << std::endl;
+        {
+            // the copy-and-filter cleanup is slow enough that only a handful of samples are taken
+            GlobalMutexIndex index;
+            run_cleanup("copy and filter", index, peers, std::min(samples, 5), filenames);
+        }
+        {
+            FilesIndex index;
+            run_cleanup("reverse index", index, peers, samples, filenames);
+        }
+    }
+    else if (mode == "memory") {
+        size_t files = argc > 2 ? atol(argv[2]) : 10000000;
+        int peers = argc > 3 ? atoi(argv[3]) : 10000;
+        size_t searches = argc > 4 ? atol(argv[4]) : 1000000;
+        std::vector<std::string> filenames = make_filenames(files);
+
+        std::cout << files << " files, " << peers << " peers" << std::endl;
+        run_memory<GlobalMutexIndex>("original map", peers, searches, filenames);
+        run_memory<FilesIndex>("files index", peers, searches, filenames);
+    }
+    else {
+        std::cerr << "usage: " << argv[0] << " mixed [threads] [seconds] [write percent] [files]" << std::endl;
+        std::cerr << "       " << argv[0] << " cleanup [files] [peers] [samples]" << std::endl;
+        std::cerr << "       " << argv[0] << " memory [files] [peers] [searches]" << std::endl;
+        exit(0);
+    }
+
+    return 0;
+}
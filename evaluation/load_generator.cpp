@@ -0,0 +1,692 @@
+// load generator for the indexing server and peer servers
+// build with `make load_generator` from src/
+//
+// usage: ./load_generator [-p peers] [-T threads] [-d seconds] [-m closed|open] [-w window] [-r rate]
+//                         [-x register:search:retrieve] [-f files] [-k files per peer] [-z zipf exponent]
+//                         [-R peer ports] [-F retrieve filenames] [-h host] [-P server ports] [-b base client id]
+//
+// opens peers simulated peers over the binary protocol, each registering k files drawn from a catalog of f names
+// ("file-<rank>.txt") with zipf distributed popularity, then drives a mix of requests against them for the given
+// number of seconds:
+//     register  registers a zipf distributed filename, or deregisters it if already held, then syncs and
+//               waits for the sync result
+//     search    tagged search for a zipf distributed filename
+//     retrieve  downloads one of the -F filenames from one of the -R peer servers (real peer processes)
+//
+// closed loop keeps window requests in flight on every simulated peer and sends the next one as soon as
+// a reply arrives. open loop sends rate requests per second in total at fixed intervals, whether or not
+// earlier requests were answered, and measures latency from when each request was due so a stalled
+// server shows up as latency instead of a lower send rate
+//
+// with several -P server ports the filenames are partitioned across the servers like the peers do it: every
+// simulated peer connects to each server and sends a file's registrations and searches to the server the
+// partition map puts the file on
+//
+// results are printed as a single json object on stdout, with the files and requests each server got
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <deque>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <cmath>
+
+#include "protocol.h"
+#include "latency_histogram.h"
+#include "partition_map.h"
+
+
+#define MAX_FILENAME_SIZE 256 // fixed filename size of the peer server protocol
+#define MAX_STAT_MSG_SIZE 16 // fixed file size reply of the peer server protocol
+#define MAX_EVENTS 256
+#define RECV_BUFFER_SIZE 65536
+
+
+typedef std::chrono::steady_clock load_clock;
+
+enum Op {REGISTER, SEARCH, RETRIEVE, NUM_OPS};
+const char *op_names[] = {"register", "search", "retrieve"};
+
+
+struct Options {
+    int peers = 100;
+    int threads = 1;
+    int seconds = 10;
+    bool open_loop = false;
+    int window = 1; // requests in flight per simulated peer in closed loop
+    double rate = 1000; // requests per second across all threads in open loop
+    int mix[NUM_OPS] = {10, 90, 0}; // relative weights of each request type
+    int files = 10000;
+    int files_per_peer = 10;
+    double zipf = 1.0;
+    std::vector<int> retrieve_ports;
+    std::vector<std::string> retrieve_files = {"a.txt"};
+    std::string host = "127.0.0.1";
+    std::vector<int> server_ports = {9999};
+    int base_id = 100000; // client ids above any real peer port so simulated peers never collide with them
+};
+
+
+// results shared by every thread
+struct Results {
+    LatencyHistogram latencies[NUM_OPS]; // microseconds
+    std::atomic<uint64_t> errors[NUM_OPS] = {};
+};
+
+
+// sample catalog ranks so that rank i is picked with probability proportional to 1 / (i + 1)^s
+class ZipfDistribution {
+    private:
+        std::vector<double> cdf;
+
+    public:
+        ZipfDistribution(int n, double s) : cdf(n) {
+            double total = 0;
+            for (int i = 0; i < n; i++) {
+                total += 1.0 / std::pow(i + 1, s);
+                cdf[i] = total;
+            }
+            for (auto &&value : cdf)
+                value /= total;
+        }
+
+        template<typename Rng>
+        int operator()(Rng &rng) {
+            double u = std::uniform_real_distribution<double>(0, 1)(rng);
+            return std::min<int>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), cdf.size() - 1);
+        }
+};
+
+
+std::string catalog_name(int rank) {
+    return "file-" + std::to_string(rank) + ".txt";
+}
+
+
+// anything registered with a worker's epoll instance
+struct Stream {
+    enum Kind {INDEX, TRANSFER};
+    Kind kind;
+    int fd = -1;
+    std::string in;
+    std::string out;
+
+    Stream(Kind stream_kind) : kind(stream_kind) {}
+};
+
+
+struct SimPeer;
+
+
+// a simulated peer's connection to one indexing server, with the share of its files the server holds
+struct ServerLink : Stream {
+    SimPeer *owner; // gets the next request in closed loop
+    uint64_t generation = 0;
+    uint64_t next_request_id = 0;
+    std::vector<int> held; // catalog ranks currently registered
+    std::unordered_map<uint64_t, load_clock::time_point> searches; // in flight by request id
+    std::deque<load_clock::time_point> syncs; // in flight, answered in the order they were sent
+    uint64_t completed[NUM_OPS] = {};
+
+    ServerLink(SimPeer *peer) : Stream(INDEX), owner(peer) {}
+};
+
+
+// a simulated peer, connected to every indexing server in the order of the -P ports
+struct SimPeer {
+    int client_id;
+    std::vector<std::unique_ptr<ServerLink>> links;
+
+    SimPeer(int id) : client_id(id) {}
+};
+
+
+// what one indexing server got from every simulated peer
+struct ServerCounts {
+    uint64_t files = 0; // registered at the end of the run
+    uint64_t completed[NUM_OPS] = {};
+};
+
+
+// a single file download from a peer server
+struct Transfer : Stream {
+    SimPeer *owner; // simulated peer that gets the next request in closed loop
+    load_clock::time_point start;
+    int64_t remaining = -1; // file bytes still expected, -1 until the size arrives
+
+    Transfer(SimPeer *peer, load_clock::time_point due) : Stream(TRANSFER), owner(peer), start(due) {}
+};
+
+
+class LoadWorker {
+    private:
+        const Options &options;
+        Results &results;
+        ZipfDistribution &zipf;
+        const std::vector<size_t> &rank_servers; // index of the server holding each catalog rank
+        std::vector<std::unique_ptr<SimPeer>> peers;
+        std::unordered_map<Transfer*, std::unique_ptr<Transfer>> transfers;
+        std::vector<SimPeer*> reissue; // closed loop peers whose transfer failed before it started, owed a new request
+        std::mt19937 rng;
+        int epoll_fd;
+        bool running = true;
+
+        static long elapsed_us(load_clock::time_point start) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(load_clock::now() - start).count();
+        }
+
+        void finish(Op op, load_clock::time_point start, bool ok) {
+            if (!running)
+                return;
+            if (ok)
+                results.latencies[op].record(elapsed_us(start));
+            else
+                results.errors[op]++;
+        }
+
+        // write as much of a stream's queued output as the socket takes, false if the connection broke
+        bool flush(Stream &stream) {
+            size_t sent = 0;
+            while (sent < stream.out.size()) {
+                ssize_t n = send(stream.fd, stream.out.data() + sent, stream.out.size() - sent, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+                if (n <= 0)
+                    return false;
+                sent += n;
+            }
+            stream.out.erase(0, sent);
+            return true;
+        }
+
+        // read everything available, false once the connection is closed
+        bool drain(Stream &stream) {
+            char buffer[RECV_BUFFER_SIZE];
+            while (1) {
+                ssize_t n = recv(stream.fd, buffer, sizeof(buffer), 0);
+                if (n > 0) {
+                    stream.in.append(buffer, n);
+                    continue;
+                }
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    return true;
+                return false;
+            }
+        }
+
+        Op pick_op() {
+            int total = options.mix[REGISTER] + options.mix[SEARCH] + options.mix[RETRIEVE];
+            int pick = std::uniform_int_distribution<int>(0, total - 1)(rng);
+            for (int op = 0; op < NUM_OPS; op++) {
+                if (pick < options.mix[op])
+                    return (Op)op;
+                pick -= options.mix[op];
+            }
+            return SEARCH;
+        }
+
+        // send the next request for a simulated peer, latency is measured from due
+        // registrations and searches go to the server the partition map puts the file on
+        void issue(SimPeer &peer, load_clock::time_point due) {
+            Op op = pick_op();
+            if (op == RETRIEVE) {
+                start_transfer(&peer, due);
+                return;
+            }
+            int rank = zipf(rng);
+            ServerLink &link = *peer.links[rank_servers[rank]];
+            if (op == SEARCH) {
+                uint64_t request_id = link.next_request_id++;
+                std::string payload;
+                put_varint(payload, request_id);
+                put_string(payload, catalog_name(rank));
+                link.out += make_frame(OP_SEARCH_TAGGED, payload);
+                link.searches[request_id] = due;
+            }
+            else {
+                // toggling popular files keeps each peer's file count near where it started
+                std::string payload;
+                put_varint(payload, ++link.generation);
+                auto held = std::find(link.held.begin(), link.held.end(), rank);
+                if (held == link.held.end()) {
+                    link.held.push_back(rank);
+                    payload += (char)0;
+                    put_strings(payload, std::vector<std::string>{catalog_name(rank)});
+                    link.out += make_frame(OP_REGISTER_MANY, payload);
+                }
+                else {
+                    link.held.erase(held);
+                    put_strings(payload, std::vector<std::string>{catalog_name(rank)});
+                    link.out += make_frame(OP_DEREGISTER_MANY, payload);
+                }
+                payload.clear();
+                put_varint(payload, link.generation);
+                put_varint(payload, link.held.size());
+                link.out += make_frame(OP_SYNC, payload);
+                link.syncs.push_back(due);
+            }
+            if (!flush(link))
+                running = false;
+        }
+
+        void start_transfer(SimPeer *peer, load_clock::time_point due) {
+            int port = options.retrieve_ports[std::uniform_int_distribution<size_t>(0, options.retrieve_ports.size() - 1)(rng)];
+            const std::string &filename = options.retrieve_files[std::uniform_int_distribution<size_t>(0, options.retrieve_files.size() - 1)(rng)];
+
+            std::unique_ptr<Transfer> transfer(new Transfer(peer, due));
+            transfer->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            struct sockaddr_in addr;
+            bzero((char*)&addr, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr);
+            if (connect(transfer->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+                close(transfer->fd);
+                finish(RETRIEVE, due, false);
+                // keep the closed loop window full like end_transfer does, but from the run loop so a server that keeps
+                // refusing cannot recurse through issue
+                if (!options.open_loop && running)
+                    reissue.push_back(peer);
+                return;
+            }
+
+            char request[MAX_FILENAME_SIZE];
+            bzero(request, sizeof(request));
+            strncpy(request, filename.c_str(), sizeof(request) - 1);
+            transfer->out.assign(request, sizeof(request));
+
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.ptr = static_cast<Stream*>(transfer.get());
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, transfer->fd, &event);
+            transfers[transfer.get()] = std::move(transfer);
+        }
+
+        void end_transfer(Transfer *transfer, bool ok) {
+            finish(RETRIEVE, transfer->start, ok);
+            SimPeer *owner = transfer->owner;
+            close(transfer->fd);
+            transfers.erase(transfer);
+            if (!options.open_loop && running)
+                issue(*owner, load_clock::now());
+        }
+
+        void handle_transfer(Transfer *transfer, uint32_t events) {
+            if (!flush(*transfer)) {
+                end_transfer(transfer, false);
+                return;
+            }
+            bool open = drain(*transfer);
+            if (transfer->remaining < 0 && transfer->in.size() >= MAX_STAT_MSG_SIZE) {
+                transfer->remaining = atoll(std::string(transfer->in.data(), strnlen(transfer->in.data(), MAX_STAT_MSG_SIZE)).c_str());
+                if (transfer->remaining < 0) {
+                    end_transfer(transfer, false);
+                    return;
+                }
+                transfer->in.erase(0, MAX_STAT_MSG_SIZE);
+            }
+            if (transfer->remaining >= 0) {
+                transfer->remaining -= std::min<int64_t>(transfer->remaining, transfer->in.size());
+                transfer->in.clear();
+                if (transfer->remaining == 0) {
+                    end_transfer(transfer, true);
+                    return;
+                }
+            }
+            if (!open || (events & EPOLLERR))
+                end_transfer(transfer, false);
+        }
+
+        void handle_link(ServerLink &link) {
+            if (!drain(link) || !flush(link)) {
+                running = false;
+                return;
+            }
+            size_t pos = 0;
+            uint8_t opcode;
+            std::string payload;
+            int parsed;
+            while ((parsed = parse_frame(link.in, pos, opcode, payload)) > 0) {
+                const char *p = payload.data();
+                const char *end = p + payload.size();
+                uint64_t key;
+                if (!get_varint(p, end, key))
+                    continue;
+                if (opcode == OP_SEARCH_TAGGED_RESULT) {
+                    auto search = link.searches.find(key);
+                    if (search == link.searches.end())
+                        continue;
+                    finish(SEARCH, search->second, true);
+                    link.searches.erase(search);
+                    link.completed[SEARCH]++;
+                }
+                else if (opcode == OP_SYNC_RESULT) {
+                    if (link.syncs.empty())
+                        continue;
+                    finish(REGISTER, link.syncs.front(), p < end && *p == SYNC_OK);
+                    link.syncs.pop_front();
+                    link.completed[REGISTER]++;
+                }
+                else {
+                    continue;
+                }
+                if (!options.open_loop && running)
+                    issue(*link.owner, load_clock::now());
+            }
+            link.in.erase(0, pos);
+            if (parsed < 0)
+                running = false;
+        }
+
+        // connect and handshake one of a simulated peer's server connections, then register its share of files
+        bool add_link(SimPeer &peer, const struct sockaddr_in &addr, const std::vector<std::string> &filenames) {
+            std::unique_ptr<ServerLink> link(new ServerLink(&peer));
+            link->fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(link->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+                close(link->fd);
+                return false;
+            }
+            int nodelay = 1;
+            setsockopt(link->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+            char handshake[sizeof(int) + sizeof(char) + sizeof(int)];
+            int magic = PROTOCOL_MAGIC;
+            memcpy(handshake, &magic, sizeof(magic));
+            handshake[sizeof(magic)] = PROTOCOL_VERSION;
+            memcpy(handshake + sizeof(magic) + sizeof(char), &peer.client_id, sizeof(peer.client_id));
+            char version;
+            if (!send_all(link->fd, handshake, sizeof(handshake)) || !recv_all(link->fd, &version, sizeof(version)) || version != PROTOCOL_VERSION) {
+                close(link->fd);
+                return false;
+            }
+
+            std::string payload;
+            put_varint(payload, ++link->generation);
+            payload += (char)REGISTER_REPLACE;
+            put_strings(payload, filenames);
+            std::string frame = make_frame(OP_REGISTER_MANY, payload);
+            if (!send_all(link->fd, frame.data(), frame.size())) {
+                close(link->fd);
+                return false;
+            }
+
+            fcntl(link->fd, F_SETFL, fcntl(link->fd, F_GETFL) | O_NONBLOCK);
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.ptr = static_cast<Stream*>(link.get());
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, link->fd, &event);
+            peer.links.push_back(std::move(link));
+            return true;
+        }
+
+    public:
+        LoadWorker(const Options &load_options, Results &load_results, ZipfDistribution &distribution, const std::vector<size_t> &servers, int seed)
+            : options(load_options), results(load_results), zipf(distribution), rank_servers(servers), rng(seed) {
+            epoll_fd = epoll_create1(0);
+        }
+
+        // connect a simulated peer to every server and register its initial files, each with the server holding it
+        bool add_peer(int client_id, const std::vector<struct sockaddr_in> &addrs) {
+            std::unique_ptr<SimPeer> peer(new SimPeer(client_id));
+            std::vector<int> ranks;
+            std::vector<std::vector<std::string>> filenames(addrs.size());
+            for (int i = 0; i < options.files_per_peer; i++) {
+                int rank = zipf(rng);
+                if (std::find(ranks.begin(), ranks.end(), rank) == ranks.end()) {
+                    ranks.push_back(rank);
+                    filenames[rank_servers[rank]].push_back(catalog_name(rank));
+                }
+            }
+            for (size_t i = 0; i < addrs.size(); i++) {
+                if (!add_link(*peer, addrs[i], filenames[i])) {
+                    for (auto &&link : peer->links)
+                        close(link->fd);
+                    return false;
+                }
+            }
+            for (int rank : ranks)
+                peer->links[rank_servers[rank]]->held.push_back(rank);
+            peers.push_back(std::move(peer));
+            return true;
+        }
+
+        // drive requests until the deadline, rate is this worker's share of the open loop rate
+        void run(load_clock::time_point deadline, double rate) {
+            struct epoll_event events[MAX_EVENTS];
+            load_clock::duration interval = std::chrono::duration_cast<load_clock::duration>(std::chrono::duration<double>(rate > 0 ? 1.0 / rate : 1.0));
+            load_clock::time_point next_send = load_clock::now();
+
+            if (!options.open_loop) {
+                for (auto &&peer : peers) {
+                    for (int i = 0; i < options.window; i++)
+                        issue(*peer, load_clock::now());
+                }
+            }
+
+            while (running && load_clock::now() < deadline) {
+                int timeout = reissue.empty() ? 100 : 0;
+                if (options.open_loop)
+                    timeout = std::max<long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(next_send - load_clock::now()).count());
+                int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+                for (int i = 0; i < n; i++) {
+                    Stream *stream = static_cast<Stream*>(events[i].data.ptr);
+                    if (stream->kind == Stream::INDEX)
+                        handle_link(*static_cast<ServerLink*>(stream));
+                    else
+                        handle_transfer(static_cast<Transfer*>(stream), events[i].events);
+                }
+
+                std::vector<SimPeer*> owed;
+                owed.swap(reissue);
+                for (auto &&peer : owed) {
+                    if (running)
+                        issue(*peer, load_clock::now());
+                }
+
+                if (options.open_loop) {
+                    // catch up on every request that came due, each keeps its own due time
+                    load_clock::time_point now = load_clock::now();
+                    while (next_send <= now && running) {
+                        issue(*peers[std::uniform_int_distribution<size_t>(0, peers.size() - 1)(rng)], next_send);
+                        next_send += interval;
+                    }
+                }
+            }
+            running = false;
+        }
+
+        size_t size() const {
+            return peers.size();
+        }
+
+        // add up what each server got from this worker's simulated peers
+        void count_servers(std::vector<ServerCounts> &counts) const {
+            for (auto &&peer : peers) {
+                for (size_t i = 0; i < peer->links.size(); i++) {
+                    counts[i].files += peer->links[i]->held.size();
+                    for (int op = 0; op < NUM_OPS; op++)
+                        counts[i].completed[op] += peer->links[i]->completed[op];
+                }
+            }
+        }
+
+        ~LoadWorker() {
+            for (auto &&peer : peers) {
+                for (auto &&link : peer->links)
+                    close(link->fd);
+            }
+            for (auto &&transfer : transfers)
+                close(transfer.first->fd);
+            close(epoll_fd);
+        }
+};
+
+
+bool parse_mix(const std::string &value, int mix[NUM_OPS]) {
+    std::istringstream parts(value);
+    std::string part;
+    for (int op = 0; op < NUM_OPS; op++) {
+        if (!std::getline(parts, part, ':'))
+            return false;
+        mix[op] = atoi(part.c_str());
+        if (mix[op] < 0)
+            return false;
+    }
+    return mix[REGISTER] + mix[SEARCH] + mix[RETRIEVE] > 0;
+}
+
+
+template<typename T>
+std::vector<T> parse_list(const std::string &value, T (*convert)(const std::string&)) {
+    std::vector<T> values;
+    std::istringstream parts(value);
+    std::string part;
+    while (std::getline(parts, part, ','))
+        values.push_back(convert(part));
+    return values;
+}
+
+
+void usage(const char *name) {
+    std::cerr << "usage: " << name << " [-p peers] [-T threads] [-d seconds] [-m closed|open] [-w window] [-r rate]" << std::endl;
+    std::cerr << "       [-x register:search:retrieve] [-f files] [-k files per peer] [-z zipf exponent]" << std::endl;
+    std::cerr << "       [-R peer ports] [-F retrieve filenames] [-h host] [-P server ports] [-b base client id]" << std::endl;
+    exit(0);
+}
+
+
+int main(int argc, char *argv[]) {
+    Options options;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:T:d:m:w:r:x:f:k:z:R:F:h:P:b:")) != -1) {
+        switch (opt) {
+            case 'p': options.peers = atoi(optarg); break;
+            case 'T': options.threads = atoi(optarg); break;
+            case 'd': options.seconds = atoi(optarg); break;
+            case 'm': options.open_loop = std::string(optarg) == "open"; break;
+            case 'w': options.window = atoi(optarg); break;
+            case 'r': options.rate = atof(optarg); break;
+            case 'x':
+                if (!parse_mix(optarg, options.mix))
+                    usage(argv[0]);
+                break;
+            case 'f': options.files = atoi(optarg); break;
+            case 'k': options.files_per_peer = atoi(optarg); break;
+            case 'z': options.zipf = atof(optarg); break;
+            case 'R': options.retrieve_ports = parse_list<int>(optarg, [](const std::string &s) { return atoi(s.c_str()); }); break;
+            case 'F': options.retrieve_files = parse_list<std::string>(optarg, [](const std::string &s) { return s; }); break;
+            case 'h': options.host = optarg; break;
+            case 'P': options.server_ports = parse_list<int>(optarg, [](const std::string &s) { return atoi(s.c_str()); }); break;
+            case 'b': options.base_id = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (options.peers <= 0 || options.threads <= 0 || options.seconds <= 0 || options.window <= 0 || options.rate <= 0 || options.files <= 0)
+        usage(argv[0]);
+    if (options.mix[RETRIEVE] > 0 && (options.retrieve_ports.empty() || options.retrieve_files.empty())) {
+        std::cerr << "retrieves need at least one peer server port (-R) and filename (-F)" << std::endl;
+        exit(0);
+    }
+    options.threads = std::min(options.threads, options.peers);
+
+    // the servers in the partition map's order, with every catalog file assigned to one of them
+    PartitionMap partition_map(options.server_ports);
+    options.server_ports = partition_map.servers();
+    if (options.server_ports.empty())
+        usage(argv[0]);
+    std::vector<size_t> rank_servers(options.files);
+    for (int rank = 0; rank < options.files; rank++) {
+        int port = partition_map.server_for(catalog_name(rank));
+        rank_servers[rank] = std::find(options.server_ports.begin(), options.server_ports.end(), port) - options.server_ports.begin();
+    }
+
+    std::vector<struct sockaddr_in> addrs;
+    for (int port : options.server_ports) {
+        struct addrinfo hints, *server_info;
+        bzero((char*)&hints, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(options.host.c_str(), std::to_string(port).c_str(), &hints, &server_info) != 0) {
+            std::cerr << "unknown host " << options.host << std::endl;
+            exit(1);
+        }
+        addrs.push_back(*(struct sockaddr_in*)server_info->ai_addr);
+        freeaddrinfo(server_info);
+    }
+
+    Results results;
+    ZipfDistribution zipf(options.files, options.zipf);
+    std::vector<std::unique_ptr<LoadWorker>> workers;
+    for (int t = 0; t < options.threads; t++)
+        workers.emplace_back(new LoadWorker(options, results, zipf, rank_servers, t + 1));
+
+    // connect every simulated peer up front, spread evenly over the workers
+    load_clock::time_point connect_start = load_clock::now();
+    int connected = 0;
+    for (int i = 0; i < options.peers; i++)
+        connected += workers[i % options.threads]->add_peer(options.base_id + i, addrs);
+    long connect_ms = std::chrono::duration_cast<std::chrono::milliseconds>(load_clock::now() - connect_start).count();
+    if (connected < options.peers)
+        std::cerr << "only " << connected << " of " << options.peers << " peers connected" << std::endl;
+
+    load_clock::time_point start = load_clock::now();
+    load_clock::time_point deadline = start + std::chrono::seconds(options.seconds);
+    std::vector<std::thread> threads;
+    for (auto &&worker : workers)
+        threads.emplace_back(&LoadWorker::run, worker.get(), deadline, options.rate * worker->size() / std::max(connected, 1));
+    for (auto &&thread : threads)
+        thread.join();
+    double elapsed = std::chrono::duration<double>(load_clock::now() - start).count();
+    std::vector<ServerCounts> server_counts(options.server_ports.size());
+    for (auto &&worker : workers)
+        worker->count_servers(server_counts);
+
+    uint64_t completed = 0, errors = 0;
+    for (int op = 0; op < NUM_OPS; op++) {
+        completed += results.latencies[op].count();
+        errors += results.errors[op];
+    }
+
+    std::ostringstream json;
+    json << "{\"mode\": \"" << (options.open_loop ? "open" : "closed") << "\", \"peers\": " << connected << ", \"threads\": " << options.threads
+         << ", \"seconds\": " << elapsed << ", \"window\": " << options.window << ", \"rate\": " << (options.open_loop ? options.rate : 0)
+         << ", \"mix\": {\"register\": " << options.mix[REGISTER] << ", \"search\": " << options.mix[SEARCH] << ", \"retrieve\": " << options.mix[RETRIEVE]
+         << "}, \"files\": " << options.files << ", \"files_per_peer\": " << options.files_per_peer << ", \"zipf\": " << options.zipf
+         << ", \"connect_ms\": " << connect_ms << ", \"completed\": " << completed << ", \"errors\": " << errors
+         << ", \"throughput\": " << (long)(completed / elapsed) << ", \"ops\": {";
+    for (int op = 0; op < NUM_OPS; op++) {
+        const LatencyHistogram &latencies = results.latencies[op];
+        json << (op ? ", " : "") << '"' << op_names[op] << "\": {\"completed\": " << latencies.count() << ", \"errors\": " << results.errors[op]
+             << ", \"throughput\": " << (long)(latencies.count() / elapsed) << ", \"mean_us\": " << latencies.mean()
+             << ", \"p50_us\": " << latencies.percentile(0.5) << ", \"p90_us\": " << latencies.percentile(0.9) << ", \"p99_us\": " << latencies.percentile(0.99)
+             << ", \"p999_us\": " << latencies.percentile(0.999) << ", \"max_us\": " << latencies.maximum() << '}';
+    }
+    json << "}, \"servers\": {";
+    for (size_t i = 0; i < server_counts.size(); i++) {
+        json << (i ? ", " : "") << '"' << options.server_ports[i] << "\": {\"files\": " << server_counts[i].files << ", \"register\": "
+             << server_counts[i].completed[REGISTER] << ", \"search\": " << server_counts[i].completed[SEARCH] << '}';
+    }
+    json << "}}";
+    std::cout << json.str() << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import time
+
+# usage: python3 partition_benchmark.py [servers] [files] [seconds]
+# runs the indexing servers as separate local processes on their own ports and checks the partitioning from both sides:
+#   1. drives 1 up to servers servers with the load generator, whose simulated peers partition their files across
+#      the -P ports like real peers do, and reports the throughput and the share of files and requests each server got
+#   2. starts a real peer sharing files small files with all but the last server in its servers file, then adds the
+#      last server to the file and measures how many files the peer moved and how long the rebalance took, before a
+#      second peer batch searches every file through the new map to check none was lost
+# starts and stops its own servers and is run from evaluation/ like the other tools
+servers = int(sys.argv[1]) if len(sys.argv) > 1 else 3
+files = int(sys.argv[2]) if len(sys.argv) > 2 else 3000
+seconds = int(sys.argv[3]) if len(sys.argv) > 3 else 5
+
+os.chdir("../src/")
+base_port = 32000 # below the ephemeral range so outgoing connections never hold these ports
+ports = [base_port + i for i in range(servers)]
+peer_port = base_port + 100
+root = 'peers/partition/'
+shutil.rmtree(root, ignore_errors=True)
+
+
+def start_servers(count):
+    return [subprocess.Popen(['./indexing_server', '-p', str(port), '-s', '', '-q'], stdout=subprocess.DEVNULL) for port in ports[:count]]
+
+
+def stop(processes):
+    for process in processes:
+        process.terminate()
+        process.wait()
+
+
+def held_files(log_path):
+    # files each server holds, added up from the peer's sync lines
+    held = {}
+    with open(log_path) as f:
+        for line in f:
+            match = re.search(r'\[files synced\] server (\d+) generation \d+: \+(\d+) -(\d+)', line)
+            if match:
+                port = int(match.group(1))
+                held[port] = held.get(port, 0) + int(match.group(2)) - int(match.group(3))
+    return held
+
+
+def wait_for(condition, timeout=30):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if condition():
+            return True
+        time.sleep(0.1)
+    return False
+
+
+print('load generator, 100 peers on 2 threads for {}s each'.format(seconds))
+for count in range(1, servers + 1):
+    processes = start_servers(count)
+    time.sleep(0.3)
+    try:
+        output = subprocess.run(['./load_generator', '-p', '100', '-T', '2', '-d', str(seconds), '-P', ','.join(map(str, ports[:count]))],
+                                stdout=subprocess.PIPE, check=True).stdout
+    finally:
+        stop(processes)
+    result = json.loads(output)
+    total_files = sum(server['files'] for server in result['servers'].values())
+    total_requests = sum(server['register'] + server['search'] for server in result['servers'].values())
+    shares = ', '.join('{}: {:.0%} of files, {:.0%} of requests'.format(port, server['files'] / max(total_files, 1),
+                                                                       (server['register'] + server['search']) / max(total_requests, 1))
+                       for port, server in sorted(result['servers'].items()))
+    print('{} server(s): {} requests/s, {} errors ({})'.format(count, result['throughput'], result['errors'], shares))
+
+# a real peer whose servers file starts without the last server
+os.makedirs(root + 'sharer')
+os.makedirs(root + 'searcher')
+names = ['part-{}.txt'.format(i) for i in range(files)]
+for name in names:
+    with open(root + 'sharer/' + name, 'w') as f:
+        f.write(name)
+with open(root + 'names', 'w') as f:
+    f.write('\n'.join(names) + '\n')
+with open(root + 'servers', 'w') as f:
+    f.write(','.join(map(str, ports[:-1])) + '\n')
+
+processes = start_servers(servers)
+time.sleep(0.3)
+log_path = 'logs/peers/{}_client.log'.format(peer_port)
+if os.path.exists(log_path):
+    os.remove(log_path)
+sharer = subprocess.Popen(['./peer', '-i', '@' + root + 'servers', root + 'sharer', str(peer_port)], stdin=subprocess.PIPE, stdout=subprocess.DEVNULL)
+try:
+    if not wait_for(lambda: os.path.exists(log_path) and sum(held_files(log_path).values()) == files):
+        sys.exit('the peer never registered all {} files'.format(files))
+    before = held_files(log_path)
+
+    with open(root + 'servers', 'w') as f:
+        f.write(','.join(map(str, ports)) + '\n')
+    start = time.time()
+    # the peer checks its servers file every few seconds, then moves the files the new map puts on the new server
+    if not wait_for(lambda: held_files(log_path).get(ports[-1], 0) > 0):
+        sys.exit('the peer never registered files with the added server')
+    elapsed = time.time() - start
+    time.sleep(1)
+    after = held_files(log_path)
+
+    searcher = subprocess.run(['./peer', '-m', '0', '-i', '@' + root + 'servers', root + 'searcher', str(peer_port + 1)],
+                              input='b\n@{}names\nq\n'.format(root).encode(), stdout=subprocess.PIPE)
+    found = re.search(r'(\d+) of (\d+) file\(s\) found', searcher.stdout.decode())
+finally:
+    sharer.stdin.close()
+    sharer.wait()
+    stop(processes)
+
+moved = after.get(ports[-1], 0)
+print('\nrebalance of {} files from {} to {} servers'.format(files, servers - 1, servers))
+print('before: ' + ', '.join('{}: {}'.format(port, before.get(port, 0)) for port in ports))
+print('after:  ' + ', '.join('{}: {}'.format(port, after.get(port, 0)) for port in ports))
+print('moved {} files ({:.1%}, about {:.1%} expected) to the new server within {:.1f}s of the servers file changing'.format(
+    moved, moved / files, 1 / servers, elapsed))
+print('left on the old servers: {} of {}'.format(sum(after.get(port, 0) for port in ports[:-1]), files - moved))
+print('searched through the new map: {}'.format('{} of {} found'.format(found.group(1), found.group(2)) if found else 'no batch result'))
+shutil.rmtree(root, ignore_errors=True)
@@ -0,0 +1,95 @@
+import socket
+import struct
+import sys
+import time
+
+# usage: python3 search_throughput.py [searches] [window] [port]
+# compares stop-and-wait searches (one request in flight) with pipelined tagged searches
+# (up to window requests in flight) on a single binary protocol connection to the indexing server
+searches = int(sys.argv[1]) if len(sys.argv) > 1 else 20000
+window = int(sys.argv[2]) if len(sys.argv) > 2 else 64
+port = int(sys.argv[3]) if len(sys.argv) > 3 else 9999
+
+PROTOCOL_MAGIC = 0x32505043
+PROTOCOL_VERSION = 2
+OP_REGISTER = 1
+OP_SEARCH = 3
+OP_SEARCH_TAGGED = 8
+
+
+def varint(value):
+    out = b''
+    while value >= 0x80:
+        out += bytes([(value & 0x7f) | 0x80])
+        value >>= 7
+    return out + bytes([value])
+
+
+def frame(opcode, payload):
+    return varint(len(payload) + 1) + bytes([opcode]) + payload
+
+
+def string(value):
+    return varint(len(value)) + value
+
+
+class Reader:
+    def __init__(self, s):
+        self.s = s
+        self.buffer = b''
+
+    def next(self):
+        while True:
+            size, shift, pos = 0, 0, 0
+            while pos < len(self.buffer):
+                byte = self.buffer[pos]
+                pos += 1
+                size |= (byte & 0x7f) << shift
+                shift += 7
+                if not byte & 0x80:
+                    if len(self.buffer) - pos >= size:
+                        body = self.buffer[pos:pos + size]
+                        self.buffer = self.buffer[pos + size:]
+                        return body
+                    break
+            data = self.s.recv(65536)
+            if not data:
+                raise ConnectionError('server closed connection')
+            self.buffer += data
+
+
+def connect(client_id):
+    s = socket.create_connection(('localhost', port))
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    s.sendall(struct.pack('<IBi', PROTOCOL_MAGIC, PROTOCOL_VERSION, client_id))
+    assert s.recv(1) == bytes([PROTOCOL_VERSION])
+    return s
+
+
+s = connect(30000)
+reader = Reader(s)
+s.sendall(frame(OP_REGISTER, string(b'a.txt')))
+
+start = time.perf_counter()
+for _ in range(searches):
+    s.sendall(frame(OP_SEARCH, string(b'a.txt')))
+    reader.next()
+serial = searches / (time.perf_counter() - start)
+
+start = time.perf_counter()
+sent = received = 0
+while received < searches:
+    # keep the window full, sending every request that fits in one write
+    batch = b''
+    while sent < searches and sent - received < window:
+        batch += frame(OP_SEARCH_TAGGED, varint(sent) + string(b'a.txt'))
+        sent += 1
+    if batch:
+        s.sendall(batch)
+    reader.next()
+    received += 1
+pipelined = searches / (time.perf_counter() - start)
+
+print('serial: {:.0f} searches/s'.format(serial))
+print('pipelined (window {}): {:.0f} searches/s ({:.1f}x)'.format(window, pipelined, pipelined / serial))
+s.close()
@@ -0,0 +1,73 @@
+import os
+import re
+import shutil
+import subprocess
+import sys
+import time
+
+# usage: python3 swarm_benchmark.py [sources] [size MiB] [upload limit KiB/s]
+# starts sources peers on loopback that all share the same file, each with its upload capped at the given
+# limit (0 for no cap), then downloads the file once from a single peer with (r)etrieve and once from every
+# peer with s(w)arm retrieve, and compares the two from the downloading peers' evaluation log lines
+# each download goes into a directory of its own, since a peer that already holds the content skips the download
+# expects an indexing server to already be running and is run from evaluation/ like the other tools
+sources = int(sys.argv[1]) if len(sys.argv) > 1 else 4
+size = int(sys.argv[2]) if len(sys.argv) > 2 else 64
+upload_limit = int(sys.argv[3]) if len(sys.argv) > 3 else 8192
+
+os.chdir("../src/")
+root = 'peers/swarm/'
+base_port = 31000 # below the ephemeral range so outgoing connections never hold these ports
+shutil.rmtree(root, ignore_errors=True)
+os.makedirs(root + 'retrieve')
+os.makedirs(root + 'swarm')
+
+# every source shares one copy of the file through hard links
+with open(root + 'big.bin', 'wb') as f:
+    for _ in range(size):
+        f.write(os.urandom(1 << 20))
+peers = []
+for i in range(sources):
+    os.makedirs(root + 'p{}'.format(i))
+    os.link(root + 'big.bin', root + 'p{}/big.bin'.format(i))
+    cmd = ['./peer', '-u', str(upload_limit), root + 'p{}'.format(i), str(base_port + i)]
+    peers.append(subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.DEVNULL))
+time.sleep(1)
+
+downloads = {'retrieve': 'r\n{}\nbig.bin\nq\n'.format(base_port), 'swarm': 'w\nbig.bin\nq\n'}
+downloader_ports = {}
+output = ''
+try:
+    # one after the other, so the first downloader has quit and is not a source for the second
+    for i, (kind, commands) in enumerate(downloads.items()):
+        downloader_ports[kind] = base_port + sources + i
+        downloader = subprocess.run(['./peer', root + kind, str(downloader_ports[kind])], input=commands.encode(), stdout=subprocess.PIPE)
+        output += downloader.stdout.decode()
+finally:
+    # closing stdin quits a peer
+    for peer in peers:
+        peer.stdin.close()
+        peer.wait()
+
+# pair up the start and end lines of each request
+times = {}
+for port in downloader_ports.values():
+    with open('logs/peers/{}_client.log'.format(port)) as f:
+        for line in f:
+            match = re.match(r'!(\d+) \[(\d+)\] \[(\w+) request\] \[(\w+)\]', line)
+            if match:
+                times.setdefault(match.group(3), {})[match.group(4)] = int(match.group(2))
+
+print('{} source(s), {} MiB file, uploads {}'.format(sources, size, 'capped at {} KiB/s per peer'.format(upload_limit) if upload_limit else 'not capped'))
+for name, kind in (('single source', 'retrieve'), ('swarm', 'swarm')):
+    seconds = (times[kind]['end'] - times[kind]['start']) / 1e6
+    print('{}: {:.3f}s, {:.1f} MiB/s'.format(name, seconds, size / seconds))
+for line in output.splitlines():
+    if line.strip().startswith('peer ') and 'bytes' in line:
+        print(line.strip())
+
+for kind in downloads:
+    path = root + kind + '/big.bin'
+    ok = os.path.exists(path) and open(path, 'rb').read() == open(root + 'big.bin', 'rb').read()
+    print('{} big.bin: {}'.format(kind, 'matches' if ok else 'MISMATCH'))
+shutil.rmtree(root, ignore_errors=True)
@@ -0,0 +1,59 @@
+import os
+import re
+import shutil
+import subprocess
+import sys
+import time
+
+# usage: python3 transfer_benchmark.py [size MiB] [runs] [directory]
+# starts one peer sharing a file of the given size on loopback and (r)etrieves it from a second peer several
+# times for each receive path: splicing into the file, copying through a buffer (-c) and splicing with socket
+# buffers left to the kernel (-b 0). reports throughput from the downloading peer's evaluation log lines
+# files go to a tmpfs directory by default so disk writeback does not drown out the receive path
+# expects an indexing server to already be running and is run from evaluation/ like the other tools
+size = int(sys.argv[1]) if len(sys.argv) > 1 else 1024
+runs = int(sys.argv[2]) if len(sys.argv) > 2 else 3
+root = os.path.join(os.path.abspath(sys.argv[3]) if len(sys.argv) > 3 else '/dev/shm', 'transfer') + '/'
+
+os.chdir("../src/")
+base_port = 32000 # below the ephemeral range so outgoing connections never hold these ports
+shutil.rmtree(root, ignore_errors=True)
+os.makedirs(root + 'source')
+
+with open(root + 'source/big.bin', 'wb') as f:
+    block = os.urandom(1 << 20)
+    for _ in range(size):
+        f.write(block)
+
+modes = (('splice', []), ('copy', ['-c']), ('splice, kernel buffers', ['-b', '0']))
+source = subprocess.Popen(['./peer', root + 'source', str(base_port)], stdin=subprocess.PIPE, stdout=subprocess.DEVNULL)
+time.sleep(1)
+
+print('{} MiB file, {} run(s) per receive path'.format(size, runs))
+try:
+    for i, (name, args) in enumerate(modes):
+        port = base_port + 1 + i
+        directory = root + 'downloader{}'.format(i)
+        os.makedirs(directory)
+        # every run after the first overwrites big-origin-<port>.bin
+        commands = 'r\n{}\nbig.bin\n'.format(base_port) * runs + 'q\n'
+        subprocess.run(['./peer'] + args + [directory, str(port)], input=commands.encode(), stdout=subprocess.DEVNULL)
+
+        # pair up the start and end lines of each request
+        times = {}
+        with open('logs/peers/{}_client.log'.format(port)) as f:
+            for line in f:
+                match = re.match(r'!(\d+) \[(\d+)\] \[retrieve request\] \[(start|end)\]', line)
+                if match:
+                    times.setdefault(match.group(1), {})[match.group(3)] = int(match.group(2))
+        rates = sorted(size / ((run['end'] - run['start']) / 1e6) for run in times.values() if 'end' in run)
+        if not rates:
+            print('{}: no completed retrievals'.format(name))
+            continue
+        print('{}: best {:.0f} MiB/s, median {:.0f} MiB/s'.format(name, rates[-1], rates[len(rates) // 2]))
+        shutil.rmtree(directory, ignore_errors=True)
+finally:
+    # closing stdin quits a peer
+    source.stdin.close()
+    source.wait()
+shutil.rmtree(root, ignore_errors=True)
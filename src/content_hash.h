@@ -0,0 +1,142 @@
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <string>
+#include <vector>
+#include <functional>
+
+
+#define HASH_CHUNK_SIZE (1 << 20) // bytes of a file hashed on their own before the chunk hashes are combined
+
+
+// XXH64, which keeps four independent lanes in flight so the multiplies of one 32 byte stripe overlap
+namespace xxh64 {
+    const uint64_t P1 = 0x9E3779B185EBCA87ull;
+    const uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+    const uint64_t P3 = 0x165667B19E3779F9ull;
+    const uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+    const uint64_t P5 = 0x27D4EB2F165667C5ull;
+
+    inline uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    inline uint64_t read64(const char *p) {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline uint32_t read32(const char *p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    inline uint64_t round(uint64_t acc, uint64_t input) {
+        return rotl(acc + input * P2, 31) * P1;
+    }
+
+    inline uint64_t merge(uint64_t acc, uint64_t lane) {
+        return (acc ^ round(0, lane)) * P1 + P4;
+    }
+
+    inline uint64_t hash(const char *data, size_t size, uint64_t seed) {
+        const char *p = data;
+        const char *end = data + size;
+        uint64_t h;
+        if (size >= 32) {
+            uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+            for (; p + 32 <= end; p += 32) {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+            }
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+        }
+        else {
+            h = seed + P5;
+        }
+        h += size;
+        for (; p + 8 <= end; p += 8)
+            h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+        if (p + 4 <= end) {
+            h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+            p += 4;
+        }
+        for (; p < end; p++)
+            h = rotl(h ^ ((uint8_t)*p * P5), 11) * P1;
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        return h ^ (h >> 32);
+    }
+}
+
+
+// content hash of a file, built from chunks fed in order
+// every HASH_CHUNK_SIZE chunk is hashed on its own and the chunk hashes are then hashed together, seeded with the
+// file size, so a file streams through one chunk sized buffer and chunks could be hashed in any order
+// 0 is never produced, it stands for unknown content
+class ContentHasher {
+    private:
+        std::string chunk_hashes;
+        uint64_t size = 0;
+
+    public:
+        // add the next chunk, every chunk but the last must be HASH_CHUNK_SIZE bytes
+        void add(const char *data, size_t length) {
+            uint64_t chunk_hash = xxh64::hash(data, length, 0);
+            chunk_hashes.append((const char*)&chunk_hash, sizeof(chunk_hash));
+            size += length;
+        }
+
+        uint64_t finish() const {
+            uint64_t hash = xxh64::hash(chunk_hashes.data(), chunk_hashes.size(), size);
+            return hash ? hash : 1;
+        }
+};
+
+
+// hash everything readable from a file descriptor, returns false if reading failed
+// progress is called after every chunk, so a caller hashing a large file can still do its periodic work
+inline bool hash_file(int fd, uint64_t &hash, const std::function<void()> &progress=std::function<void()>()) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    std::vector<char> buffer(HASH_CHUNK_SIZE);
+    ContentHasher hasher;
+    off_t offset = 0;
+    while (1) {
+        // fill a whole chunk, reads may come back short
+        size_t filled = 0;
+        while (filled < buffer.size()) {
+            ssize_t n = pread(fd, buffer.data() + filled, buffer.size() - filled, offset + filled);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return false;
+            if (n == 0)
+                break;
+            filled += n;
+        }
+        if (filled > 0 || offset == 0)
+            hasher.add(buffer.data(), filled);
+        offset += filled;
+        if (filled < buffer.size())
+            break;
+        if (progress)
+            progress();
+    }
+    hash = hasher.finish();
+    return true;
+}
+
+#endif
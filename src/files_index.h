@@ -0,0 +1,578 @@
+#ifndef FILES_INDEX_H
+#define FILES_INDEX_H
+
+#include <stdint.h>
+
+#include <shared_mutex>
+#include <mutex>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <string_view>
+#include <stdexcept>
+
+#include "latency_histogram.h"
+#include "name_arena.h"
+#include "name_trie.h"
+
+
+#define FILES_INDEX_SHARDS 64 // default number of independently locked shards
+#define HOLDERS_INLINE 2 // peers an index entry holds before spilling them to the heap
+#define MATCH_SCAN_LIMIT 65536 // names a prefix or glob match looks at before returning a partial page
+
+
+// mapping between a filename and any peers associated with it
+// filenames are hashed onto shards that each have their own reader-writer lock, so searches only
+// wait on writers touching the same shard and never on each other
+// within a shard every filename is interned once in an arena and known by a 32-bit entry id, entries keep
+// their first few holders inline, and an open addressing table maps filename hashes to entry ids. this
+// keeps a file with one or two peers to a few dozen bytes instead of several separate allocations
+// every peer of a file also has the content hash it registered, 0 if unknown. the entry keeps the hash most
+// of its peers agree on and a shard only remembers the hashes of peers that registered something else
+// each shard also keeps the reverse mapping from a client id to the entries it registered there,
+// so dropping a peer only touches that peer's own entries
+// every indexed filename is also kept in a radix tree for prefix and glob matching. it only changes when a
+// file gains its first or loses its last peer, under the shard lock and then its own lock
+class FilesIndex {
+    private:
+        static const uint32_t NONE = UINT32_MAX;
+
+        struct Entry {
+            uint32_t name; // arena offset of the length prefixed filename, or the next free entry once freed
+            uint32_t count; // number of peers, 0 for a free entry
+            uint64_t hash; // content hash of every peer not listed in the shard's other_hashes
+            union {
+                int held[HOLDERS_INLINE]; // the peers while there are at most HOLDERS_INLINE of them
+                int *spilled; // beyond that, a heap block holding its capacity and then the peers
+            };
+        };
+
+        struct Slot {
+            uint32_t hash;
+            uint32_t entry; // NONE for an empty slot
+        };
+
+        struct ClientFiles {
+            std::vector<uint32_t> entries; // entries the client registered, some may since have been left or reused
+            uint32_t count = 0; // entries the client still holds
+        };
+
+        struct alignas(64) Shard {
+            std::shared_mutex m;
+            NameArena names;
+            std::vector<Entry> entries;
+            uint32_t free_entries = NONE; // chain of freed entries through their name
+            std::vector<Slot> slots; // entry ids by filename hash with linear probing, a power of two long
+            size_t files = 0;
+            std::unordered_map<int, ClientFiles> client_files;
+            std::unordered_map<uint64_t, uint64_t> other_hashes; // content hashes that differ from their entry's by holder_key
+
+            ~Shard() {
+                for (auto &&entry : entries)
+                    if (entry.count > HOLDERS_INLINE)
+                        delete[] entry.spilled;
+            }
+        };
+
+        std::vector<std::unique_ptr<Shard>> shards;
+        NameTrie names; // every filename in files, in order
+        std::shared_mutex names_m;
+        LatencyHistogram lock_waits; // nanoseconds spent waiting on shard or name locks held by another thread
+
+        // take a shard lock, only timing the wait when it is contended so the common case stays free
+        template<typename Guard>
+        void lock_shard(Guard &guard) {
+            if (guard.try_lock())
+                return;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            guard.lock();
+            lock_waits.record_since(start);
+        }
+
+        static size_t name_hash(std::string_view filename) {
+            return std::hash<std::string_view>()(filename);
+        }
+
+        // bits of a filename's hash used within its shard, the low bits already picked the shard
+        static uint32_t slot_hash(size_t hash) {
+            return (hash * 0x9E3779B97F4A7C15ull) >> 32;
+        }
+
+        Shard &shard_for(size_t hash) {
+            return *shards[hash % shards.size()];
+        }
+
+        static std::string_view entry_name(const Shard &shard, const Entry &entry) {
+            const unsigned char *bytes = (const unsigned char*)shard.names.at(entry.name);
+            size_t length = 0;
+            int shift = 0;
+            while (*bytes & 0x80) {
+                length |= (size_t)(*bytes++ & 0x7F) << shift;
+                shift += 7;
+            }
+            length |= (size_t)*bytes++ << shift;
+            return std::string_view((const char*)bytes, length);
+        }
+
+        // store a filename in the shard's arena behind a varint length
+        static uint32_t intern(NameArena &names, std::string_view filename) {
+            char prefix[10];
+            size_t prefix_size = 0;
+            for (size_t length = filename.size(); ; length >>= 7) {
+                prefix[prefix_size++] = (length & 0x7F) | (length >= 0x80 ? 0x80 : 0);
+                if (length < 0x80)
+                    break;
+            }
+            char *bytes;
+            uint32_t offset = names.allocate(prefix_size + filename.size(), bytes);
+            std::copy(prefix, prefix + prefix_size, bytes);
+            std::copy(filename.begin(), filename.end(), bytes + prefix_size);
+            return offset;
+        }
+
+        static const int *holders(const Entry &entry) {
+            return entry.count > HOLDERS_INLINE ? entry.spilled + 1 : entry.held;
+        }
+
+        static std::vector<int> holder_list(const Entry &entry) {
+            return std::vector<int>(holders(entry), holders(entry) + entry.count);
+        }
+
+        // returns false if the client id already holds the entry, peers stay in the order they were added
+        static bool add_peer(Entry &entry, int client_id) {
+            const int *current = holders(entry);
+            if (std::find(current, current + entry.count, client_id) != current + entry.count)
+                return false;
+            if (entry.count < HOLDERS_INLINE) {
+                entry.held[entry.count++] = client_id;
+                return true;
+            }
+            if (entry.count == HOLDERS_INLINE || (uint32_t)entry.spilled[0] == entry.count) {
+                uint32_t capacity = entry.count * 2;
+                int *spilled = new int[capacity + 1];
+                spilled[0] = capacity;
+                std::copy(current, current + entry.count, spilled + 1);
+                if (entry.count > HOLDERS_INLINE)
+                    delete[] entry.spilled;
+                entry.spilled = spilled;
+            }
+            entry.spilled[1 + entry.count++] = client_id;
+            return true;
+        }
+
+        // returns false if the client id did not hold the entry
+        static bool remove_peer(Entry &entry, int client_id) {
+            int *current = entry.count > HOLDERS_INLINE ? entry.spilled + 1 : entry.held;
+            int *end = current + entry.count;
+            int *position = std::find(current, end, client_id);
+            if (position == end)
+                return false;
+            std::copy(position + 1, end, position);
+            if (--entry.count == HOLDERS_INLINE) {
+                int *spilled = entry.spilled;
+                std::copy(spilled + 1, spilled + 1 + HOLDERS_INLINE, entry.held);
+                delete[] spilled;
+            }
+            return true;
+        }
+
+        static uint64_t holder_key(uint32_t id, int client_id) {
+            return (uint64_t)id << 32 | (uint32_t)client_id;
+        }
+
+        // record the content hash a peer of an entry registered
+        static void set_hash(Shard &shard, uint32_t id, int client_id, uint64_t hash) {
+            Entry &entry = shard.entries[id];
+            if (entry.count == 1)
+                entry.hash = hash;
+            if (hash != entry.hash)
+                shard.other_hashes[holder_key(id, client_id)] = hash;
+            else if (!shard.other_hashes.empty())
+                shard.other_hashes.erase(holder_key(id, client_id));
+        }
+
+        // content hash of each peer of an entry, in the same order as its holders
+        static std::vector<uint64_t> holder_hashes(const Shard &shard, uint32_t id) {
+            const Entry &entry = shard.entries[id];
+            std::vector<uint64_t> hashes(entry.count, entry.hash);
+            if (!shard.other_hashes.empty()) {
+                for (uint32_t i = 0; i < entry.count; i++) {
+                    auto other = shard.other_hashes.find(holder_key(id, holders(entry)[i]));
+                    if (other != shard.other_hashes.end())
+                        hashes[i] = other->second;
+                }
+            }
+            return hashes;
+        }
+
+        // remove a peer from an entry along with any hash it registered, returns false if it was not a peer
+        // if every peer left registered other content than the entry's hash, the first of them sets a new one
+        static bool release_holder(Shard &shard, uint32_t id, int client_id) {
+            Entry &entry = shard.entries[id];
+            if (!remove_peer(entry, client_id))
+                return false;
+            if (shard.other_hashes.empty())
+                return true;
+            shard.other_hashes.erase(holder_key(id, client_id));
+            const int *current = holders(entry);
+            for (uint32_t i = 0; i < entry.count; i++) {
+                if (!shard.other_hashes.count(holder_key(id, current[i])))
+                    return true;
+            }
+            if (entry.count == 0)
+                return true;
+            entry.hash = shard.other_hashes[holder_key(id, current[0])];
+            for (uint32_t i = 0; i < entry.count; i++) {
+                auto other = shard.other_hashes.find(holder_key(id, current[i]));
+                if (other->second == entry.hash)
+                    shard.other_hashes.erase(other);
+            }
+            return true;
+        }
+
+        // entry id of a filename in a shard, NONE if it is not indexed
+        static uint32_t find_entry(const Shard &shard, std::string_view filename, uint32_t hash) {
+            if (shard.slots.empty())
+                return NONE;
+            size_t mask = shard.slots.size() - 1;
+            for (size_t i = hash & mask; shard.slots[i].entry != NONE; i = (i + 1) & mask) {
+                const Slot &slot = shard.slots[i];
+                if (slot.hash == hash && entry_name(shard, shard.entries[slot.entry]) == filename)
+                    return slot.entry;
+            }
+            return NONE;
+        }
+
+        static void insert_slot(std::vector<Slot> &slots, Slot slot) {
+            size_t mask = slots.size() - 1;
+            size_t i = slot.hash & mask;
+            while (slots[i].entry != NONE)
+                i = (i + 1) & mask;
+            slots[i] = slot;
+        }
+
+        // add an entry without holders for a filename that is not indexed yet
+        static uint32_t create_entry(Shard &shard, std::string_view filename, uint32_t hash) {
+            // keep the table at most three quarters full
+            if ((shard.files + 1) * 4 > shard.slots.size() * 3) {
+                std::vector<Slot> slots(std::max<size_t>(16, shard.slots.size() * 2), Slot{0, NONE});
+                for (auto &&slot : shard.slots)
+                    if (slot.entry != NONE)
+                        insert_slot(slots, slot);
+                shard.slots.swap(slots);
+            }
+
+            uint32_t id = shard.free_entries;
+            if (id != NONE) {
+                shard.free_entries = shard.entries[id].name;
+            }
+            else {
+                if (shard.entries.size() >= NONE)
+                    throw std::length_error("files index shard full");
+                id = shard.entries.size();
+                shard.entries.emplace_back();
+            }
+            shard.entries[id].name = intern(shard.names, filename);
+            shard.entries[id].count = 0;
+            shard.entries[id].hash = 0;
+            insert_slot(shard.slots, Slot{hash, id});
+            shard.files++;
+            return id;
+        }
+
+        // drop an entry that lost its last holder, its filename is added to erased so it can be dropped from names
+        static void erase_entry(Shard &shard, uint32_t id, std::vector<std::string> &erased) {
+            Entry &entry = shard.entries[id];
+            std::string_view filename = entry_name(shard, entry);
+            erased.emplace_back(filename);
+            shard.names.release(filename.data() + filename.size() - shard.names.at(entry.name));
+
+            // backward shift deletion, so lookups never need tombstones
+            size_t mask = shard.slots.size() - 1;
+            size_t i = slot_hash(name_hash(filename)) & mask;
+            while (shard.slots[i].entry != id)
+                i = (i + 1) & mask;
+            for (size_t j = (i + 1) & mask; shard.slots[j].entry != NONE; j = (j + 1) & mask) {
+                // a slot may move back into the hole as long as that is not before where it hashes to
+                if (((j - (shard.slots[j].hash & mask)) & mask) >= ((j - i) & mask)) {
+                    shard.slots[i] = shard.slots[j];
+                    i = j;
+                }
+            }
+            shard.slots[i].entry = NONE;
+
+            entry.name = shard.free_entries;
+            shard.free_entries = id;
+            shard.files--;
+        }
+
+        // copy the filenames still indexed into a fresh arena once most of the old one was released
+        static void repack_names(Shard &shard) {
+            if (!shard.names.fragmented())
+                return;
+            NameArena packed;
+            for (auto &&entry : shard.entries)
+                if (entry.count > 0)
+                    entry.name = intern(packed, entry_name(shard, entry));
+            shard.names = std::move(packed);
+        }
+
+        // add peer's client id and content hash to a file in a shard, the filename is added to created if the file is new
+        // a peer that already has the file only has its content hash updated
+        static void add_holder(Shard &shard, const std::string &filename, int client_id, uint64_t content_hash, std::vector<std::string> &created) {
+            uint32_t hash = slot_hash(name_hash(filename));
+            uint32_t id = find_entry(shard, filename, hash);
+            if (id == NONE) {
+                id = create_entry(shard, filename, hash);
+                created.push_back(filename);
+            }
+            bool added = add_peer(shard.entries[id], client_id);
+            set_hash(shard, id, client_id, content_hash);
+            if (!added)
+                return;
+            ClientFiles &client_files = shard.client_files[client_id];
+            client_files.entries.push_back(id);
+            client_files.count++;
+        }
+
+        // remove peer's client id from a file in a shard, erasing the file once no peers are left
+        static void drop_holder(Shard &shard, const std::string &filename, int client_id, std::vector<std::string> &erased) {
+            uint32_t id = find_entry(shard, filename, slot_hash(name_hash(filename)));
+            if (id == NONE || !release_holder(shard, id, client_id))
+                return;
+            if (shard.entries[id].count == 0)
+                erase_entry(shard, id, erased);
+
+            auto client_files = shard.client_files.find(client_id);
+            if (client_files == shard.client_files.end())
+                return;
+            if (--client_files->second.count == 0) {
+                shard.client_files.erase(client_files);
+                return;
+            }
+            // entries left behind are only skipped over, so prune them before they outnumber the live ones
+            std::vector<uint32_t> &entries = client_files->second.entries;
+            if (entries.size() > 2 * client_files->second.count + 16) {
+                entries.erase(std::remove_if(entries.begin(), entries.end(), [&shard, client_id](uint32_t id) {
+                    const Entry &entry = shard.entries[id];
+                    return entry.count == 0 || std::find(holders(entry), holders(entry) + entry.count, client_id) == holders(entry) + entry.count;
+                }), entries.end());
+                std::sort(entries.begin(), entries.end());
+                entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+            }
+        }
+
+        // bring names in line with files created or erased under a shard lock that is still held
+        void update_names(const std::vector<std::string> &created, const std::vector<std::string> &erased) {
+            if (created.empty() && erased.empty())
+                return;
+            std::unique_lock<std::shared_mutex> guard(names_m, std::defer_lock);
+            lock_shard(guard);
+            for (auto &&filename : created)
+                names.insert(filename);
+            for (auto &&filename : erased)
+                names.erase(filename);
+        }
+
+        // group filenames by shard and apply update to each while holding that shard's write lock once
+        // update records the files it created or erased, which are applied to names before the shard is unlocked
+        // update is given the index of each filename
+        void for_each_shard(const std::vector<std::string> &filenames,
+                            const std::function<void(Shard&, size_t, std::vector<std::string>&, std::vector<std::string>&)> &update) {
+            std::vector<std::vector<size_t>> by_shard(shards.size());
+            for (size_t i = 0; i < filenames.size(); i++)
+                by_shard[name_hash(filenames[i]) % shards.size()].push_back(i);
+
+            for (size_t i = 0; i < shards.size(); i++) {
+                if (by_shard[i].empty())
+                    continue;
+                std::unique_lock<std::shared_mutex> guard(shards[i]->m, std::defer_lock);
+                lock_shard(guard);
+                std::vector<std::string> created, erased;
+                for (auto &&index : by_shard[i])
+                    update(*shards[i], index, created, erased);
+                repack_names(*shards[i]);
+                update_names(created, erased);
+            }
+        }
+
+    public:
+        FilesIndex(size_t num_shards=FILES_INDEX_SHARDS) {
+            for (size_t i = 0; i < std::max<size_t>(num_shards, 1); i++)
+                shards.emplace_back(new Shard);
+        }
+
+        // add peer's client id to a file if not already included, or update the content hash it registered
+        void add(const std::string &filename, int client_id, uint64_t content_hash=0) {
+            Shard &shard = shard_for(name_hash(filename));
+            std::unique_lock<std::shared_mutex> guard(shard.m, std::defer_lock);
+            lock_shard(guard);
+            std::vector<std::string> created;
+            add_holder(shard, filename, client_id, content_hash, created);
+            update_names(created, std::vector<std::string>());
+        }
+
+        // add peer's client id to many files, taking each shard's lock once
+        // content hashes line up with filenames, files past the end of them get 0
+        void add_many(const std::vector<std::string> &filenames, int client_id, const std::vector<uint64_t> &content_hashes=std::vector<uint64_t>()) {
+            for_each_shard(filenames, [&filenames, client_id, &content_hashes](Shard &shard, size_t i, std::vector<std::string> &created, std::vector<std::string>&) {
+                add_holder(shard, filenames[i], client_id, i < content_hashes.size() ? content_hashes[i] : 0, created);
+            });
+        }
+
+        // remove peer's client id from a file, dropping the file once no peers are left
+        void remove(const std::string &filename, int client_id) {
+            Shard &shard = shard_for(name_hash(filename));
+            std::unique_lock<std::shared_mutex> guard(shard.m, std::defer_lock);
+            lock_shard(guard);
+            std::vector<std::string> erased;
+            drop_holder(shard, filename, client_id, erased);
+            repack_names(shard);
+            update_names(std::vector<std::string>(), erased);
+        }
+
+        // remove peer's client id from many files, taking each shard's lock once
+        void remove_many(const std::vector<std::string> &filenames, int client_id) {
+            for_each_shard(filenames, [&filenames, client_id](Shard &shard, size_t i, std::vector<std::string>&, std::vector<std::string> &erased) {
+                drop_holder(shard, filenames[i], client_id, erased);
+            });
+        }
+
+        // remove client id from all of its files, one shard at a time
+        // the names of those files are added to removed if it is given
+        void remove_client(int client_id, std::vector<std::string> *removed=nullptr) {
+            for (auto &&shard : shards) {
+                std::unique_lock<std::shared_mutex> guard(shard->m, std::defer_lock);
+                lock_shard(guard);
+                auto client_files = shard->client_files.find(client_id);
+                if (client_files == shard->client_files.end())
+                    continue;
+                std::vector<std::string> erased;
+                // entries the client already left either no longer list it or were freed
+                for (auto &&id : client_files->second.entries) {
+                    if (shard->entries[id].count == 0 || !release_holder(*shard, id, client_id))
+                        continue;
+                    if (removed)
+                        removed->emplace_back(entry_name(*shard, shard->entries[id]));
+                    if (shard->entries[id].count == 0)
+                        erase_entry(*shard, id, erased);
+                }
+                shard->client_files.erase(client_files);
+                repack_names(*shard);
+                update_names(std::vector<std::string>(), erased);
+            }
+        }
+
+        // number of files registered by a client id
+        size_t client_files_count(int client_id) {
+            size_t count = 0;
+            for (auto &&shard : shards) {
+                std::shared_lock<std::shared_mutex> guard(shard->m, std::defer_lock);
+                lock_shard(guard);
+                auto client_files = shard->client_files.find(client_id);
+                if (client_files != shard->client_files.end())
+                    count += client_files->second.count;
+            }
+            return count;
+        }
+
+        // returns all client ids mapped to a filename, empty if the file is not indexed
+        std::vector<int> find(const std::string &filename) {
+            size_t hash = name_hash(filename);
+            Shard &shard = shard_for(hash);
+            std::shared_lock<std::shared_mutex> guard(shard.m, std::defer_lock);
+            lock_shard(guard);
+            uint32_t id = find_entry(shard, filename, slot_hash(hash));
+            if (id == NONE)
+                return std::vector<int>();
+            return holder_list(shard.entries[id]);
+        }
+
+        // client ids mapped to a filename along with the content hash each of them registered
+        std::vector<int> find(const std::string &filename, std::vector<uint64_t> &content_hashes) {
+            size_t hash = name_hash(filename);
+            Shard &shard = shard_for(hash);
+            std::shared_lock<std::shared_mutex> guard(shard.m, std::defer_lock);
+            lock_shard(guard);
+            uint32_t id = find_entry(shard, filename, slot_hash(hash));
+            if (id == NONE) {
+                content_hashes.clear();
+                return std::vector<int>();
+            }
+            content_hashes = holder_hashes(shard, id);
+            return holder_list(shard.entries[id]);
+        }
+
+        // client ids for many filenames at once, taking each shard's read lock once
+        // results line up with filenames, with an empty list for each file that is not indexed
+        std::vector<std::vector<int>> find_many(const std::vector<std::string> &filenames) {
+            std::vector<std::vector<std::pair<size_t, uint32_t>>> by_shard(shards.size()); // index in filenames and slot hash
+            for (size_t i = 0; i < filenames.size(); i++) {
+                size_t hash = name_hash(filenames[i]);
+                by_shard[hash % shards.size()].emplace_back(i, slot_hash(hash));
+            }
+
+            std::vector<std::vector<int>> results(filenames.size());
+            for (size_t i = 0; i < shards.size(); i++) {
+                if (by_shard[i].empty())
+                    continue;
+                std::shared_lock<std::shared_mutex> guard(shards[i]->m, std::defer_lock);
+                lock_shard(guard);
+                for (auto &&file : by_shard[i]) {
+                    uint32_t id = find_entry(*shards[i], filenames[file.first], file.second);
+                    if (id != NONE)
+                        results[file.first] = holder_list(shards[i]->entries[id]);
+                }
+            }
+            return results;
+        }
+
+        // collect filenames in order that start with pattern, or match it as a glob, and sort after the name
+        // given as after, stopping at limit names or after looking at MATCH_SCAN_LIMIT names
+        // returns the name to pass as after for the next page, empty once there are no more
+        std::string match(const std::string &pattern, bool glob, const std::string &after, size_t limit, std::vector<std::string> &matched) {
+            std::shared_lock<std::shared_mutex> guard(names_m, std::defer_lock);
+            lock_shard(guard);
+            if (!glob)
+                return names.scan(pattern, after, limit, MATCH_SCAN_LIMIT, [](const std::string&) { return true; }, matched);
+            return names.scan(glob_prefix(pattern), after, limit, MATCH_SCAN_LIMIT, [&pattern](const std::string &filename) {
+                return glob_match(pattern, filename);
+            }, matched);
+        }
+
+        // number of indexed files and of (file, peer) entries across all shards
+        void size(size_t &files, size_t &entries) {
+            files = entries = 0;
+            for (auto &&shard : shards) {
+                std::shared_lock<std::shared_mutex> guard(shard->m, std::defer_lock);
+                lock_shard(guard);
+                files += shard->files;
+                for (auto const &client_files : shard->client_files)
+                    entries += client_files.second.count;
+            }
+        }
+
+        // time spent waiting on contended shard locks
+        const LatencyHistogram &lock_wait_histogram() const {
+            return lock_waits;
+        }
+
+        // visit every file with its client ids and their content hashes, holding each shard's read lock while it is visited
+        void for_each(const std::function<void(const std::string&, const std::vector<int>&, const std::vector<uint64_t>&)> &visit) {
+            for (auto &&shard : shards) {
+                std::shared_lock<std::shared_mutex> guard(shard->m, std::defer_lock);
+                lock_shard(guard);
+                for (uint32_t id = 0; id < shard->entries.size(); id++) {
+                    const Entry &entry = shard->entries[id];
+                    if (entry.count > 0)
+                        visit(std::string(entry_name(*shard, entry)), holder_list(entry), holder_hashes(*shard, id));
+                }
+            }
+        }
+};
+
+#endif
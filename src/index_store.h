@@ -0,0 +1,317 @@
+#ifndef INDEX_STORE_H
+#define INDEX_STORE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#include "files_index.h"
+#include "protocol.h"
+
+
+#define SNAPSHOT_MAGIC "PA1INDX2" // 8 byte header identifying a snapshot file
+#define SNAPSHOT_MAGIC_V1 "PA1INDX1" // snapshots written before content hashes were kept, still loaded
+#define STORE_FLUSH_SIZE 65536 // operation log bytes buffered before forcing a write
+
+
+// persistence for the files index so a restarted indexing server can answer searches right away
+//
+// the index is written out periodically as a compact snapshot and every change made in between is
+// appended to an operation log. operations set membership of a (filename, client id) pair outright,
+// so replaying them on top of a snapshot taken while they were happening gives the same final index
+//
+// snapshot: [SNAPSHOT_MAGIC][varint file count] then per file [string filename][peer id list][content hash list]
+// operation log: [op (1 byte)][varint client id][string filename], filename left empty for LOG_REMOVE_CLIENT
+// and followed by the 8 byte content hash for LOG_ADD_HASHED
+class IndexStore {
+    private:
+        enum LogOp : uint8_t {LOG_ADD = 1, LOG_REMOVE = 2, LOG_REMOVE_CLIENT = 3, LOG_ADD_HASHED = 4};
+
+        std::string snapshot_path;
+        std::string log_path;
+        std::string old_log_path; // log being folded into a snapshot that is still being written
+        int log_fd = -1;
+        std::string pending; // operations not yet written to the log
+
+        std::mutex log_m;
+
+        void append(LogOp op, int client_id, const std::string &filename, uint64_t content_hash=0) {
+            std::lock_guard<std::mutex> guard(log_m);
+            if (log_fd < 0)
+                return;
+            pending += (char)op;
+            put_varint(pending, (uint32_t)client_id);
+            put_string(pending, filename);
+            for (int i = 0; op == LOG_ADD_HASHED && i < 8; i++)
+                pending += (char)(content_hash >> (8 * i));
+            if (pending.size() >= STORE_FLUSH_SIZE)
+                write_pending();
+        }
+
+        // write buffered operations to the log, log_m must be held
+        bool write_pending() {
+            size_t written = 0;
+            while (written < pending.size()) {
+                ssize_t n = write(log_fd, pending.data() + written, pending.size() - written);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                written += n;
+            }
+            pending.erase(0, written);
+            return pending.empty();
+        }
+
+        // map a file into memory read-only, size is 0 if it does not exist or is empty
+        static const char *map_file(const std::string &path, size_t &size) {
+            size = 0;
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return nullptr;
+            struct stat file_stat;
+            const char *data = nullptr;
+            if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+                void *mapped = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapped != MAP_FAILED) {
+                    data = static_cast<const char*>(mapped);
+                    size = file_stat.st_size;
+                    madvise(mapped, size, MADV_SEQUENTIAL);
+                }
+            }
+            close(fd);
+            return data;
+        }
+
+        // replay an operation log onto the index, a torn record at the end of the log is ignored and cut off,
+        // so operations appended after it later are not lost behind it
+        static size_t replay_log(const std::string &path, FilesIndex &files_index, std::unordered_set<int> &clients) {
+            size_t size, replayed = 0;
+            const char *data = map_file(path, size);
+            if (!data)
+                return 0;
+            const char *complete = data;
+
+            const char *pos = data;
+            const char *end = data + size;
+            uint64_t client_id, content_hash;
+            std::string filename;
+            while (pos < end) {
+                uint8_t op = *pos++;
+                if (!get_varint(pos, end, client_id) || !get_string(pos, end, filename))
+                    break;
+                if (op == LOG_ADD || op == LOG_ADD_HASHED) {
+                    content_hash = 0;
+                    if (op == LOG_ADD_HASHED) {
+                        if (end - pos < 8)
+                            break;
+                        for (int i = 0; i < 8; i++)
+                            content_hash |= (uint64_t)(uint8_t)*pos++ << (8 * i);
+                    }
+                    files_index.add(filename, client_id, content_hash);
+                    clients.insert(client_id);
+                }
+                else if (op == LOG_REMOVE) {
+                    files_index.remove(filename, client_id);
+                }
+                else if (op == LOG_REMOVE_CLIENT) {
+                    files_index.remove_client(client_id);
+                }
+                replayed++;
+                complete = pos;
+            }
+            size_t valid = complete - data;
+            munmap((void*)data, size);
+            if (valid < size)
+                while (truncate(path.c_str(), valid) < 0 && errno == EINTR) {}
+            return replayed;
+        }
+
+        // append a whole file to another and sync it, the destination is cut back to its old size if anything fails
+        static bool append_file(const std::string &from_path, const std::string &to_path) {
+            int from_fd = open(from_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (from_fd < 0)
+                return errno == ENOENT;
+            int to_fd = open(to_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+            if (to_fd < 0) {
+                close(from_fd);
+                return false;
+            }
+            struct stat to_stat;
+            bool copied = fstat(to_fd, &to_stat) == 0;
+            char buffer[STORE_FLUSH_SIZE];
+            while (copied) {
+                ssize_t n = read(from_fd, buffer, sizeof(buffer));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    copied = n == 0;
+                    break;
+                }
+                for (ssize_t written = 0; copied && written < n;) {
+                    ssize_t w = write(to_fd, buffer + written, n - written);
+                    if (w < 0 && errno == EINTR)
+                        continue;
+                    copied = w > 0;
+                    written += std::max<ssize_t>(w, 0);
+                }
+            }
+            copied = copied && fsync(to_fd) == 0;
+            // a partial copy would leave a torn record in the middle of the log
+            if (!copied)
+                while (ftruncate(to_fd, to_stat.st_size) < 0 && errno == EINTR) {}
+            close(from_fd);
+            close(to_fd);
+            return copied;
+        }
+
+        // make renames and unlinks in the directory holding path durable
+        static bool sync_directory(const std::string &path) {
+            size_t slash = path.rfind('/');
+            std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+            int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0)
+                return false;
+            bool synced = fsync(fd) == 0;
+            close(fd);
+            return synced;
+        }
+
+        // move the current log aside for a snapshot, log_m must be held
+        // a log still there from a snapshot that never finished holds operations no snapshot covers yet, so the current log
+        // is added to its end instead of replacing it
+        bool rotate_log() {
+            struct stat old_stat;
+            if (stat(old_log_path.c_str(), &old_stat) == 0) {
+                if (!append_file(log_path, old_log_path))
+                    return false;
+                return unlink(log_path.c_str()) == 0 || errno == ENOENT;
+            }
+            return rename(log_path.c_str(), old_log_path.c_str()) == 0 || errno == ENOENT;
+        }
+
+    public:
+        IndexStore(std::string path) : snapshot_path(path), log_path(path + ".log"), old_log_path(path + ".log.old") {}
+
+        // rebuild the index from the last snapshot and any logged operations after it
+        // every client id found is added to clients, returns the number of files loaded from the snapshot
+        size_t load(FilesIndex &files_index, std::unordered_set<int> &clients, size_t &replayed) {
+            size_t size, loaded = 0;
+            const char *data = map_file(snapshot_path, size);
+            bool hashed = data && size >= strlen(SNAPSHOT_MAGIC) && memcmp(data, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) == 0;
+            if (hashed || (data && size >= strlen(SNAPSHOT_MAGIC_V1) && memcmp(data, SNAPSHOT_MAGIC_V1, strlen(SNAPSHOT_MAGIC_V1)) == 0)) {
+                const char *pos = data + strlen(SNAPSHOT_MAGIC);
+                const char *end = data + size;
+                uint64_t count;
+                std::string filename;
+                std::vector<int> client_ids;
+                std::vector<uint64_t> content_hashes;
+                if (get_varint(pos, end, count)) {
+                    for (; loaded < count; loaded++) {
+                        if (!get_string(pos, end, filename) || !get_ids(pos, end, client_ids) || (hashed && !get_hashes(pos, end, content_hashes)))
+                            break;
+                        for (size_t i = 0; i < client_ids.size(); i++) {
+                            files_index.add(filename, client_ids[i], i < content_hashes.size() ? content_hashes[i] : 0);
+                            clients.insert(client_ids[i]);
+                        }
+                    }
+                }
+            }
+            if (data)
+                munmap((void*)data, size);
+
+            // a log left over from an interrupted snapshot comes before the current log
+            replayed = replay_log(old_log_path, files_index, clients);
+            replayed += replay_log(log_path, files_index, clients);
+            return loaded;
+        }
+
+        // start appending operations to the log
+        bool open_log() {
+            std::lock_guard<std::mutex> guard(log_m);
+            log_fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            return log_fd >= 0;
+        }
+
+        void log_add(const std::string &filename, int client_id, uint64_t content_hash=0) {
+            append(content_hash ? LOG_ADD_HASHED : LOG_ADD, client_id, filename, content_hash);
+        }
+
+        void log_remove(const std::string &filename, int client_id) {
+            append(LOG_REMOVE, client_id, filename);
+        }
+
+        void log_remove_client(int client_id) {
+            append(LOG_REMOVE_CLIENT, client_id, std::string());
+        }
+
+        // write out operations buffered since the last flush
+        bool flush() {
+            std::lock_guard<std::mutex> guard(log_m);
+            if (log_fd < 0 || pending.empty())
+                return true;
+            return write_pending();
+        }
+
+        // write a fresh snapshot of the index and drop the operations it covers
+        // the log is swapped for an empty one first, so changes made while the snapshot is written are logged
+        // to the new log and replayed on top of it after a restart
+        bool snapshot(FilesIndex &files_index) {
+            {
+                std::lock_guard<std::mutex> guard(log_m);
+                if (log_fd < 0)
+                    return false;
+                write_pending();
+                close(log_fd);
+                bool rotated = rotate_log();
+                // if the log could not be moved aside it is simply appended to again
+                log_fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                if (!rotated || log_fd < 0)
+                    return false;
+            }
+
+            std::string body;
+            uint64_t count = 0;
+            files_index.for_each([&body, &count](const std::string &filename, const std::vector<int> &client_ids, const std::vector<uint64_t> &content_hashes) {
+                put_string(body, filename);
+                put_ids(body, client_ids);
+                put_hashes(body, content_hashes);
+                count++;
+            });
+
+            std::string header = SNAPSHOT_MAGIC;
+            put_varint(header, count);
+
+            // write to a temporary file and rename it over the old snapshot so a crash never leaves a partial one
+            std::string tmp_path = snapshot_path + ".tmp";
+            FILE *file = fopen(tmp_path.c_str(), "w");
+            if (file == NULL)
+                return false;
+            bool written = fwrite(header.data(), 1, header.size(), file) == header.size() &&
+                           fwrite(body.data(), 1, body.size(), file) == body.size() &&
+                           fflush(file) == 0 && fsync(fileno(file)) == 0;
+            fclose(file);
+            if (!written || rename(tmp_path.c_str(), snapshot_path.c_str()) < 0 || !sync_directory(snapshot_path))
+                return false;
+
+            // only dropped once the snapshot covering it is on disk
+            unlink(old_log_path.c_str());
+            return true;
+        }
+
+        ~IndexStore() {
+            flush();
+            if (log_fd >= 0)
+                close(log_fd);
+        }
+};
+
+#endif
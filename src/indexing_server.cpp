@@ -1,216 +1,1207 @@
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
+#include <memory>
 #include <unordered_map>
+#include <unordered_set>
 #include <iostream>
 #include <sstream>
 #include <vector>
 #include <algorithm>
 #include <chrono>
 #include <fstream>
+#include <random>
+
+#include "files_index.h"
+#include "protocol.h"
+#include "index_store.h"
+#include "logger.h"
+#include "latency_histogram.h"
+#include "timer_wheel.h"
 
 
 #define PORT 9999 // default chosen for server
+#define BACKLOG 1024 // default size of the pending connection queue
+#define MAX_EVENTS 256 // maximum number of epoll events handled per wakeup
 #define MAX_FILENAME_SIZE 256 // assume the maximum file size is 256 characters
 #define MAX_MSG_SIZE 4096
+#define RECV_BUFFER_SIZE 65536
+#define SNAPSHOT_PATH "logs/indexing_server/index.snapshot" // default location of the persisted index
+#define SNAPSHOT_INTERVAL 60 // seconds between index snapshots
+#define STORE_FLUSH_MS 100 // how often logged index operations are written out
+#define PROVISIONAL_GRACE 30 // seconds restored peers have to reconnect before their entries are dropped
+#define STATS_PATH "logs/indexing_server/stats.log" // where the stats report is dumped periodically
+#define SERVER_LOG_PATH "logs/indexing_server/server.log"
+#define PEER_LEASE 90 // default seconds a peer may stay silent before it is dropped, three of its syncs
+#define LIVENESS_TICK_MS 250 // resolution of peer lease expiry
+#define CLIENT_LOCKS 64 // stripes of the locks that keep a client's index changes and their log records in the same order
+#define ASSUMED_UPLOAD_SPEED (100 << 20) // bytes per second expected from a peer without an upload limit that was never seen sending faster
+
+
+// state kept for a single peer client connection between epoll wakeups
+// requests are framed incrementally since a single recv may hold a partial or multiple requests
+// legacy peers use fixed size requests while peers that send PROTOCOL_MAGIC switch to binary frames
+struct Connection : std::enable_shared_from_this<Connection> {
+    enum State {AWAIT_ID, AWAIT_HANDSHAKE, AWAIT_REQUEST, AWAIT_FILENAME, AWAIT_FRAME};
+
+    int socket_fd;
+    int client_id = 0;
+    int version = 1;
+    uint64_t generation = 0; // last batch registration generation applied for the peer client
+    State state = AWAIT_ID;
+    char request = '0';
+    std::string identity;
+    std::string in; // bytes recieved but not yet framed into a request
+    std::string out; // bytes waiting for the socket to become writable
+    bool closed = false;
+    bool batching = false; // replies are held back while the owning worker handles a batch of requests
+    std::unordered_set<std::string> watching; // filenames the peer client watches, only used by the owning worker
+    std::atomic<size_t> leases{0}; // leased search results the peer client holds
+    std::atomic<uint64_t> heard{0}; // liveness tick the peer client last sent something in
+    bool leased = false; // has a liveness timer, only used by the owning worker
+    std::atomic<bool> expired{false}; // the peer lease ran out and the connection was shut down
+
+    std::mutex out_m;
+
+    Connection(int fd, std::string client_identity) : socket_fd(fd), identity(client_identity) {}
+};
+
+
+// settings for the indexing server, most can be changed from the command line
+struct ServerConfig {
+    int port = PORT;
+    int backlog = BACKLOG;
+    int workers = 1;
+    std::string snapshot_path = SNAPSHOT_PATH;
+    int snapshot_interval = SNAPSHOT_INTERVAL;
+    int provisional_grace = PROVISIONAL_GRACE;
+    LogLevel log_level = LOG_INFO;
+    int log_flush_ms = LOG_FLUSH_MS;
+    bool log_stdout = true; // mirror the server log to stdout, off in fast mode
+    int stats_interval = 0; // seconds between dumps of the stats report to stats_path, 0 to disable
+    std::string server_log_path = SERVER_LOG_PATH;
+    std::string stats_path = STATS_PATH;
+    int peer_lease = PEER_LEASE; // seconds, 0 to keep silent peers until their connection breaks
+};
+
+
+// request counters and latency histograms, updated from every worker without locks
+struct ServerStats {
+    enum Op {REGISTRY, DEREGISTRY, SEARCH, CLEANUP, PATTERN_SEARCH, NUM_OPS};
+
+    LatencyHistogram latencies[NUM_OPS]; // nanoseconds per request, a batch counts as one request
+    std::atomic<uint64_t> items[NUM_OPS] = {}; // files registered, deregistered or searched and peers cleaned up
+    std::atomic<int> connected_peers{0};
+    std::atomic<uint64_t> accepted{0}; // connections accepted since start
+    std::atomic<uint64_t> watch_events{0}; // OP_WATCH_EVENT frames pushed to watchers
+    std::atomic<uint64_t> leases{0}; // leased search results handed out
+    std::atomic<uint64_t> invalidations{0}; // OP_INVALIDATE frames pushed to leaseholders
+    std::atomic<uint64_t> expired_peers{0}; // peers dropped after staying silent for a whole peer lease
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
+
+// upload load a peer client last reported with its sync
+struct PeerLoad {
+    uint64_t active = 0; // uploads in progress
+    uint64_t throughput = 0; // bytes per second sent lately
+    uint64_t limit = 0; // bytes per second it may send at most, 0 for no limit
+    uint64_t peak = 0; // highest throughput it ever reported
+};
+
+
+// a peer client that may keep a search result until the lease expires
+struct Lease {
+    std::weak_ptr<Connection> conn;
+    std::chrono::steady_clock::time_point expires;
+};
+
+
+// peer clients watching a filename or holding leases on its search result, and the holders they were last told about
+struct Watch {
+    std::vector<std::weak_ptr<Connection>> watchers;
+    std::vector<Lease> leases;
+    std::vector<std::pair<int, uint64_t>> holders; // client ids and content hashes as of the last check, sorted
+};
+
+
+// watched or leased filenames split by filename hash into as many shards as the files index, each with its own lock,
+// so searches and index changes on different files never wait on each other
+struct WatchShard {
+    std::unordered_map<std::string, Watch> watches;
+    TimerWheel<std::string> lease_expiry; // files with a lease running out at a tick of LIVENESS_TICK_MS
+    std::mutex m;
+};
+
+
+// a single reactor thread with its own epoll instance
+// connections are assigned to one worker for their whole lifetime so framing never needs a lock
+struct Worker {
+    int epoll_fd;
+    std::unordered_map<Connection*, std::shared_ptr<Connection>> connections;
+    std::mutex connections_m;
+};
 
 
 class IndexingServer {
     private:
-        std::unordered_map<std::string, std::vector<int>> files_index; // mapping between a filename and any peers associated with it
-        std::ofstream server_log;
+        ServerConfig config;
+        FilesIndex files_index; // mapping between a filename and any peers associated with it
+        std::unique_ptr<IndexStore> index_store; // snapshot and operation log of files_index, unset if persistence is off
+        std::unordered_set<int> provisional_clients; // peers restored from the store that have not reconnected yet
+        ServerStats stats;
+        Logger logger;
+        int server_log; // logger sink for the server log
+        std::vector<std::unique_ptr<Worker>> workers;
+        WatchShard watch_shards[FILES_INDEX_SHARDS]; // watched or leased filenames
+        std::atomic<size_t> watched_files{0}; // files in watch_shards, so index changes skip the watch locks while nobody watches
+        std::unordered_map<int, PeerLoad> peer_loads; // by client id
+        TimerWheel<std::weak_ptr<Connection>> peer_leases; // a liveness timer per binary protocol peer, in LIVENESS_TICK_MS ticks
 
-        std::mutex log_m;
-        std::mutex files_index_m;
+        std::mutex provisional_clients_m;
+        std::shared_mutex peer_loads_m;
+        std::mutex peer_leases_m;
+        std::mutex client_locks[CLIENT_LOCKS];
 
-        // helper function for getting the current time to microsecond-accuracy as a string
-        std::string time_now() {
-            std::chrono::high_resolution_clock::duration now = std::chrono::high_resolution_clock::now().time_since_epoch();
-            std::chrono::microseconds now_ms = std::chrono::duration_cast<std::chrono::microseconds>(now);
-            return std::to_string(now_ms.count());
+        // queue message for the server log, written out by the logger thread
+        void log(const std::string &type, const std::string &msg, LogLevel level=LOG_INFO) {
+            logger.log(server_log, level, type, msg);
         }
 
-        // log message to specified log file
-        void log(std::string type, std::string msg) {
-            std::lock_guard<std::mutex> guard(log_m);
-            server_log << '[' << time_now() << "] [" << type << "] " << msg  << '\n' << std::endl;
-            std::cout << '[' << time_now() << "] [" << type << "] [" << msg  << "]\n" << std::endl;
-        }
-        
         void error(std::string type) {
+            logger.flush();
             std::cerr << "\n[" << type << "] exiting program\n" << std::endl;
             exit(1);
         }
 
         //helper function for cleaning up the indexing server anytime a peer client is disconnected
-        void remove_client(int client_socket_fd, int client_id, std::string type) {
-            std::string msg = "closing connection for client ID '" + std::to_string(client_id) + "' and cleaning up index";
-            log(type, msg);
-            files_index_cleanup(client_id);
-            close(client_socket_fd);
-        }
-
-        // handle all requests sent to the indexing server
-        void handle_client_requests(int client_socket_fd) {
-            int client_id;
-            //initialize connection with peer client with getting client id
-            if (recv(client_socket_fd, &client_id, sizeof(client_id), 0) < 0) {
+        // only ever called from the worker owning the connection
+        void remove_client(Worker &worker, Connection *conn, std::string type) {
+            if (conn->state == Connection::AWAIT_ID || conn->state == Connection::AWAIT_HANDSHAKE) {
                 log("client unidentified", "closing connection");
-                close(client_socket_fd);
+            }
+            else {
+                std::string msg = "closing connection for client ID '" + std::to_string(conn->client_id) + "' and cleaning up index";
+                log(type, msg);
+                for (auto &&filename : conn->watching)
+                    drop_watcher(conn, filename);
+                files_index_cleanup(conn->client_id);
+                stats.connected_peers--;
+                std::unique_lock<std::shared_mutex> guard(peer_loads_m);
+                peer_loads.erase(conn->client_id);
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(conn->out_m);
+                conn->closed = true;
+                close(conn->socket_fd);
+            }
+
+            std::lock_guard<std::mutex> guard(worker.connections_m);
+            worker.connections.erase(conn);
+        }
+
+        // queue a reply for the peer client and write as much of it as the socket accepts
+        // anything left over is written once epoll reports the socket as writable again
+        void send_reply(Connection *conn, const char *data, size_t size) {
+            std::lock_guard<std::mutex> guard(conn->out_m);
+            if (conn->closed)
                 return;
+            conn->out.append(data, size);
+            if (!conn->batching)
+                flush_replies(conn);
+        }
+
+        // write queued replies until done or the socket would block, out_m must be held
+        void flush_replies(Connection *conn) {
+            size_t sent = 0;
+            while (sent < conn->out.size()) {
+                ssize_t n = send(conn->socket_fd, conn->out.data() + sent, conn->out.size() - sent, MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        // let the owning worker see the failure on its next read and clean up
+                        shutdown(conn->socket_fd, SHUT_RDWR);
+                    break;
+                }
+                sent += n;
             }
+            conn->out.erase(0, sent);
+        }
 
-            char request;
+        // drain the socket and handle every complete request, returns false once the connection is gone
+        bool read_client(Worker &worker, Connection *conn) {
+            char buffer[RECV_BUFFER_SIZE];
             while (1) {
-                request = '0';
-                // get request type from peer client
-                if (recv(client_socket_fd, &request, sizeof(request), 0) < 0) {
-                    remove_client(client_socket_fd, client_id, "client unresponsive");
-                    return;
+                ssize_t n = recv(conn->socket_fd, buffer, sizeof(buffer), 0);
+                if (n > 0) {
+                    conn->in.append(buffer, n);
+                    continue;
                 }
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
 
-                switch (request) {
-                    case '1':
-                        registry(client_socket_fd, client_id);
+                // handle anything sent before the peer client closed its end
+                if (!handle_client_requests(worker, conn))
+                    return false;
+                remove_client(worker, conn, conn->expired ? "client expired" : n == 0 ? "client disconnected" : "client unresponsive");
+                return false;
+            }
+            return handle_client_requests(worker, conn);
+        }
+
+        // frame and handle all requests sent to the indexing server
+        // returns false if the connection was closed while handling them
+        bool handle_client_requests(Worker &worker, Connection *conn) {
+            size_t pos = 0;
+            bool open = true;
+            // anything at all from the peer client renews its lease
+            conn->heard.store(liveness_tick(), std::memory_order_relaxed);
+            // replies to pipelined requests are collected and written with a single send
+            {
+                std::lock_guard<std::mutex> guard(conn->out_m);
+                conn->batching = true;
+            }
+            while (open) {
+                size_t available = conn->in.size() - pos;
+                if (conn->state == Connection::AWAIT_ID) {
+                    //initialize connection with peer client with getting client id
+                    if (available < sizeof(conn->client_id))
                         break;
-                    case '2':
-                        deregistry(client_socket_fd, client_id);
+                    memcpy(&conn->client_id, conn->in.data() + pos, sizeof(conn->client_id));
+                    pos += sizeof(conn->client_id);
+                    // binary protocol peers send the magic number first and identify themselves during the handshake
+                    conn->state = conn->client_id == PROTOCOL_MAGIC ? Connection::AWAIT_HANDSHAKE : Connection::AWAIT_REQUEST;
+                    if (conn->state == Connection::AWAIT_REQUEST)
+                        client_identified(conn);
+                }
+                else if (conn->state == Connection::AWAIT_HANDSHAKE) {
+                    // get the highest version the peer client speaks followed by its client id
+                    if (available < sizeof(char) + sizeof(conn->client_id))
+                        break;
+                    conn->version = std::min<int>((uint8_t)conn->in[pos], PROTOCOL_VERSION);
+                    memcpy(&conn->client_id, conn->in.data() + pos + 1, sizeof(conn->client_id));
+                    pos += sizeof(char) + sizeof(conn->client_id);
+
+                    // reply with the version both sides will use
+                    char version = conn->version;
+                    send_reply(conn, &version, sizeof(version));
+                    conn->state = Connection::AWAIT_FRAME;
+                    client_identified(conn);
+                }
+                else if (conn->state == Connection::AWAIT_FRAME) {
+                    uint8_t opcode;
+                    std::string payload;
+                    int parsed = parse_frame(conn->in, pos, opcode, payload);
+                    if (parsed == 0)
                         break;
-                    case '3':
-                        search(client_socket_fd, client_id);
+                    if (parsed < 0 || !handle_frame(conn, opcode, payload)) {
+                        remove_client(worker, conn, "unexpected request");
+                        open = false;
+                    }
+                }
+                else if (conn->state == Connection::AWAIT_REQUEST) {
+                    // get request type from peer client
+                    if (available < sizeof(conn->request))
                         break;
-                    case '4':
-                        print_files_map();
+                    conn->request = conn->in[pos++];
+
+                    switch (conn->request) {
+                        case '1':
+                        case '2':
+                        case '3':
+                            conn->state = Connection::AWAIT_FILENAME;
+                            break;
+                        case '4':
+                            print_files_map();
+                            break;
+                        case '5':
+                            legacy_stats(conn);
+                            break;
+                        case '0':
+                            remove_client(worker, conn, "client disconnected");
+                            open = false;
+                            break;
+                        default:
+                            remove_client(worker, conn, "unexpected request");
+                            open = false;
+                            break;
+                    }
+                }
+                else {
+                    // recieve filename from peer client
+                    if (available < MAX_FILENAME_SIZE)
                         break;
-                    case '0':
-                        remove_client(client_socket_fd, client_id, "client disconnected");
-                        return;
-                    default:
-                        remove_client(client_socket_fd, client_id, "unexpected request");
-                        return;
+                    const char *buffer = conn->in.data() + pos;
+                    std::string filename = std::string(buffer, strnlen(buffer, MAX_FILENAME_SIZE));
+                    pos += MAX_FILENAME_SIZE;
+                    conn->state = Connection::AWAIT_REQUEST;
+
+                    switch (conn->request) {
+                        case '1':
+                            registry(conn->client_id, filename);
+                            break;
+                        case '2':
+                            deregistry(conn->client_id, filename);
+                            break;
+                        case '3':
+                            search(conn, filename);
+                            break;
+                    }
                 }
             }
+
+            if (open) {
+                conn->in.erase(0, pos);
+                std::lock_guard<std::mutex> guard(conn->out_m);
+                conn->batching = false;
+                flush_replies(conn);
+            }
+            return open;
         }
 
-        // handles communication with peer client for registering a single file 
-        void registry(int client_socket_fd, int client_id) {
-            char buffer[MAX_FILENAME_SIZE];
-            // recieve filename from peer client
-            if (recv(client_socket_fd, buffer, sizeof(buffer), 0) < 0) {
-                remove_client(client_socket_fd, client_id, "client unresponsive");
+        // handle a single binary protocol frame, returns false if the frame was malformed
+        bool handle_frame(Connection *conn, uint8_t opcode, const std::string &payload) {
+            const char *pos = payload.data();
+            const char *end = pos + payload.size();
+            std::string filename, cursor;
+            std::vector<std::string> filenames, removed;
+            std::vector<uint64_t> content_hashes;
+            uint64_t generation, count, request_id;
+            uint8_t flags;
+
+            switch (opcode) {
+                case OP_REGISTER:
+                    if (!get_string(pos, end, filename))
+                        return false;
+                    registry(conn->client_id, filename);
+                    return true;
+                case OP_DEREGISTER:
+                    if (!get_string(pos, end, filename))
+                        return false;
+                    deregistry(conn->client_id, filename);
+                    return true;
+                case OP_SEARCH:
+                    if (!get_string(pos, end, filename))
+                        return false;
+                    search(conn, filename);
+                    return true;
+                case OP_SEARCH_TAGGED:
+                    if (!get_varint(pos, end, request_id) || !get_string(pos, end, filename))
+                        return false;
+                    tagged_search(conn, request_id, filename);
+                    return true;
+                case OP_SEARCH_LEASED:
+                    if (!get_varint(pos, end, request_id) || !get_string(pos, end, filename))
+                        return false;
+                    leased_search(conn, request_id, filename);
+                    return true;
+                case OP_SEARCH_PATTERN:
+                    if (!get_varint(pos, end, request_id) || pos == end)
+                        return false;
+                    flags = *pos++;
+                    if (!get_string(pos, end, filename) || !get_string(pos, end, cursor) || !get_varint(pos, end, count))
+                        return false;
+                    pattern_search(conn, request_id, flags, filename, cursor, count);
+                    return true;
+                case OP_SEARCH_MANY:
+                    if (!get_varint(pos, end, request_id) || !get_strings(pos, end, filenames) || filenames.size() > MAX_BATCH_SIZE)
+                        return false;
+                    batch_search(conn, request_id, filenames);
+                    return true;
+                case OP_WATCH:
+                    if (!get_string(pos, end, filename) || (!conn->watching.count(filename) && conn->watching.size() >= MAX_WATCHES))
+                        return false;
+                    watch(conn, filename);
+                    return true;
+                case OP_UNWATCH:
+                    if (!get_string(pos, end, filename))
+                        return false;
+                    if (conn->watching.erase(filename))
+                        drop_watcher(conn, filename);
+                    return true;
+                case OP_PRINT_FILES_MAP:
+                    print_files_map();
+                    return true;
+                case OP_STATS:
+                    if (!get_varint(pos, end, request_id))
+                        return false;
+                    tagged_stats(conn, request_id);
+                    return true;
+                case OP_REGISTER_MANY:
+                    if (!get_varint(pos, end, generation) || pos == end)
+                        return false;
+                    flags = *pos++;
+                    if (!get_strings(pos, end, filenames))
+                        return false;
+                    if ((flags & REGISTER_HASHED) && (!get_hashes(pos, end, content_hashes) || content_hashes.size() != filenames.size()))
+                        return false;
+                    // a replacing batch repairs drift by starting over from the peer's full file list
+                    // watchers are only told about the result, not about the files briefly dropped in between
+                    if (flags & REGISTER_REPLACE)
+                        removed = files_index_cleanup(conn->client_id, false);
+                    registry_many(conn->client_id, filenames, content_hashes);
+                    notify_watchers(removed);
+                    conn->generation = generation;
+                    return true;
+                case OP_DEREGISTER_MANY:
+                    if (!get_varint(pos, end, generation) || !get_strings(pos, end, filenames))
+                        return false;
+                    deregistry_many(conn->client_id, filenames);
+                    conn->generation = generation;
+                    return true;
+                case OP_SYNC:
+                    if (!get_varint(pos, end, generation) || !get_varint(pos, end, count))
+                        return false;
+                    if (pos < end) {
+                        PeerLoad load;
+                        if (!get_varint(pos, end, load.active) || !get_varint(pos, end, load.throughput) || !get_varint(pos, end, load.limit))
+                            return false;
+                        report_load(conn->client_id, load);
+                    }
+                    // peers that sync keep doing so every few seconds, so from the first sync on their silence means they hung
+                    if (config.peer_lease > 0 && !conn->leased) {
+                        conn->leased = true;
+                        lease_peer(conn->shared_from_this(), conn->heard);
+                    }
+                    sync(conn, generation, count);
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        // count a handled request and how long it took
+        void record(ServerStats::Op op, std::chrono::steady_clock::time_point start, size_t items) {
+            stats.latencies[op].record_since(start);
+            stats.items[op].fetch_add(items, std::memory_order_relaxed);
+        }
+
+        // held across an index change and its log record while persistence is on
+        // every change and record concerns a single client id, so changes for different clients can be logged in any order,
+        // but two connections with the same client id, like a reconnect racing the old connection's cleanup, must log their
+        // changes in the order they made them or a replay ends up with a different index
+        std::unique_lock<std::mutex> lock_client(int client_id) {
+            if (!index_store)
+                return std::unique_lock<std::mutex>();
+            return std::unique_lock<std::mutex>(client_locks[(unsigned)client_id % CLIENT_LOCKS]);
+        }
+
+        // registers a single file for a peer client
+        void registry(int client_id, const std::string &filename) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            {
+                std::unique_lock<std::mutex> guard = lock_client(client_id);
+                files_index.add(filename, client_id);
+                if (index_store)
+                    index_store->log_add(filename, client_id);
+            }
+            record(ServerStats::REGISTRY, start, 1);
+            notify_watchers(filename);
+        }
+
+        // registers a batch of files for a peer client, along with their content hashes if it sent any
+        void registry_many(int client_id, const std::vector<std::string> &filenames, const std::vector<uint64_t> &content_hashes) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            {
+                std::unique_lock<std::mutex> guard = lock_client(client_id);
+                files_index.add_many(filenames, client_id, content_hashes);
+                if (index_store) {
+                    for (size_t i = 0; i < filenames.size(); i++)
+                        index_store->log_add(filenames[i], client_id, i < content_hashes.size() ? content_hashes[i] : 0);
+                }
+            }
+            record(ServerStats::REGISTRY, start, filenames.size());
+            notify_watchers(filenames);
+        }
+
+        // deregisters a single file for a peer client
+        void deregistry(int client_id, const std::string &filename) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            {
+                std::unique_lock<std::mutex> guard = lock_client(client_id);
+                files_index.remove(filename, client_id);
+                if (index_store)
+                    index_store->log_remove(filename, client_id);
+            }
+            record(ServerStats::DEREGISTRY, start, 1);
+            notify_watchers(filename);
+        }
+
+        // deregisters a batch of files for a peer client
+        void deregistry_many(int client_id, const std::vector<std::string> &filenames) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            {
+                std::unique_lock<std::mutex> guard = lock_client(client_id);
+                files_index.remove_many(filenames, client_id);
+                if (index_store) {
+                    for (auto &&filename : filenames)
+                        index_store->log_remove(filename, client_id);
+                }
+            }
+            record(ServerStats::DEREGISTRY, start, filenames.size());
+            notify_watchers(filenames);
+        }
+
+        // remove client id from all files in mapping
+        // returns the watched files that may have changed, which watchers are told about unless notify is unset
+        std::vector<std::string> files_index_cleanup(int client_id, bool notify=true) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            // the client's filenames are only collected while someone watches, so a plain cleanup stays cheap
+            bool watched = watched_files > 0;
+            std::vector<std::string> removed;
+            {
+                std::unique_lock<std::mutex> guard = lock_client(client_id);
+                files_index.remove_client(client_id, watched ? &removed : nullptr);
+                if (index_store)
+                    index_store->log_remove_client(client_id);
+            }
+            record(ServerStats::CLEANUP, start, 1);
+            if (!watched && watched_files > 0) {
+                // a watch started while the files were dropped, so any watched file may have been one of them
+                for (auto &&shard : watch_shards) {
+                    std::lock_guard<std::mutex> guard(shard.m);
+                    for (auto &&watch : shard.watches)
+                        removed.push_back(watch.first);
+                }
+            }
+            if (notify)
+                notify_watchers(removed);
+            return removed;
+        }
+
+        // start pushing changes to a file's holders to the peer client, and tell it about the current ones right away
+        // so a file registered between a search and the watch is not missed
+        void watch(Connection *conn, const std::string &filename) {
+            if (!conn->watching.insert(filename).second)
                 return;
+            WatchShard &shard = watch_shard(filename);
+            std::lock_guard<std::mutex> guard(shard.m);
+            auto inserted = shard.watches.emplace(filename, Watch());
+            Watch &watch = inserted.first->second;
+            watch.watchers.push_back(conn->shared_from_this());
+            if (inserted.second)
+                watched_files++;
+
+            std::vector<std::pair<int, uint64_t>> holders = watched_holders(filename);
+            // a watch that already existed keeps its holders until the pending notification for them runs
+            if (inserted.second)
+                watch.holders = holders;
+            if (!holders.empty()) {
+                std::string frame = watch_event(filename, holders);
+                send_reply(conn, frame.data(), frame.size());
+                stats.watch_events++;
             }
-            
-            std::string filename = std::string(buffer);
-            std::lock_guard<std::mutex> guard(files_index_m);
-            // add peer's client id to file map if not already included
-            if(!(std::find(files_index[filename].begin(), files_index[filename].end(), client_id) != files_index[filename].end()))
-                files_index[filename].push_back(client_id);
         }
 
-        // handles communication with peer client for deregistering a single file 
-        void deregistry(int client_socket_fd, int client_id) {
-            char buffer[MAX_FILENAME_SIZE];
-            if (recv(client_socket_fd, buffer, sizeof(buffer), 0) < 0) {
-                remove_client(client_socket_fd, client_id, "client unresponsive");
+        // stop pushing changes to a file to the peer client
+        void drop_watcher(Connection *conn, const std::string &filename) {
+            WatchShard &shard = watch_shard(filename);
+            std::lock_guard<std::mutex> guard(shard.m);
+            auto watch = shard.watches.find(filename);
+            if (watch == shard.watches.end())
                 return;
+            std::vector<std::weak_ptr<Connection>> &watchers = watch->second.watchers;
+            watchers.erase(std::remove_if(watchers.begin(), watchers.end(), [conn](const std::weak_ptr<Connection> &watcher) {
+                std::shared_ptr<Connection> watching = watcher.lock();
+                return !watching || watching.get() == conn;
+            }), watchers.end());
+            drop_unused(shard, watch);
+        }
+
+        WatchShard &watch_shard(const std::string &filename) {
+            return watch_shards[std::hash<std::string>()(filename) % FILES_INDEX_SHARDS];
+        }
+
+        // stop checking a file once nobody watches or leases it anymore, the shard's lock must be held
+        void drop_unused(WatchShard &shard, std::unordered_map<std::string, Watch>::iterator watch) {
+            if (watch->second.watchers.empty() && watch->second.leases.empty()) {
+                shard.watches.erase(watch);
+                watched_files--;
             }
- 
-            std::string filename = std::string(buffer);
-            std::lock_guard<std::mutex> guard(files_index_m);
-            // remove peer's client id from file
-            files_index[filename].erase(std::remove(files_index[filename].begin(), files_index[filename].end(), client_id), files_index[filename].end());
-            // remove filename from mapping if no more peers mapped to file
-            if (files_index[filename].size() == 0)
-                files_index.erase(filename);
         }
 
-        // remove client id from all files in mapping
-        void files_index_cleanup(int client_id) {
-            std::unordered_map<std::string, std::vector<int>> tmp_files_index;
-            
-            std::lock_guard<std::mutex> guard(files_index_m);
-            for (auto const &file_index : files_index) {
-                std::vector<int> tmp_client_ids = file_index.second;
-                tmp_client_ids.erase(std::remove(tmp_client_ids.begin(), tmp_client_ids.end(), client_id), tmp_client_ids.end());
-                if (tmp_client_ids.size() > 0)
-                    tmp_files_index[file_index.first] = tmp_client_ids;
-            }
-            files_index = tmp_files_index;
-        }
-
-        // handles communication with peer client for returning all client ids mapped to a filename
-        void search(int client_socket_fd, int client_id) {
-            char buffer[MAX_FILENAME_SIZE];
-            // recieve filename from peer client
-            if (recv(client_socket_fd, buffer, sizeof(buffer), 0) < 0) {
-                remove_client(client_socket_fd, client_id, "client unresponsive");
+        // holders of a file as sent in a watch event, sorted so two lists compare directly, the file's watch shard
+        // lock must be held
+        std::vector<std::pair<int, uint64_t>> watched_holders(const std::string &filename) {
+            std::vector<uint64_t> content_hashes;
+            std::vector<int> client_ids = files_index.find(filename, content_hashes);
+            std::vector<std::pair<int, uint64_t>> holders;
+            for (size_t i = 0; i < client_ids.size(); i++)
+                holders.emplace_back(client_ids[i], content_hashes[i]);
+            std::sort(holders.begin(), holders.end());
+            return holders;
+        }
+
+        static std::string watch_event(const std::string &filename, const std::vector<std::pair<int, uint64_t>> &holders) {
+            std::vector<int> client_ids;
+            std::vector<uint64_t> content_hashes;
+            for (auto &&holder : holders) {
+                client_ids.push_back(holder.first);
+                content_hashes.push_back(holder.second);
+            }
+            std::string payload;
+            put_string(payload, filename);
+            put_ids(payload, client_ids);
+            put_hashes(payload, content_hashes);
+            return make_frame(OP_WATCH_EVENT, payload);
+        }
+
+        // compare a watched file's holders with what its watchers were last told, the file's watch shard lock must be held
+        // watchers hear about every new holder or changed content and about the last holder leaving, while a holder
+        // leaving a file others still hold is only recorded. any change at all ends every lease on the file
+        void check_watch(const std::string &filename, Watch &watch) {
+            std::vector<std::pair<int, uint64_t>> holders = watched_holders(filename);
+            if (holders == watch.holders)
                 return;
+            bool push = holders.empty() || !std::includes(watch.holders.begin(), watch.holders.end(), holders.begin(), holders.end());
+            watch.holders = holders;
+
+            if (!watch.leases.empty()) {
+                std::string payload;
+                put_string(payload, filename);
+                std::string frame = make_frame(OP_INVALIDATE, payload);
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                for (auto &&lease : watch.leases) {
+                    std::shared_ptr<Connection> conn = lease.conn.lock();
+                    if (!conn)
+                        continue;
+                    conn->leases--;
+                    if (now < lease.expires) {
+                        send_reply(conn.get(), frame.data(), frame.size());
+                        stats.invalidations++;
+                    }
+                }
+                watch.leases.clear();
             }
+            if (!push)
+                return;
 
-            std::string filename = std::string(buffer);
-            
-            std::ostringstream client_ids;
-            if (files_index.count(filename) > 0) {
-                std::string delimiter;
-                std::lock_guard<std::mutex> guard(files_index_m);
-                for (auto &&client_id : files_index[filename]) {
-                    // add client id to stream
-                    client_ids << delimiter << client_id;
-                    delimiter = ',';
+            std::string frame = watch_event(filename, holders);
+            for (auto &&watcher : watch.watchers) {
+                std::shared_ptr<Connection> conn = watcher.lock();
+                if (!conn)
+                    continue;
+                send_reply(conn.get(), frame.data(), frame.size());
+                stats.watch_events++;
+            }
+        }
+
+        // push changes to the files just registered or deregistered to anyone watching them
+        // files left with neither watchers nor leases stop being checked
+        void notify_watchers(const std::vector<std::string> &filenames) {
+            if (watched_files == 0 || filenames.empty())
+                return;
+            for (auto &&filename : filenames) {
+                WatchShard &shard = watch_shard(filename);
+                std::lock_guard<std::mutex> guard(shard.m);
+                auto watch = shard.watches.find(filename);
+                if (watch == shard.watches.end())
+                    continue;
+                check_watch(filename, watch->second);
+                drop_unused(shard, watch);
+            }
+        }
+
+        void notify_watchers(const std::string &filename) {
+            if (watched_files == 0)
+                return;
+            notify_watchers(std::vector<std::string>{filename});
+        }
+
+        // drop leases that ran out or whose peer client went away, along with files nobody watches or leases anymore
+        // every lease has a timer on its shard's wheel, so only the files with a lease coming due are looked at
+        void expire_leases() {
+            std::vector<std::string> due;
+            while (1) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(LIVENESS_TICK_MS));
+                uint64_t tick = liveness_tick();
+                std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+                for (auto &&shard : watch_shards) {
+                    std::lock_guard<std::mutex> guard(shard.m);
+                    due.clear();
+                    shard.lease_expiry.advance(tick, due);
+                    for (auto &&filename : due) {
+                        // the file's leases may have been invalidated or its watch dropped and started over meanwhile
+                        auto watch = shard.watches.find(filename);
+                        if (watch == shard.watches.end())
+                            continue;
+                        std::vector<Lease> &leases = watch->second.leases;
+                        leases.erase(std::remove_if(leases.begin(), leases.end(), [now](const Lease &lease) {
+                            std::shared_ptr<Connection> conn = lease.conn.lock();
+                            if (conn && now < lease.expires)
+                                return false;
+                            if (conn)
+                                conn->leases--;
+                            return true;
+                        }), leases.end());
+                        drop_unused(shard, watch);
+                    }
                 }
             }
+        }
 
-            char buffer_[MAX_MSG_SIZE];
-            strcpy(buffer_, client_ids.str().c_str());
-            // send comma delimited list of all client ids for a specific file to the peer client
-            if (send(client_socket_fd, buffer_, sizeof(buffer_), 0) < 0) {
-                remove_client(client_socket_fd, client_id, "client unresponsive");
+        // ticks of LIVENESS_TICK_MS since the server started
+        uint64_t liveness_tick() {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - stats.start).count() / LIVENESS_TICK_MS;
+        }
+
+        uint64_t peer_lease_ticks() {
+            return (uint64_t)config.peer_lease * 1000 / LIVENESS_TICK_MS;
+        }
+
+        // set a peer client's liveness timer to go off one peer lease after it was last heard from
+        void lease_peer(const std::shared_ptr<Connection> &conn, uint64_t heard) {
+            std::lock_guard<std::mutex> guard(peer_leases_m);
+            peer_leases.add(heard + peer_lease_ticks(), conn);
+        }
+
+        // drop peer clients that sent nothing for a whole peer lease, most likely hung with their connection still open
+        // a peer's timer is not moved when it is heard from, only checked once it goes off and set again from when the peer
+        // was last heard from, so requests cost a single store and every tick costs the same however many peers there are
+        void expire_peers() {
+            std::vector<std::weak_ptr<Connection>> due;
+            while (1) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(LIVENESS_TICK_MS));
+                uint64_t now = liveness_tick();
+                {
+                    std::lock_guard<std::mutex> guard(peer_leases_m);
+                    peer_leases.advance(now, due);
+                }
+                for (auto &&timer : due) {
+                    // timers of connections that already closed are just dropped
+                    std::shared_ptr<Connection> conn = timer.lock();
+                    if (!conn)
+                        continue;
+                    uint64_t heard = conn->heard.load(std::memory_order_relaxed);
+                    if (heard + peer_lease_ticks() > now) {
+                        lease_peer(conn, heard);
+                        continue;
+                    }
+
+                    std::lock_guard<std::mutex> guard(conn->out_m);
+                    if (conn->closed)
+                        continue;
+                    log("client expired", "client ID '" + std::to_string(conn->client_id) + "' sent nothing for " + std::to_string(config.peer_lease) +
+                        "s, closing connection", LOG_WARN);
+                    stats.expired_peers++;
+                    conn->expired = true;
+                    // the owning worker sees the connection end and cleans up the index as for any other disconnect
+                    shutdown(conn->socket_fd, SHUT_RDWR);
+                }
+                due.clear();
+            }
+        }
+
+        // a peer client that held files before a restart has reconnected, so its entries are no longer provisional
+        // entries from a binary protocol peer are replaced once its first sync reports drift
+        void client_identified(Connection *conn) {
+            stats.connected_peers++;
+            std::lock_guard<std::mutex> guard(provisional_clients_m);
+            provisional_clients.erase(conn->client_id);
+        }
+
+        // drop the restored entries of any peer client that did not reconnect within the grace period
+        void expire_provisional_clients() {
+            std::this_thread::sleep_for(std::chrono::seconds(config.provisional_grace));
+
+            std::vector<int> expired;
+            {
+                std::lock_guard<std::mutex> guard(provisional_clients_m);
+                expired.assign(provisional_clients.begin(), provisional_clients.end());
+            }
+            for (auto &&client_id : expired) {
+                // a peer that reconnected since the list was taken keeps its entries, and the lock is held through the
+                // cleanup so a peer identifying itself cannot slip in between the check and the cleanup
+                std::lock_guard<std::mutex> guard(provisional_clients_m);
+                if (!provisional_clients.erase(client_id))
+                    continue;
+                log("client expired", "client ID '" + std::to_string(client_id) + "' did not reconnect after restart, cleaning up index");
+                files_index_cleanup(client_id);
+            }
+        }
+
+        // flush the operation log often and replace it with a snapshot of the index every snapshot interval
+        void persist_index() {
+            std::chrono::steady_clock::time_point last_snapshot = std::chrono::steady_clock::now();
+            while (1) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(STORE_FLUSH_MS));
+                if (!index_store->flush())
+                    log("failed index log write", "changes may be lost on restart", LOG_WARN);
+
+                if (std::chrono::steady_clock::now() - last_snapshot >= std::chrono::seconds(config.snapshot_interval)) {
+                    if (!index_store->snapshot(files_index))
+                        log("failed index snapshot", "keeping previous snapshot and log", LOG_WARN);
+                    last_snapshot = std::chrono::steady_clock::now();
+                }
+            }
+        }
+
+        void report_load(int client_id, PeerLoad load) {
+            std::unique_lock<std::shared_mutex> guard(peer_loads_m);
+            PeerLoad &reported = peer_loads[client_id];
+            load.peak = std::max(reported.peak, load.throughput);
+            reported = load;
+        }
+
+        // bytes per second a new download could expect from a peer client, peer_loads_m must be held
+        // one that never reported its load counts as idle
+        uint64_t expected_speed(int client_id) {
+            auto load = peer_loads.find(client_id);
+            if (load == peer_loads.end())
+                return ASSUMED_UPLOAD_SPEED;
+            uint64_t speed = load->second.limit ? load->second.limit : std::max<uint64_t>(load->second.peak, ASSUMED_UPLOAD_SPEED);
+            return speed / (load->second.active + 1);
+        }
+
+        // order holders by the speed a new download can expect from them, fastest first
+        // speeds within a factor of two of each other count as equal and are shuffled, so downloads spread over them
+        // content hashes, if given, are kept lined up with their holders
+        void rank_holders(std::vector<int> &client_ids, std::vector<uint64_t> *content_hashes=nullptr) {
+            if (client_ids.size() < 2)
+                return;
+            thread_local std::mt19937 random(std::random_device{}());
+            std::vector<std::pair<uint64_t, size_t>> order; // speed class in the high half and a random tie breaker in the low half
+            {
+                std::shared_lock<std::shared_mutex> guard(peer_loads_m);
+                for (size_t i = 0; i < client_ids.size(); i++) {
+                    uint64_t speed_class = 63 - __builtin_clzll(expected_speed(client_ids[i]) | 1);
+                    order.emplace_back(speed_class << 32 | (uint32_t)random(), i);
+                }
+            }
+            std::sort(order.begin(), order.end(), std::greater<std::pair<uint64_t, size_t>>());
+
+            std::vector<int> ranked_ids;
+            std::vector<uint64_t> ranked_hashes;
+            for (auto &&holder : order) {
+                ranked_ids.push_back(client_ids[holder.second]);
+                if (content_hashes)
+                    ranked_hashes.push_back((*content_hashes)[holder.second]);
+            }
+            client_ids.swap(ranked_ids);
+            if (content_hashes)
+                content_hashes->swap(ranked_hashes);
+        }
+
+        // returns all client ids mapped to a filename to the peer client, ranked by expected speed
+        void search(Connection *conn, const std::string &filename) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            std::vector<int> holders = files_index.find(filename);
+            rank_holders(holders);
+            if (conn->version >= 2) {
+                std::string payload;
+                put_ids(payload, holders);
+                std::string frame = make_frame(OP_SEARCH_RESULT, payload);
+                send_reply(conn, frame.data(), frame.size());
+                record(ServerStats::SEARCH, start, 1);
                 return;
             }
+
+            std::ostringstream client_ids;
+            std::string delimiter;
+            for (auto &&client_id : holders) {
+                // stop before a client id would overflow the reply
+                if (client_ids.tellp() + (std::streamoff)(delimiter.size() + std::to_string(client_id).size()) >= MAX_MSG_SIZE)
+                    break;
+                // add client id to stream
+                client_ids << delimiter << client_id;
+                delimiter = ',';
+            }
+
+            char buffer[MAX_MSG_SIZE];
+            bzero(buffer, MAX_MSG_SIZE);
+            strcpy(buffer, client_ids.str().c_str());
+            // send comma delimited list of all client ids for a specific file to the peer client
+            send_reply(conn, buffer, sizeof(buffer));
+            record(ServerStats::SEARCH, start, 1);
+        }
+
+        // returns all client ids mapped to a filename and the content hash each registered, along with the request id
+        // the peer client tagged the search with
+        void tagged_search(Connection *conn, uint64_t request_id, const std::string &filename) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            std::vector<uint64_t> content_hashes;
+            std::string payload;
+            put_varint(payload, request_id);
+            std::vector<int> holders = files_index.find(filename, content_hashes);
+            rank_holders(holders, &content_hashes);
+            put_ids(payload, holders);
+            put_hashes(payload, content_hashes);
+            std::string frame = make_frame(OP_SEARCH_TAGGED_RESULT, payload);
+            send_reply(conn, frame.data(), frame.size());
+            record(ServerStats::SEARCH, start, 1);
+        }
+
+        // tagged search whose result the peer client may keep, since it is told as soon as the file's holders change
+        // the reply is queued under the file's watch shard lock, so an invalidation for the lease cannot overtake it
+        // a file nobody holds gets no lease, so searches that miss leave nothing behind to check
+        void leased_search(Connection *conn, uint64_t request_id, const std::string &filename) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            WatchShard &shard = watch_shard(filename);
+            std::lock_guard<std::mutex> guard(shard.m);
+            std::vector<std::pair<int, uint64_t>> holders = watched_holders(filename);
+            uint64_t lease_ms = 0;
+            if (!holders.empty() && conn->leases < MAX_LEASES) {
+                auto inserted = shard.watches.emplace(filename, Watch());
+                Watch &watch = inserted.first->second;
+                // a watch that already existed keeps its holders until the pending notification for them runs
+                if (inserted.second) {
+                    watch.holders = holders;
+                    watched_files++;
+                }
+                lease_ms = SEARCH_LEASE_MS;
+                watch.leases.push_back(Lease{conn->shared_from_this(), start + std::chrono::milliseconds(lease_ms)});
+                // the tick the lease started in may be almost over, so the timer waits one more to be sure it ran out
+                shard.lease_expiry.add(liveness_tick() + (SEARCH_LEASE_MS + LIVENESS_TICK_MS - 1) / LIVENESS_TICK_MS + 1, filename);
+                conn->leases++;
+                stats.leases++;
+            }
+
+            std::vector<int> client_ids;
+            std::vector<uint64_t> content_hashes;
+            for (auto &&holder : holders) {
+                client_ids.push_back(holder.first);
+                content_hashes.push_back(holder.second);
+            }
+            rank_holders(client_ids, &content_hashes);
+            std::string payload;
+            put_varint(payload, request_id);
+            put_varint(payload, lease_ms);
+            put_ids(payload, client_ids);
+            put_hashes(payload, content_hashes);
+            std::string frame = make_frame(OP_SEARCH_LEASED_RESULT, payload);
+            send_reply(conn, frame.data(), frame.size());
+            record(ServerStats::SEARCH, start, 1);
+        }
+
+        // returns the client ids mapped to each of a batch of filenames in one reply, tagged with the request id
+        void batch_search(Connection *conn, uint64_t request_id, const std::vector<std::string> &filenames) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            std::string payload;
+            put_varint(payload, request_id);
+            put_varint(payload, filenames.size());
+            for (auto &&holders : files_index.find_many(filenames)) {
+                rank_holders(holders);
+                put_ids(payload, holders);
+            }
+            std::string frame = make_frame(OP_SEARCH_MANY_RESULT, payload);
+            send_reply(conn, frame.data(), frame.size());
+            record(ServerStats::SEARCH, start, filenames.size());
+        }
+
+        // returns a page of the files matching a prefix or glob pattern and their peers, tagged with the request id
+        // the cursor sent back is the last filename the page covered, so the next page picks up right after it
+        void pattern_search(Connection *conn, uint64_t request_id, uint8_t mode, const std::string &pattern, const std::string &cursor, uint64_t page_size) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            if (page_size == 0 || page_size > PATTERN_PAGE_SIZE)
+                page_size = PATTERN_PAGE_SIZE;
+            std::vector<std::string> matched;
+            std::string next_cursor = files_index.match(pattern, mode == PATTERN_GLOB, cursor, page_size, matched);
+
+            std::string files;
+            uint64_t count = 0;
+            for (size_t i = 0; i < matched.size(); i++) {
+                std::vector<int> holders = files_index.find(matched[i]);
+                // dropped since it was matched
+                if (holders.empty())
+                    continue;
+                rank_holders(holders);
+                size_t previous_size = files.size();
+                put_string(files, matched[i]);
+                put_ids(files, holders);
+                if (files.size() > PATTERN_PAGE_BYTES && count > 0) {
+                    // leave the rest for the next page
+                    files.resize(previous_size);
+                    next_cursor = matched[i - 1];
+                    break;
+                }
+                count++;
+            }
+
+            std::string payload;
+            put_varint(payload, request_id);
+            put_string(payload, next_cursor);
+            put_varint(payload, count);
+            payload += files;
+            std::string frame = make_frame(OP_SEARCH_PATTERN_RESULT, payload);
+            send_reply(conn, frame.data(), frame.size());
+            record(ServerStats::PATTERN_SEARCH, start, count);
+        }
+
+        // check that the index agrees with the peer client's view of its registered files
+        // a generation or file count mismatch means updates were lost, so the peer is asked to resend everything
+        void sync(Connection *conn, uint64_t generation, uint64_t count) {
+            char status = SYNC_OK;
+            if (generation != conn->generation || count != files_index.client_files_count(conn->client_id)) {
+                log("client drift", "client ID '" + std::to_string(conn->client_id) + "' at generation " + std::to_string(generation) + " needs a full resync", LOG_WARN);
+                status = SYNC_DRIFT;
+            }
+
+            std::string payload;
+            put_varint(payload, generation);
+            payload += status;
+            std::string frame = make_frame(OP_SYNC_RESULT, payload);
+            send_reply(conn, frame.data(), frame.size());
+        }
+
+        // human readable summary of the server's counters, latency percentiles, index size and connected peers
+        std::string stats_report() {
+            const char *names[] = {"registry", "deregistry", "search", "cleanup", "pattern search"};
+            const char *item_names[] = {"files", "files", "files", "peers", "files"};
+            size_t files, entries;
+            files_index.size(files, entries);
+            long uptime = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - stats.start).count();
+
+            std::ostringstream report;
+            report << "uptime " << uptime << "s, " << stats.connected_peers << " connected peer(s), " << stats.accepted << " connection(s) accepted, "
+                   << stats.expired_peers << " expired\n";
+            report << "index " << files << " files, " << entries << " entries\n";
+            report << "watched or leased " << watched_files << " files, " << stats.watch_events << " event(s) pushed, " << stats.leases << " lease(s) granted, "
+                   << stats.invalidations << " invalidation(s) pushed\n";
+            auto histogram_line = [&report](const LatencyHistogram &histogram) {
+                report << "ns mean " << histogram.mean() << " p50 " << histogram.percentile(0.5) << " p99 " << histogram.percentile(0.99)
+                       << " p999 " << histogram.percentile(0.999) << " max " << histogram.maximum() << '\n';
+            };
+            for (int op = 0; op < ServerStats::NUM_OPS; op++) {
+                report << names[op] << ": " << stats.latencies[op].count() << " requests, " << stats.items[op] << ' ' << item_names[op] << ", ";
+                histogram_line(stats.latencies[op]);
+            }
+            const LatencyHistogram &lock_waits = files_index.lock_wait_histogram();
+            report << "lock waits: " << lock_waits.count() << " contended, ";
+            histogram_line(lock_waits);
+            return report.str();
+        }
+
+        // returns the stats report along with the request id the peer client tagged the request with
+        void tagged_stats(Connection *conn, uint64_t request_id) {
+            std::string payload;
+            put_varint(payload, request_id);
+            put_string(payload, stats_report());
+            std::string frame = make_frame(OP_STATS_RESULT, payload);
+            send_reply(conn, frame.data(), frame.size());
+        }
+
+        // returns the stats report to a legacy peer client, cut short to fit the fixed reply size
+        void legacy_stats(Connection *conn) {
+            char buffer[MAX_MSG_SIZE];
+            bzero(buffer, MAX_MSG_SIZE);
+            std::string report = stats_report();
+            memcpy(buffer, report.data(), std::min(report.size(), sizeof(buffer) - 1));
+            send_reply(conn, buffer, sizeof(buffer));
+        }
+
+        // append the stats report to the stats path every stats interval
+        void dump_stats() {
+            std::ofstream stats_log(config.stats_path, std::ios::app);
+            while (1) {
+                std::this_thread::sleep_for(std::chrono::seconds(config.stats_interval));
+                long now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+                stats_log << '[' << now << "]\n" << stats_report() << std::endl;
+            }
         }
 
         // helper function for displaying the entire files index
         void print_files_map() {
-            std::lock_guard<std::mutex> guard(files_index_m);
-            std::cout << "\n__________FILES INDEX__________" << std::endl;
-            for (auto const &file_index : files_index) {
-                std::cout << file_index.first << ':';
+            std::ostringstream files_map;
+            files_map << "\n__________FILES INDEX__________\n";
+            files_index.for_each([&files_map](const std::string &filename, const std::vector<int> &client_ids, const std::vector<uint64_t>&) {
+                files_map << filename << ':';
                 std::string delimiter;
-                for (auto &&client_id : file_index.second) {
-                    std::cout << delimiter << client_id;
+                for (auto &&client_id : client_ids) {
+                    files_map << delimiter << client_id;
                     delimiter = ',';
                 }
-                std::cout << std::endl;
+                files_map << '\n';
+            });
+            files_map << "_______________________________\n";
+            std::cout << files_map.str() << std::endl;
+        }
+
+        // event loop for a single worker, handles reads and pending writes for all of its connections
+        void run_worker(Worker &worker) {
+            struct epoll_event events[MAX_EVENTS];
+            while (1) {
+                int n = epoll_wait(worker.epoll_fd, events, MAX_EVENTS, -1);
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    error("failed epoll wait");
+                }
+
+                for (int i = 0; i < n; i++) {
+                    Connection *conn = static_cast<Connection*>(events[i].data.ptr);
+                    if (events[i].events & EPOLLOUT) {
+                        std::lock_guard<std::mutex> guard(conn->out_m);
+                        if (!conn->closed)
+                            flush_replies(conn);
+                    }
+                    if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                        read_client(worker, conn);
+                }
             }
-            std::cout << "_______________________________\n" << std::endl;
         }
 
     public:
         int socket_fd;
 
-        IndexingServer() {
+        IndexingServer(const ServerConfig &server_config) : config(server_config) {
             struct sockaddr_in addr;
             socklen_t addr_size = sizeof(addr);
             bzero((char*)&addr, addr_size);
-            
+
             addr.sin_family = AF_INET;
             addr.sin_addr.s_addr = INADDR_ANY;
-            addr.sin_port = htons(PORT);
+            addr.sin_port = htons(config.port);
 
             socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+            // allow a restarted server to take the port back right away
+            int reuse = 1;
+            setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
             // bind socket to port to be used for indexing server
             if (bind(socket_fd, (struct sockaddr*)&addr, addr_size) < 0)
                 error("failed server binding");
 
-            std::cout << "starting indexing server on port " << PORT << '\n' << std::endl;
+            // create the fixed set of reactor workers
+            for (int i = 0; i < config.workers; i++) {
+                std::unique_ptr<Worker> worker(new Worker);
+                if ((worker->epoll_fd = epoll_create1(0)) < 0)
+                    error("failed epoll creation");
+                workers.push_back(std::move(worker));
+            }
+
+            std::cout << "starting indexing server on port " << config.port << " with " << config.workers << " worker(s)\n" << std::endl;
 
             // start logging
-            server_log.open("logs/indexing_server/server.log");
+            logger.set_level(config.log_level);
+            logger.set_flush_interval(config.log_flush_ms);
+            logger.set_stdout(config.log_stdout);
+            server_log = logger.open(config.server_log_path, true);
+            logger.start();
+
+            // restore the index from the last run, every peer in it stays provisional until it reconnects
+            if (!config.snapshot_path.empty()) {
+                index_store.reset(new IndexStore(config.snapshot_path));
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                size_t replayed;
+                size_t loaded = index_store->load(files_index, provisional_clients, replayed);
+                long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+                log("index restored", std::to_string(loaded) + " files from snapshot and " + std::to_string(replayed) + " logged operations for " +
+                    std::to_string(provisional_clients.size()) + " provisional client(s) in " + std::to_string(elapsed) + "us");
+                if (!index_store->open_log())
+                    error("failed index log open");
+            }
         }
 
         void run() {
@@ -218,23 +1209,68 @@ class IndexingServer {
             socklen_t addr_size = sizeof(addr);
             int client_socket_fd;
 
+            for (auto &&worker : workers) {
+                std::thread t(&IndexingServer::run_worker, this, std::ref(*worker));
+                t.detach();
+            }
+
+            std::thread l_t(&IndexingServer::expire_leases, this);
+            l_t.detach();
+
+            if (config.peer_lease > 0) {
+                std::thread x_t(&IndexingServer::expire_peers, this);
+                x_t.detach();
+            }
+
+            if (index_store) {
+                std::thread p_t(&IndexingServer::persist_index, this);
+                p_t.detach();
+                std::thread e_t(&IndexingServer::expire_provisional_clients, this);
+                e_t.detach();
+            }
+
+            if (config.stats_interval > 0) {
+                std::thread d_t(&IndexingServer::dump_stats, this);
+                d_t.detach();
+            }
+
+            // listen for any peer connections to start communication
+            if (listen(socket_fd, config.backlog) < 0)
+                error("failed server listen");
+
             std::ostringstream client_identity;
+            size_t next_worker = 0;
             while (1) {
-                // listen for any peer connections to start communication
-                listen(socket_fd, 5);
-
-                if ((client_socket_fd = accept(socket_fd, (struct sockaddr*)&addr, &addr_size)) < 0) {
+                if ((client_socket_fd = accept4(socket_fd, (struct sockaddr*)&addr, &addr_size, SOCK_NONBLOCK)) < 0) {
                     // ignore any failed connections from peer clients
-                    log("failed client connection", "ignoring connection");
+                    log("failed client connection", "ignoring connection", LOG_WARN);
                     continue;
                 }
+                // replies are small and already batched, so don't let them wait on delayed acks
+                int nodelay = 1;
+                setsockopt(client_socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
                 client_identity << inet_ntoa(addr.sin_addr) << '@' << ntohs(addr.sin_port);
                 log("client connected", client_identity.str());
-                
-                // start thread for single client-server communication
-                std::thread t(&IndexingServer::handle_client_requests, this, client_socket_fd);
-                t.detach(); // detaches thread and allows for next connection to be made without waiting
+                stats.accepted++;
+
+                // hand the connection to the next worker, edge-triggered so each wakeup drains the socket
+                Worker &worker = *workers[next_worker++ % workers.size()];
+                std::shared_ptr<Connection> conn = std::make_shared<Connection>(client_socket_fd, client_identity.str());
+                {
+                    std::lock_guard<std::mutex> guard(worker.connections_m);
+                    worker.connections[conn.get()] = conn;
+                }
+
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                event.data.ptr = conn.get();
+                if (epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, client_socket_fd, &event) < 0) {
+                    log("failed client connection", "closing connection", LOG_WARN);
+                    std::lock_guard<std::mutex> guard(worker.connections_m);
+                    worker.connections.erase(conn.get());
+                    close(client_socket_fd);
+                }
 
                 client_identity.str("");
                 client_identity.clear();
@@ -243,13 +1279,93 @@ class IndexingServer {
 
         ~IndexingServer() {
             close(socket_fd);
-            server_log.close();
+            for (auto &&worker : workers)
+                close(worker->epoll_fd);
         }
 };
 
 
-int main() {
-    IndexingServer indexing_server;
+// default file of a server on another port than PORT, so several servers can share the logs directory
+// the port goes in front of the extension, index.snapshot becomes index-10000.snapshot
+std::string instance_path(const std::string &path, int port) {
+    if (port == PORT)
+        return path;
+    size_t extension = path.rfind('.');
+    if (extension == std::string::npos || extension < path.rfind('/') + 1)
+        extension = path.size();
+    return path.substr(0, extension) + '-' + std::to_string(port) + path.substr(extension);
+}
+
+
+int main(int argc, char *argv[]) {
+    ServerConfig config;
+    bool snapshot_path_set = false;
+    config.workers = std::max(1u, std::thread::hardware_concurrency());
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:b:w:s:i:g:e:l:f:qt:")) != -1) {
+        switch (opt) {
+            case 'p':
+                config.port = atoi(optarg);
+                break;
+            case 'b':
+                config.backlog = atoi(optarg);
+                break;
+            case 'w':
+                config.workers = atoi(optarg);
+                break;
+            case 's':
+                config.snapshot_path = optarg;
+                snapshot_path_set = true;
+                break;
+            case 'i':
+                config.snapshot_interval = atoi(optarg);
+                break;
+            case 'g':
+                config.provisional_grace = atoi(optarg);
+                break;
+            case 'e':
+                config.peer_lease = atoi(optarg);
+                break;
+            case 'l':
+                if (!parse_log_level(optarg, config.log_level)) {
+                    std::cerr << "log level must be one of debug, info, warn or error" << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'f':
+                config.log_flush_ms = atoi(optarg);
+                break;
+            case 'q':
+                config.log_stdout = false;
+                break;
+            case 't':
+                config.stats_interval = atoi(optarg);
+                break;
+            default:
+                std::cerr << "usage: " << argv[0] << " [-p port] [-b backlog] [-w workers] [-s snapshot path (empty to disable)] [-i snapshot interval] [-g provisional grace]" << std::endl;
+                std::cerr << "       [-e peer lease (0 to disable)] [-l log level] [-f log flush interval ms] [-q (fast mode, no stdout log mirror)] [-t stats dump interval (0 to disable)]" << std::endl;
+                exit(1);
+        }
+    }
+
+    if (config.port <= 0 || config.port > 65535) {
+        std::cerr << "port must be between 1 and 65535" << std::endl;
+        exit(1);
+    }
+    if (!snapshot_path_set)
+        config.snapshot_path = instance_path(config.snapshot_path, config.port);
+    config.server_log_path = instance_path(config.server_log_path, config.port);
+    config.stats_path = instance_path(config.stats_path, config.port);
+
+    if (config.backlog <= 0 || config.workers <= 0 || config.snapshot_interval <= 0 || config.provisional_grace < 0 || config.log_flush_ms <= 0 ||
+        config.stats_interval < 0 || config.peer_lease < 0) {
+        std::cerr << "backlog, workers, snapshot interval and log flush interval must be positive, and provisional grace, peer lease and "
+                     "stats dump interval cannot be negative" << std::endl;
+        exit(1);
+    }
+
+    IndexingServer indexing_server(config);
     indexing_server.run();
 
     return 0;
@@ -0,0 +1,94 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+
+
+#define HISTOGRAM_SUB_BITS 4 // 16 buckets per power of two, so values are reported within about 6%
+#define HISTOGRAM_BUCKETS (64 << HISTOGRAM_SUB_BITS)
+
+
+// lock-free log-linear latency histogram in the style of HdrHistogram
+// values below 2^HISTOGRAM_SUB_BITS get a bucket each and every power of two above is split into the same
+// number of equal buckets, so recording is a couple of shifts and one relaxed increment from any thread
+class LatencyHistogram {
+    private:
+        std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS];
+        std::atomic<uint64_t> total{0};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> max{0};
+
+        static int bucket_for(uint64_t value) {
+            if (value < (1u << HISTOGRAM_SUB_BITS))
+                return value;
+            int exponent = 63 - __builtin_clzll(value);
+            int sub_bucket = (value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+            return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub_bucket;
+        }
+
+        // highest value that falls into a bucket
+        static uint64_t bucket_value(int bucket) {
+            if (bucket < (1 << HISTOGRAM_SUB_BITS))
+                return bucket;
+            int exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+            uint64_t sub_bucket = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+            uint64_t lowest = ((1ull << HISTOGRAM_SUB_BITS) + sub_bucket) << (exponent - HISTOGRAM_SUB_BITS);
+            return lowest + (1ull << (exponent - HISTOGRAM_SUB_BITS)) - 1;
+        }
+
+    public:
+        LatencyHistogram() {
+            for (auto &&count : counts)
+                count.store(0, std::memory_order_relaxed);
+        }
+
+        void record(uint64_t value) {
+            counts[bucket_for(value)].fetch_add(1, std::memory_order_relaxed);
+            total.fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(value, std::memory_order_relaxed);
+            uint64_t current = max.load(std::memory_order_relaxed);
+            while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+        }
+
+        // record the nanoseconds elapsed since start
+        void record_since(std::chrono::steady_clock::time_point start) {
+            record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        uint64_t count() const {
+            return total.load(std::memory_order_relaxed);
+        }
+
+        uint64_t mean() const {
+            uint64_t n = count();
+            return n ? sum.load(std::memory_order_relaxed) / n : 0;
+        }
+
+        uint64_t maximum() const {
+            return max.load(std::memory_order_relaxed);
+        }
+
+        // value at or below which the fraction p of recorded values fall, 0 if nothing was recorded
+        // read while other threads record, so it is only as consistent as a relaxed snapshot of the buckets
+        uint64_t percentile(double p) const {
+            uint64_t n = 0;
+            for (auto &&count : counts)
+                n += count.load(std::memory_order_relaxed);
+            if (n == 0)
+                return 0;
+            uint64_t target = std::max<uint64_t>(1, (uint64_t)(p * n + 0.5));
+            uint64_t seen = 0;
+            for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                seen += counts[i].load(std::memory_order_relaxed);
+                if (seen >= target)
+                    return std::min(bucket_value(i), maximum());
+            }
+            return maximum();
+        }
+};
+
+#endif
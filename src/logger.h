@@ -0,0 +1,338 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+
+#define LOG_RING_SIZE 1024 // records buffered per thread before new ones are dropped
+#define LOG_TEXT_SIZE 232 // bytes of type and message per record, a longer message goes on in the records after it
+                          // and a type is cut to half of it
+#define LOG_MAX_RECORDS 64 // records one line may span, a message still longer is cut and ends in "..."
+#define LOG_FLUSH_MS 100 // default delay before buffered records are written out
+#define MAX_LOG_SINKS 4
+
+
+enum LogLevel : uint8_t {LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR};
+
+// parse a level name from the command line, returns false for unknown names
+inline bool parse_log_level(const std::string &name, LogLevel &level) {
+    const char *names[] = {"debug", "info", "warn", "error"};
+    for (int i = 0; i <= LOG_ERROR; i++) {
+        if (name == names[i]) {
+            level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// background logger shared by every thread of a process
+//
+// each thread appends fixed size binary records to its own single-producer ring, so logging never takes a
+// lock or touches a file on the calling thread. a background thread wakes every flush interval, drains
+// all rings, orders the records by time and writes each log file with a single write. records are dropped
+// (and counted) instead of blocking when a thread's ring is full
+//
+// lines keep the existing formats: "[time] [type] msg" for log files, "[time] [type] [msg]" when mirrored
+// to stdout and "!key [time] [type] [msg]" for records written with an evaluation key
+class Logger {
+    private:
+        struct Record {
+            uint64_t time; // microseconds since the epoch, taken once when the record is made
+            int32_t key; // evaluation key, -1 for a regular record
+            uint8_t sink;
+            uint8_t level;
+            uint8_t type_size;
+            uint8_t msg_size;
+            uint8_t more; // the message goes on in the next record, which only holds more of it
+            char text[LOG_TEXT_SIZE]; // type followed by msg, neither null terminated
+        };
+
+        static_assert(LOG_TEXT_SIZE <= 255, "record sizes must fit in a byte");
+
+        struct Ring {
+            Record records[LOG_RING_SIZE];
+            std::atomic<uint64_t> head{0}; // next record the owning thread writes
+            std::atomic<uint64_t> tail{0}; // next record the logger thread reads
+            std::atomic<bool> retired{false}; // owning thread exited, free once drained
+        };
+
+        // gives each thread its own ring and retires it when the thread exits
+        struct RingOwner {
+            std::shared_ptr<Ring> ring;
+            ~RingOwner() {
+                if (ring)
+                    ring->retired = true;
+            }
+        };
+
+        struct Sink {
+            int fd = -1;
+            bool mirror = false; // also write to stdout
+            std::string buffer;
+        };
+
+        std::vector<std::shared_ptr<Ring>> rings;
+        std::vector<std::shared_ptr<Ring>> free_rings; // drained rings of exited threads, reused by new threads
+        Sink sinks[MAX_LOG_SINKS];
+        int num_sinks = 0;
+        LogLevel min_level = LOG_INFO;
+        int flush_interval_ms = LOG_FLUSH_MS;
+        bool stdout_enabled = true;
+        bool running = false;
+        std::atomic<uint64_t> dropped{0};
+        std::thread writer;
+
+        std::mutex rings_m;
+        std::mutex flush_m; // serializes draining between the logger thread and explicit flushes
+        std::mutex wake_m;
+        std::condition_variable wake_cv;
+
+        Ring *thread_ring() {
+            static thread_local RingOwner owner;
+            if (!owner.ring) {
+                std::lock_guard<std::mutex> guard(rings_m);
+                if (free_rings.empty()) {
+                    owner.ring.reset(new Ring);
+                }
+                else {
+                    owner.ring = free_rings.back();
+                    free_rings.pop_back();
+                    owner.ring->retired = false;
+                }
+                rings.push_back(owner.ring);
+            }
+            return owner.ring.get();
+        }
+
+        static uint64_t time_now() {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        static void write_fd(int fd, const std::string &data) {
+            size_t written = 0;
+            while (written < data.size()) {
+                ssize_t n = write(fd, data.data() + written, data.size() - written);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                written += n;
+            }
+        }
+
+        // a continuation record only adds its part of the message to the line the records before it started
+        void format(const Record &record, std::string &out, bool mirror, bool continuation) {
+            bool bracketed = mirror || record.key >= 0;
+            if (!continuation) {
+                if (record.key >= 0) {
+                    out += '!';
+                    out += std::to_string(record.key);
+                    out += ' ';
+                }
+                out += '[';
+                out += std::to_string(record.time);
+                out += "] [";
+                out.append(record.text, record.type_size);
+                out += "] ";
+                if (bracketed)
+                    out += '[';
+            }
+            out.append(record.text + record.type_size, record.msg_size);
+            if (!record.more) {
+                if (bracketed)
+                    out += ']';
+                out += "\n\n";
+            }
+        }
+
+        // move every buffered record to its sink and write each sink once
+        void drain() {
+            std::lock_guard<std::mutex> guard(flush_m);
+            std::vector<std::shared_ptr<Ring>> current;
+            {
+                std::lock_guard<std::mutex> guard(rings_m);
+                current = rings;
+            }
+
+            std::vector<Record> batch;
+            std::vector<std::shared_ptr<Ring>> drained;
+            for (auto &&ring : current) {
+                bool retired = ring->retired;
+                uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+                uint64_t head = ring->head.load(std::memory_order_acquire);
+                for (; tail < head; tail++)
+                    batch.push_back(ring->records[tail % LOG_RING_SIZE]);
+                ring->tail.store(tail, std::memory_order_release);
+                if (retired)
+                    drained.push_back(ring);
+            }
+
+            if (!drained.empty()) {
+                std::lock_guard<std::mutex> guard(rings_m);
+                for (auto &&ring : drained) {
+                    rings.erase(std::remove(rings.begin(), rings.end(), ring), rings.end());
+                    free_rings.push_back(ring);
+                }
+            }
+
+            uint64_t lost = dropped.exchange(0);
+            if (batch.empty() && lost == 0)
+                return;
+
+            // records from different threads arrive per ring, put them back in time order
+            std::stable_sort(batch.begin(), batch.end(), [](const Record &a, const Record &b) { return a.time < b.time; });
+
+            // the records of one line share their time and ring, so sorting leaves them next to each other
+            std::string mirrored;
+            bool continuation = false;
+            for (auto &&record : batch) {
+                Sink &sink = sinks[record.sink];
+                format(record, sink.buffer, false, continuation);
+                if (sink.mirror && stdout_enabled)
+                    format(record, mirrored, true, continuation);
+                continuation = record.more;
+            }
+            if (lost > 0 && num_sinks > 0) {
+                Record record;
+                std::string type = "log records dropped";
+                make_record(record, time_now(), 0, LOG_WARN, type, std::to_string(lost), 0, -1);
+                format(record, sinks[0].buffer, false, false);
+            }
+
+            for (int i = 0; i < num_sinks; i++) {
+                if (sinks[i].fd >= 0 && !sinks[i].buffer.empty())
+                    write_fd(sinks[i].fd, sinks[i].buffer);
+                sinks[i].buffer.clear();
+            }
+            if (!mirrored.empty())
+                write_fd(STDOUT_FILENO, mirrored);
+        }
+
+        // fill a record with type and as much of msg from offset as fits, returns where the next record goes on
+        // continuation records are made with an empty type
+        static size_t make_record(Record &record, uint64_t time, int sink, LogLevel level, const std::string &type, const std::string &msg,
+                                  size_t offset, int key) {
+            record.time = time;
+            record.key = key;
+            record.sink = sink;
+            record.level = level;
+            record.type_size = std::min<size_t>(type.size(), LOG_TEXT_SIZE / 2);
+            record.msg_size = std::min<size_t>(msg.size() - offset, LOG_TEXT_SIZE - record.type_size);
+            record.more = offset + record.msg_size < msg.size();
+            memcpy(record.text, type.data(), record.type_size);
+            memcpy(record.text + record.type_size, msg.data() + offset, record.msg_size);
+            return offset + record.msg_size;
+        }
+
+        void run() {
+            std::unique_lock<std::mutex> guard(wake_m);
+            while (running) {
+                wake_cv.wait_for(guard, std::chrono::milliseconds(flush_interval_ms));
+                guard.unlock();
+                drain();
+                guard.lock();
+            }
+        }
+
+    public:
+        // open a log file to write records to, returns the sink id to log with or -1 on failure
+        // mirrored sinks are also written to stdout unless stdout is disabled
+        int open(const std::string &path, bool mirror=false) {
+            if (num_sinks == MAX_LOG_SINKS)
+                return -1;
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            sinks[num_sinks].fd = fd;
+            sinks[num_sinks].mirror = mirror;
+            return num_sinks++;
+        }
+
+        void set_level(LogLevel level) {
+            min_level = level;
+        }
+
+        void set_flush_interval(int interval_ms) {
+            flush_interval_ms = std::max(1, interval_ms);
+        }
+
+        // fast mode skips the stdout mirror entirely
+        void set_stdout(bool enabled) {
+            stdout_enabled = enabled;
+        }
+
+        bool enabled(LogLevel level) const {
+            return level >= min_level;
+        }
+
+        void start() {
+            running = true;
+            writer = std::thread(&Logger::run, this);
+        }
+
+        // queue a line from the calling thread, never blocks
+        // a long message takes as many records as it needs, published together so the logger thread drains them at once
+        void log(int sink, LogLevel level, const std::string &type, const std::string &msg, int key=-1) {
+            if (level < min_level || sink < 0)
+                return;
+            size_t first = LOG_TEXT_SIZE - std::min<size_t>(type.size(), LOG_TEXT_SIZE / 2);
+            size_t count = 1;
+            if (msg.size() > first)
+                count += (msg.size() - first + LOG_TEXT_SIZE - 1) / LOG_TEXT_SIZE;
+            bool cut = count > LOG_MAX_RECORDS;
+            count = std::min<size_t>(count, LOG_MAX_RECORDS);
+
+            Ring *ring = thread_ring();
+            uint64_t head = ring->head.load(std::memory_order_relaxed);
+            if (head - ring->tail.load(std::memory_order_acquire) + count > LOG_RING_SIZE) {
+                dropped++;
+                return;
+            }
+            uint64_t time = time_now();
+            size_t offset = 0;
+            std::string no_type;
+            for (size_t i = 0; i < count; i++)
+                offset = make_record(ring->records[(head + i) % LOG_RING_SIZE], time, sink, level, i == 0 ? type : no_type, msg, offset, key);
+            if (cut) {
+                Record &last = ring->records[(head + count - 1) % LOG_RING_SIZE];
+                last.more = false;
+                memcpy(last.text + last.type_size + last.msg_size - 3, "...", 3);
+            }
+            ring->head.store(head + count, std::memory_order_release);
+        }
+
+        // write everything queued so far, used before exiting
+        void flush() {
+            drain();
+        }
+
+        ~Logger() {
+            if (running) {
+                {
+                    std::lock_guard<std::mutex> guard(wake_m);
+                    running = false;
+                }
+                wake_cv.notify_all();
+                writer.join();
+            }
+            drain();
+            for (int i = 0; i < num_sinks; i++) {
+                if (sinks[i].fd >= 0)
+                    close(sinks[i].fd);
+            }
+        }
+};
+
+#endif
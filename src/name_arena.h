@@ -0,0 +1,69 @@
+#ifndef NAME_ARENA_H
+#define NAME_ARENA_H
+
+#include <stdint.h>
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+
+#define ARENA_CHUNK_BITS 16
+#define ARENA_CHUNK (1 << ARENA_CHUNK_BITS) // bytes per arena chunk
+
+
+// append-only store for name bytes that hands out 32-bit offsets instead of pointers
+// bytes go into fixed chunks so growing never moves what is already stored, and a block larger than a chunk
+// gets an allocation of its own that takes up as many offsets as its size
+// released bytes are only counted, callers reclaim them by copying what is still used into a new arena
+class NameArena {
+    private:
+        std::vector<std::unique_ptr<char[]>> blocks; // owned allocations
+        std::vector<char*> chunks; // where each run of ARENA_CHUNK offsets starts
+        uint64_t used = 0; // offset the next allocation starts at
+        uint64_t dead = 0; // bytes released since the arena was filled
+
+    public:
+        // reserve size bytes that stay at the same address, returns their offset and points bytes at them
+        uint32_t allocate(size_t size, char *&bytes) {
+            uint64_t room = (uint64_t)chunks.size() * ARENA_CHUNK - used;
+            if (chunks.empty() || size > room) {
+                // the rest of the last chunk is wasted, an allocation never straddles two blocks
+                uint64_t span = std::max<uint64_t>(1, (size + ARENA_CHUNK - 1) / ARENA_CHUNK);
+                used = (uint64_t)chunks.size() * ARENA_CHUNK;
+                if (used + span * ARENA_CHUNK > UINT32_MAX)
+                    throw std::length_error("name arena full");
+                blocks.emplace_back(new char[span * ARENA_CHUNK]);
+                for (uint64_t i = 0; i < span; i++)
+                    chunks.push_back(blocks.back().get() + i * ARENA_CHUNK);
+            }
+            uint32_t offset = used;
+            used += size;
+            bytes = at(offset);
+            return offset;
+        }
+
+        uint32_t add(const char *data, size_t size) {
+            char *bytes;
+            uint32_t offset = allocate(size, bytes);
+            std::copy(data, data + size, bytes);
+            return offset;
+        }
+
+        char *at(uint32_t offset) const {
+            return chunks[offset >> ARENA_CHUNK_BITS] + (offset & (ARENA_CHUNK - 1));
+        }
+
+        // mark bytes as no longer used
+        void release(size_t size) {
+            dead += size;
+        }
+
+        // true once at least half of the arena is released bytes, so copying out the rest is worth it
+        bool fragmented() const {
+            return dead > ARENA_CHUNK && dead * 2 > used;
+        }
+};
+
+#endif
@@ -0,0 +1,363 @@
+#ifndef NAME_TRIE_H
+#define NAME_TRIE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <functional>
+
+#include "name_arena.h"
+
+
+// literal part of a glob pattern before its first wildcard, every match starts with it
+inline std::string glob_prefix(const std::string &pattern) {
+    return pattern.substr(0, pattern.find_first_of("*?["));
+}
+
+// match a name against a glob pattern: '*' matches any run of characters, '?' any single character and
+// '[...]' any character in the set, which may hold ranges like a-z and is negated by a leading '!'
+inline bool glob_match(const std::string &pattern, const std::string &name) {
+    size_t p = 0, n = 0;
+    size_t star = std::string::npos, star_n = 0; // last '*' seen and where in name it started matching
+    while (n < name.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            star_n = n;
+            continue;
+        }
+        if (p < pattern.size() && pattern[p] == '[') {
+            size_t q = p + 1;
+            bool negate = q < pattern.size() && pattern[q] == '!';
+            if (negate)
+                q++;
+            bool matched = false;
+            // a ']' right after the opening bracket is part of the set
+            for (bool first = true; q < pattern.size() && (first || pattern[q] != ']'); first = false) {
+                if (q + 2 < pattern.size() && pattern[q + 1] == '-' && pattern[q + 2] != ']') {
+                    matched |= pattern[q] <= name[n] && name[n] <= pattern[q + 2];
+                    q += 3;
+                }
+                else {
+                    matched |= pattern[q++] == name[n];
+                }
+            }
+            // an unterminated set is taken literally
+            if (q < pattern.size() && matched != negate) {
+                p = q + 1;
+                n++;
+                continue;
+            }
+            if (q >= pattern.size() && pattern[p] == name[n]) {
+                p++;
+                n++;
+                continue;
+            }
+        }
+        else if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+            continue;
+        }
+        // mismatch, let the last '*' swallow one more character
+        if (star == std::string::npos)
+            return false;
+        p = star + 1;
+        n = ++star_n;
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+        p++;
+    return p == pattern.size();
+}
+
+
+#define TRIE_NODE_CHUNK 4096 // nodes allocated at a time
+
+
+// set of names kept as a compressed radix tree, so every name sharing a prefix sits in one subtree
+// children are sorted, which makes walking a subtree visit names in order and lets a scan resume after
+// any name without remembering anything between calls
+// nodes live in fixed chunks and refer to each other by index, and edge labels are ranges of one arena,
+// so a name costs a node or two and its own bytes rather than several allocations
+// the empty name is never stored, so an empty cursor can always mean the start or the end of a scan
+// not thread safe, callers hold their own lock
+class NameTrie {
+    private:
+        static const uint32_t NONE = UINT32_MAX;
+        static const uint32_t TERMINAL = 1u << 31; // set in a node's length when a name ends there
+
+        struct Node {
+            uint32_t label; // arena offset of the bytes on the edge leading to this node
+            uint32_t length; // number of bytes on the edge, with TERMINAL set if a name ends here
+            uint32_t child; // first child, children are chained through sibling in order of their first byte
+            uint32_t sibling; // next child of the same parent, or the next free node once freed
+            char first; // first byte of the label, so finding a child never touches the arena
+        };
+
+        // where a node hangs in its parent's chain of children
+        struct Link {
+            uint32_t parent;
+            uint32_t prev; // child before it, NONE if it is the first
+            uint32_t node;
+        };
+
+        // state of a single scan
+        struct Scan {
+            const std::string &after;
+            size_t limit;
+            size_t scan_limit;
+            const std::function<bool(const std::string&)> &match;
+            std::vector<std::string> &names;
+            size_t scanned = 0;
+            std::string cursor;
+        };
+
+        std::vector<std::unique_ptr<Node[]>> chunks;
+        uint32_t allocated = 0; // nodes handed out from chunks, node 0 is the root
+        uint32_t free_nodes = NONE;
+        NameArena labels;
+        size_t count = 0;
+
+        Node &node(uint32_t index) const {
+            return chunks[index / TRIE_NODE_CHUNK][index % TRIE_NODE_CHUNK];
+        }
+
+        static size_t length(const Node &node) {
+            return node.length & ~TERMINAL;
+        }
+
+        uint32_t new_node(uint32_t label, uint32_t length, char first) {
+            uint32_t index = free_nodes;
+            if (index != NONE) {
+                free_nodes = node(index).sibling;
+            }
+            else {
+                if (allocated % TRIE_NODE_CHUNK == 0)
+                    chunks.emplace_back(new Node[TRIE_NODE_CHUNK]);
+                index = allocated++;
+            }
+            node(index) = Node{label, length, NONE, NONE, first};
+            return index;
+        }
+
+        // the node's label bytes are left for the caller to release
+        void free_node(uint32_t index) {
+            node(index).sibling = free_nodes;
+            free_nodes = index;
+        }
+
+        // find the child of parent whose label starts with first, or where one would be linked in
+        // returns the child, or the one that would follow it, and leaves the child before it in prev
+        uint32_t find_child(uint32_t parent, char first, uint32_t &prev) const {
+            prev = NONE;
+            uint32_t child = node(parent).child;
+            while (child != NONE && (unsigned char)node(child).first < (unsigned char)first) {
+                prev = child;
+                child = node(child).sibling;
+            }
+            return child;
+        }
+
+        // point whatever came before a child in its parent's chain at next
+        void relink(uint32_t parent, uint32_t prev, uint32_t next) {
+            if (prev == NONE)
+                node(parent).child = next;
+            else
+                node(prev).sibling = next;
+        }
+
+        // drop a node that no longer leads to any name, or fold a node with a single child into that child
+        // returns true if the node was dropped, which leaves its parent with one child less
+        bool compact(const Link &link) {
+            Node &current = node(link.node);
+            if (current.length & TERMINAL)
+                return false;
+            if (current.child == NONE) {
+                relink(link.parent, link.prev, current.sibling);
+                labels.release(length(current));
+                free_node(link.node);
+                return true;
+            }
+            Node &child = node(current.child);
+            if (child.sibling != NONE)
+                return false;
+            // a label split off this one is usually still right after it in the arena
+            size_t joined = length(current) + length(child);
+            if (current.label + length(current) != child.label || labels.at(current.label) + length(current) != labels.at(child.label)) {
+                char *bytes;
+                uint32_t label = labels.allocate(joined, bytes);
+                std::copy(labels.at(current.label), labels.at(current.label) + length(current), bytes);
+                std::copy(labels.at(child.label), labels.at(child.label) + length(child), bytes + length(current));
+                labels.release(joined);
+                current.label = label;
+            }
+            child.label = current.label;
+            child.length = (child.length & TERMINAL) | joined;
+            child.first = current.first;
+            child.sibling = current.sibling;
+            relink(link.parent, link.prev, current.child);
+            free_node(link.node);
+            return false;
+        }
+
+        // copy every label still in use into a fresh arena
+        void repack(uint32_t parent, NameArena &packed) {
+            for (uint32_t child = node(parent).child; child != NONE; child = node(child).sibling) {
+                Node &current = node(child);
+                current.label = packed.add(labels.at(current.label), length(current));
+                repack(child, packed);
+            }
+        }
+
+        // walk a subtree in order, returns true once the scan should stop
+        // bounded is set while names in the subtree may still sort at or before scan.after
+        bool walk(uint32_t index, std::string &path, bool bounded, Scan &scan) const {
+            if (bounded) {
+                if (scan.after.compare(0, path.size(), path) != 0) {
+                    // every name below starts with path, so they all sort on the same side of scan.after
+                    if (path < scan.after)
+                        return false;
+                    bounded = false;
+                }
+            }
+            // a path that is a prefix of scan.after sorts at or before it
+            if ((node(index).length & TERMINAL) && !bounded) {
+                scan.scanned++;
+                if (scan.match(path))
+                    scan.names.push_back(path);
+                if (scan.names.size() >= scan.limit || scan.scanned >= scan.scan_limit) {
+                    scan.cursor = path;
+                    return true;
+                }
+            }
+            for (uint32_t child = node(index).child; child != NONE; child = node(child).sibling) {
+                const Node &current = node(child);
+                path.append(labels.at(current.label), length(current));
+                bool stop = walk(child, path, bounded, scan);
+                path.resize(path.size() - length(current));
+                if (stop)
+                    return true;
+            }
+            return false;
+        }
+
+    public:
+        NameTrie() {
+            new_node(0, 0, 0);
+        }
+
+        // returns false if the name was already present or is empty
+        bool insert(const std::string &name) {
+            if (name.empty())
+                return false;
+            uint32_t parent = 0;
+            size_t i = 0;
+            while (i < name.size()) {
+                uint32_t prev;
+                uint32_t child = find_child(parent, name[i], prev);
+                if (child == NONE || node(child).first != name[i]) {
+                    uint32_t leaf = new_node(labels.add(name.data() + i, name.size() - i), (name.size() - i) | TERMINAL, name[i]);
+                    node(leaf).sibling = child;
+                    relink(parent, prev, leaf);
+                    count++;
+                    return true;
+                }
+
+                Node &current = node(child);
+                const char *label = labels.at(current.label);
+                size_t common = 0;
+                while (common < length(current) && i + common < name.size() && label[common] == name[i + common])
+                    common++;
+                if (common < length(current)) {
+                    // split the edge where the name leaves it, both halves keep their bytes where they are
+                    uint32_t split = new_node(current.label, common, current.first);
+                    node(split).child = child;
+                    node(split).sibling = current.sibling;
+                    relink(parent, prev, split);
+                    current.label += common;
+                    current.length -= common;
+                    current.first = label[common];
+                    current.sibling = NONE;
+                    child = split;
+                }
+                parent = child;
+                i += common;
+            }
+            if (node(parent).length & TERMINAL)
+                return false;
+            node(parent).length |= TERMINAL;
+            count++;
+            return true;
+        }
+
+        // returns false if the name was not present
+        bool erase(const std::string &name) {
+            if (name.empty())
+                return false;
+            Link last{NONE, NONE, NONE}, before_last{NONE, NONE, NONE}; // the last two steps on the way down
+            uint32_t parent = 0;
+            size_t i = 0;
+            while (i < name.size()) {
+                uint32_t prev;
+                uint32_t child = find_child(parent, name[i], prev);
+                if (child == NONE || node(child).first != name[i])
+                    return false;
+                const Node &current = node(child);
+                if (name.size() - i < length(current) || !std::equal(name.begin() + i, name.begin() + i + length(current), labels.at(current.label)))
+                    return false;
+                before_last = last;
+                last = Link{parent, prev, child};
+                i += length(current);
+                parent = child;
+            }
+            if (!(node(parent).length & TERMINAL))
+                return false;
+            node(parent).length &= ~TERMINAL;
+            count--;
+
+            // removing the node can leave its parent with a single child, so compact both
+            if (compact(last) && before_last.node != NONE)
+                compact(before_last);
+            if (labels.fragmented()) {
+                NameArena packed;
+                repack(0, packed);
+                labels = std::move(packed);
+            }
+            return true;
+        }
+
+        size_t size() const {
+            return count;
+        }
+
+        // collect names in order that start with prefix, sort after the name given as after and pass match,
+        // stopping once limit names were collected or scan_limit names were looked at
+        // returns the last name looked at when it stopped early, to pass as after for the next page, or an
+        // empty string once every candidate was visited
+        std::string scan(const std::string &prefix, const std::string &after, size_t limit, size_t scan_limit,
+                         const std::function<bool(const std::string&)> &match, std::vector<std::string> &names) const {
+            // find the subtree holding every name that starts with prefix, it may end partway down an edge
+            uint32_t parent = 0;
+            std::string path;
+            while (path.size() < prefix.size()) {
+                uint32_t prev;
+                uint32_t child = find_child(parent, prefix[path.size()], prev);
+                if (child == NONE || node(child).first != prefix[path.size()])
+                    return std::string();
+                const Node &current = node(child);
+                size_t compared = std::min(length(current), prefix.size() - path.size());
+                if (prefix.compare(path.size(), compared, labels.at(current.label), compared) != 0)
+                    return std::string();
+                path.append(labels.at(current.label), length(current));
+                parent = child;
+            }
+
+            Scan state{after, std::max<size_t>(limit, 1), std::max<size_t>(scan_limit, 1), match, names, 0, std::string()};
+            walk(parent, path, !after.empty(), state);
+            return state.cursor;
+        }
+};
+
+#endif
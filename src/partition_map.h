@@ -0,0 +1,70 @@
+#ifndef PARTITION_MAP_H
+#define PARTITION_MAP_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "content_hash.h"
+
+
+#define PARTITION_VNODES 64 // points every indexing server gets on the hash ring, more points even out the share of each server
+
+
+// assignment of filenames to indexing servers by consistent hashing
+// every server is placed at PARTITION_VNODES points of a 64-bit ring and a filename belongs to the first point at or
+// after its own hash, wrapping around. adding or removing a server only moves the filenames between its points and
+// the ones before them, so a peer rebalancing onto a changed map re-registers about 1/N of its files
+class PartitionMap {
+    private:
+        std::vector<int> ports; // sorted, without duplicates
+        std::vector<std::pair<uint64_t, int>> ring; // points by hash, each with the port of its server
+
+        static uint64_t name_hash(const std::string &filename) {
+            return xxh64::hash(filename.data(), filename.size(), 0);
+        }
+
+    public:
+        PartitionMap() {}
+
+        explicit PartitionMap(std::vector<int> server_ports) : ports(std::move(server_ports)) {
+            std::sort(ports.begin(), ports.end());
+            ports.erase(std::unique(ports.begin(), ports.end()), ports.end());
+            for (int port : ports) {
+                for (int i = 0; i < PARTITION_VNODES; i++) {
+                    std::string point = std::to_string(port) + '#' + std::to_string(i);
+                    ring.emplace_back(name_hash(point), port);
+                }
+            }
+            std::sort(ring.begin(), ring.end());
+        }
+
+        // port of the server holding filename, 0 if the map is empty
+        int server_for(const std::string &filename) const {
+            if (ring.empty())
+                return 0;
+            auto point = std::lower_bound(ring.begin(), ring.end(), std::make_pair(name_hash(filename), 0));
+            return point == ring.end() ? ring.front().second : point->second;
+        }
+
+        const std::vector<int> &servers() const {
+            return ports;
+        }
+
+        bool empty() const {
+            return ports.empty();
+        }
+
+        bool operator==(const PartitionMap &other) const {
+            return ports == other.ports;
+        }
+
+        bool operator!=(const PartitionMap &other) const {
+            return ports != other.ports;
+        }
+};
+
+#endif
@@ -1,27 +1,73 @@
 #include <string.h>
+#include <signal.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <dirent.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/sendfile.h>
+#include <sys/epoll.h>
 
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <unordered_map>
+#include <unordered_set>
 #include <iostream>
 #include <sstream>
+#include <fstream>
 #include <vector>
+#include <deque>
+#include <list>
 #include <algorithm>
 #include <chrono>
-#include <fstream>
 
+#include "protocol.h"
+#include "logger.h"
+#include "content_hash.h"
+#include "partition_map.h"
 
 #define HOST "localhost" // assume all connections happen on same machine
 #define INDEXING_SERVER_PORT 9999 // default chosen from indexing_server source code
+#define REQUEST_SERVER_BITS 16 // low bits of a request id holding the port of the indexing server it was sent to
 #define MAX_FILENAME_SIZE 256 // assume the maximum file size is 256 characters
 #define MAX_MSG_SIZE 4096
 #define MAX_STAT_MSG_SIZE 16
+#define SYNC_INTERVAL 30 // seconds between syncs with the indexing server when no files change
+#define LOAD_REPORT_INTERVAL 5 // seconds between checks whether the upload load changed enough to report it before the next sync
+#define SYNC_DEBOUNCE_MS 10 // delay for batching a burst of file changes into one sync
+#define DIRENTS_BUFFER_SIZE 65536
+#define INOTIFY_BUFFER_SIZE 65536
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB)
+#define RESCAN_INTERVAL 5 // seconds between rescans of the files directory when it cannot be watched
+#define SWARM_CHUNK_SIZE (1 << 20) // bytes fetched per ranged request in a swarm download
+#define MAX_SWARM_SOURCES 8 // peers a swarm download fetches from at once
+#define SWARM_SOURCE_TIMEOUT 10 // seconds a source may stall before its chunk is handed to another source
+#define UPLOAD_SLICE_SIZE 65536 // bytes sent per sendfile call, and per throttling step when uploads are limited
+#define DOWNLOAD_BUFFER_SIZE (1 << 20) // bytes copied per read when a download cannot splice into the file
+#define SPLICE_PIPE_SIZE (1 << 20) // capacity asked for the pipe a download splices through
+#define TRANSFER_SOCKET_BUFFER (1 << 20) // default socket send and receive buffers for peer to peer transfers
+#define UPLOAD_WORKERS 4 // default number of requests the peer server serves at once
+#define UPLOAD_QUEUE_SIZE 32 // default number of requests waiting for a worker before new ones are turned away
+#define UPLOAD_IDLE_TIMEOUT 30 // seconds a kept-alive connection may sit idle between requests before it is closed
+#define UPLOAD_REQUEST_TIMEOUT 10 // seconds a peer client may take to finish sending a request it started
+#define MAX_UPLOAD_EVENTS 64
+#define PEER_CONNECTION_TTL 20 // seconds an idle connection to another peer is kept, under the peer server's idle timeout
+#define MAX_IDLE_CONNECTIONS 4 // idle connections kept per peer
+#define PARTIAL_SUFFIX ".partial" // downloads in progress are written to filename + PARTIAL_SUFFIX
+#define PROGRESS_SUFFIX ".progress" // sidecar next to a partial file recording which chunks are done
+#define PROGRESS_MAGIC "PA1PART1"
+#define PROGRESS_HEADER_SIZE 24 // PROGRESS_MAGIC, 8 byte file size and 8 byte chunk size, followed by a bitmap of done chunks
+#define HASH_CACHE_NAME ".hash_cache" // content hashes of the shared files, kept in the files directory but never shared
+#define HASH_CACHE_MAGIC "PA1HASH1" // followed by records of 8 byte inode, modified time in ns, size and content hash
+#define SEARCH_CACHE_SIZE (1 << 20) // default bytes of leased search results kept
+#define SEARCH_CACHE_OVERHEAD 128 // bytes counted per cached search on top of its filename, peer ids and hashes
 
 
 //global counters used only for logging special messages used for later anlaysis
@@ -29,227 +75,1526 @@ int search_request_counter = 0;
 int retrieve_request_counter = 0;
 
 
+// result of a search sent to the indexing server, ok is false if the server could not be reached
+struct SearchResult {
+    bool ok = false;
+    std::vector<int> client_ids;
+    std::vector<uint64_t> content_hashes; // content hash each peer registered, 0 if unknown
+};
+
+
+// a search result kept until its lease runs out or the indexing server invalidates it
+struct CachedSearch {
+    SearchResult result;
+    std::chrono::steady_clock::time_point expires;
+    size_t bytes;
+    std::list<std::string>::iterator lru; // position in the recency list
+};
+
+
+// a file's content as of one write, a file that still has the same version still has the same content hash
+struct FileVersion {
+    uint64_t inode;
+    int64_t modified; // nanoseconds
+    uint64_t size;
+
+    bool operator==(const FileVersion &other) const {
+        return inode == other.inode && modified == other.modified && size == other.size;
+    }
+};
+
+struct FileVersionHash {
+    size_t operator()(const FileVersion &version) const {
+        return std::hash<uint64_t>()(version.inode * 31 + version.modified) ^ version.size;
+    }
+};
+
+
+// one page of a pattern search, ok is false if the server could not be reached
+struct PatternPage {
+    bool ok = false;
+    std::string cursor; // passed back for the next page, empty on the last one
+    std::vector<std::pair<std::string, std::vector<int>>> files; // matching filenames and the peers with them
+};
+
+
+// settings for a peer, most can be changed from the command line
+struct PeerConfig {
+    int port = 0; // peer server port and client id, random if 0
+    LogLevel log_level = LOG_INFO;
+    int log_flush_ms = LOG_FLUSH_MS;
+    long upload_limit = 0; // bytes per second shared by all uploads, 0 for no limit
+    int socket_buffer = TRANSFER_SOCKET_BUFFER; // bytes, 0 leaves buffer sizes to the kernel
+    bool splice_downloads = true; // move downloaded data straight from sockets into files instead of copying it
+    int upload_workers = UPLOAD_WORKERS;
+    size_t upload_queue = UPLOAD_QUEUE_SIZE;
+    size_t search_cache = SEARCH_CACHE_SIZE; // bytes of search results kept, 0 to always ask the indexing server
+    std::string index_servers = std::to_string(INDEXING_SERVER_PORT); // indexing server ports separated by commas,
+                                                                      // or '@' and a file listing them
+};
+
+
+// upload load reported to the indexing server with every sync, so it can point downloads at less busy peers
+struct UploadLoad {
+    uint64_t active = 0; // uploads in progress or waiting for a worker, averaged over the last interval
+    uint64_t throughput = 0; // bytes per second sent over the last interval
+
+    // loads that differ this little are not worth an early report
+    bool similar(const UploadLoad &other) const {
+        return active == other.active && 64 - __builtin_clzll(throughput | 1) == 64 - __builtin_clzll(other.throughput | 1);
+    }
+};
+
+
+// a connection to one of the indexing servers the filename space is partitioned across
+// the registration state is only used by the updater, user requests just share the connection
+struct IndexServer {
+    int port;
+    int socket_fd;
+    FrameReader reader; // replies from the server, only used by its reader thread
+    std::atomic<bool> closed{false}; // the reader stopped, set under the peer's pending_m so no request is left waiting on it
+    std::atomic<bool> drifted{false}; // the server asked for every file it holds to be resent
+    uint64_t generation = 0;
+    std::unordered_map<std::string, FileVersion> registered_files; // files the server knows about and the version it last got
+    std::mutex send_m; // keeps frames from the updater and user requests from interleaving
+
+    IndexServer(int server_port, int fd) : port(server_port), socket_fd(fd), reader(fd) {}
+
+    ~IndexServer() {
+        close(socket_fd);
+    }
+};
+
+
+// an idle ranged connection to another peer's server, kept for the next download from it
+struct IdleConnection {
+    int socket_fd;
+    std::chrono::steady_clock::time_point idle_since;
+};
+
+
+// a connection to the peer server, kept open between ranged requests
+// while idle it waits in the peer server's epoll set, and once a request arrives it is queued for a worker
+struct UploadConnection {
+    int socket_fd;
+    std::string identity;
+    FrameReader reader;
+    bool ranged = false; // the ranged request marker was recieved, legacy connections are served once and closed
+    bool busy = false; // queued or being served, so not idle
+    int file_fd = -1; // ranged requests usually ask for the same file, so it stays open between them
+    std::string open_filename;
+    std::chrono::steady_clock::time_point last_active;
+
+    UploadConnection(int fd, std::string client_identity) : socket_fd(fd), identity(client_identity), reader(fd) {}
+};
+
+
+// one peer server a swarm download fetches ranges from
+struct SwarmSource {
+    int port;
+    int socket_fd;
+    FrameReader reader;
+    uint64_t received = 0; // bytes of chunks this source completed
+    bool healthy = true; // still in step with the source, so the connection can be reused
+    int pipe_fds[2] = {-1, -1}; // pipe received ranges are spliced through, -1 when copying through a buffer
+    bool splice_to_file = true; // cleared if the file system cannot be spliced into
+
+    SwarmSource(int source_port, int fd) : port(source_port), socket_fd(fd), reader(fd) {}
+};
+
+
+// shared state of a download split into chunks fetched from several peers at once
+// sources pull the next pending chunk whenever they finish one, so faster sources end up serving more of
+// the file. once nothing is pending, idle sources also fetch chunks still in flight on slower ones and
+// whichever copy arrives first completes the chunk
+struct SwarmDownload {
+    enum ChunkState : uint8_t {CHUNK_PENDING, CHUNK_ACTIVE, CHUNK_DONE};
+
+    std::string filename;
+    int file_fd;
+    uint64_t file_size;
+    std::vector<ChunkState> chunks;
+    std::vector<uint8_t> fetching; // number of sources currently fetching each chunk
+    size_t next_pending = 0; // no chunk before this one is pending
+    size_t done = 0;
+    int progress_fd = -1; // progress sidecar
+    std::string progress; // bitmap of done chunks, mirrored in the sidecar
+
+    std::mutex m;
+    std::condition_variable cv;
+};
+
+
+// outcome of a download, reported to the user by whichever request started it
+struct DownloadResult {
+    enum Status {OK, NO_SOURCE, BUSY, NOT_FOUND, UNREADABLE, FILE_ERROR, FAILED, PRESENT, CORRUPT};
+
+    Status status = NO_SOURCE;
+    std::string local_filename; // also the file already holding the content when it was PRESENT
+    uint64_t file_size = 0;
+    uint64_t resumed = 0; // bytes already downloaded by an earlier attempt
+    uint64_t completed = 0; // bytes on disk once the download stopped
+    double seconds = 0;
+    std::vector<std::pair<int, uint64_t>> sources; // bytes recieved from each source peer
+};
+
+
 class Peer {
     private:
-        std::vector<std::pair<std::string, time_t>> files; // vector of all files within a peer's directory
-        std::ofstream server_log;
-        std::ofstream client_log;
+        std::unordered_map<std::string, FileVersion> files; // all files within a peer's directory and their current version
+        bool files_changed = false; // set by the watcher when files differ from what was last synced
+        int inotify_fd = -1; // watch on the files directory, -1 if it failed and the directory is rescanned instead
+        std::unordered_map<FileVersion, uint64_t, FileVersionHash> hash_cache; // content hashes by file version, so unchanged files are never read again
+        std::unordered_map<std::string, FileVersion> file_versions; // version each file had when it was last hashed
+        bool hash_cache_changed = false;
+        Logger logger;
+        int server_log = -1; // logger sinks for the peer server and client logs
+        int client_log = -1;
+        std::shared_ptr<const PartitionMap> partition_map; // which indexing server holds which filenames
+        std::unordered_map<int, std::shared_ptr<IndexServer>> index_servers; // connections to the servers in the partition map by port
+        int64_t servers_file_modified = -1; // modified time in ns of the servers file the partition map was last read from
+        std::unordered_map<uint64_t, std::function<void(const SearchResult&)>> pending_searches; // searches in flight by request id
+        std::unordered_map<uint64_t, std::shared_ptr<std::promise<std::string>>> pending_stats; // stats requests in flight by request id
+        std::unordered_map<uint64_t, std::shared_ptr<std::promise<PatternPage>>> pending_patterns; // pattern search pages in flight by request id
+        std::unordered_map<uint64_t, std::shared_ptr<std::promise<std::vector<SearchResult>>>> pending_batches; // batch searches in flight by request id
+        std::unordered_set<std::string> watched_files; // filenames the indexing server pushes holder changes for
+        std::unordered_map<uint64_t, std::pair<std::string, std::chrono::steady_clock::time_point>> pending_leases; // filename and send time
+                                                                                                            // of leased searches in flight
+        std::unordered_map<std::string, CachedSearch> search_cache; // leased search results by filename
+        std::list<std::string> search_lru; // cached filenames, most recently used first
+        size_t search_cache_bytes = 0;
+        uint64_t search_cache_hits = 0;
+        uint64_t search_cache_misses = 0;
+        uint64_t next_request_id = 0;
+        std::atomic<bool> resync_needed{false}; // wakes the updater to resend drifted files or reconnect a server
 
-        std::mutex log_m;
+        PeerConfig config;
+        std::chrono::steady_clock::time_point upload_next; // earliest time the next upload slice may be sent
+        std::atomic<int> uploads_active{0}; // requests being served by upload workers
+        std::atomic<uint64_t> upload_busy_ns{0}; // time upload workers spent serving requests
+        std::atomic<uint64_t> uploaded_bytes{0};
+        std::chrono::steady_clock::time_point load_sampled = std::chrono::steady_clock::now(); // where the last upload load sample
+        uint64_t load_sampled_busy_ns = 0;                                                    // left off, only used by the updater
+        uint64_t load_sampled_bytes = 0;
+        std::chrono::steady_clock::time_point last_sync = std::chrono::steady_clock::now(); // when every server last heard a sync,
+                                                                                           // only used by the updater
 
-        // helper function for getting the current time to microsecond-accuracy as a string
-        std::string time_now() {
-            std::chrono::high_resolution_clock::duration now = std::chrono::high_resolution_clock::now().time_since_epoch();
-            std::chrono::microseconds now_ms = std::chrono::duration_cast<std::chrono::microseconds>(now);
-            return std::to_string(now_ms.count());
-        }
+        struct sockaddr_in host_addr; // HOST resolved once, every connection only differs in its port
+        std::unordered_map<int, std::vector<IdleConnection>> idle_connections; // ranged connections to other peers by port
+        int upload_epoll_fd = -1; // listening socket and idle upload connections
+        std::unordered_map<int, std::unique_ptr<UploadConnection>> upload_connections; // open upload connections by socket
+        std::deque<UploadConnection*> upload_queue; // connections with a request waiting for a worker
+
+        std::mutex upload_m;
+        std::mutex uploads_m; // guards upload_connections and upload_queue
+        std::mutex connections_m; // guards idle_connections
+        std::condition_variable uploads_cv;
+        std::mutex pending_m;
+        std::mutex files_m;
+        std::condition_variable files_cv;
+        std::mutex hash_m; // guards hash_cache and file_versions
+        std::mutex search_cache_m; // guards search_cache, search_lru and their counters
+        std::mutex servers_m; // guards partition_map and index_servers
 
-        // log message to specified log file
-        void log(std::ofstream &log_stream, std::string type, std::string msg) {
-            std::lock_guard<std::mutex> guard(log_m);
-            log_stream << '[' << time_now() << "] [" << type << "] " << msg  << '\n' << std::endl;
+        // queue message for the specified log, written out by the logger thread
+        void log(int log_sink, const std::string &type, const std::string &msg, LogLevel level=LOG_INFO) {
+            logger.log(log_sink, level, type, msg);
         }
 
         //special log messages used for later analysis
-        void eval_log(std::ofstream &log_stream, int key, std::string type, std::string msg) {
-            std::lock_guard<std::mutex> guard(log_m);
-            log_stream << '!' << key << " [" << time_now() << "] [" << type << "] [" << msg  << "]\n" << std::endl;
+        void eval_log(int log_sink, int key, const std::string &type, const std::string &msg) {
+            logger.log(log_sink, LOG_INFO, type, msg, key);
         }
         
         void error(std::string type) {
+            logger.flush();
             std::cerr << "\n[" << type << "] exiting program\n" << std::endl;
             exit(1);
         }
 
-        // handles a peer server's file retrieval request
-        // only performs single retrieval
-        void handle_client_request(int client_socket_fd) {
-            retrieve(client_socket_fd);
+        // serve the next request on an upload connection, returns false once the connection should be closed
+        // legacy peers retrieve a single whole file, ranged downloads send any number of requests
+        bool serve_upload(UploadConnection &connection) {
+            if (!connection.ranged) {
+                char marker;
+                if (connection.reader.read_some(&marker, sizeof(marker)) != sizeof(marker)) {
+                    log(server_log, "client unresponsive", "closing connection", LOG_WARN);
+                    return false;
+                }
+                if (marker != RANGE_REQUEST_MARKER) {
+                    retrieve(connection.socket_fd, marker);
+                    return false;
+                }
+                connection.ranged = true;
+                // wait for the first request in the epoll set rather than on a worker
+                return true;
+            }
+            return serve_range(connection);
+        }
 
-            close(client_socket_fd);
-            log(server_log, "client disconnected", "closed connection");
+        // hold an upload back until it fits under the upload limit shared by every connection
+        void throttle_upload(size_t size) {
+            if (config.upload_limit <= 0)
+                return;
+            std::chrono::steady_clock::time_point start;
+            {
+                std::lock_guard<std::mutex> guard(upload_m);
+                start = std::max(std::chrono::steady_clock::now(), upload_next);
+                upload_next = start + std::chrono::microseconds(size * 1000000 / config.upload_limit);
+            }
+            std::this_thread::sleep_until(start);
         }
 
-        void retrieve(int client_socket_fd) {
+        // send length bytes of a file starting at offset, returns false if the peer client went away
+        bool send_file_range(int client_socket_fd, int fd, off_t offset, size_t length) {
+            while (length > 0) {
+                size_t slice = std::min<size_t>(length, UPLOAD_SLICE_SIZE);
+                throttle_upload(slice);
+                ssize_t sent = sendfile(client_socket_fd, fd, &offset, slice);
+                if (sent < 0 && errno == EINTR)
+                    continue;
+                if (sent <= 0)
+                    return false;
+                uploaded_bytes.fetch_add(sent, std::memory_order_relaxed);
+                length -= sent;
+            }
+            return true;
+        }
+
+        // answer a single ranged request, returns false if the connection broke or sent garbage
+        bool serve_range(UploadConnection &connection) {
+            uint8_t opcode;
+            std::string payload, filename;
+            if (!connection.reader.next(opcode, payload))
+                return false;
+            const char *pos = payload.data();
+            const char *end = pos + payload.size();
+            uint64_t offset, length;
+            if (opcode != OP_RANGE || !get_string(pos, end, filename) || !get_varint(pos, end, offset) || !get_varint(pos, end, length)) {
+                log(server_log, "unexpected request", "closing connection", LOG_WARN);
+                return false;
+            }
+
+            if (connection.file_fd < 0 || filename != connection.open_filename) {
+                if (connection.file_fd >= 0)
+                    close(connection.file_fd);
+                // anything but a shared file in the files directory is answered as not found
+                connection.file_fd = shared_file(filename) ? open((files_directory_path + filename).c_str(), O_RDONLY) : -1;
+                connection.open_filename = filename;
+            }
+
+            char status = RANGE_OK;
+            uint64_t file_size = 0;
+            struct stat file_stat;
+            if (connection.file_fd < 0) {
+                status = RANGE_NOT_FOUND;
+            }
+            else if (fstat(connection.file_fd, &file_stat) < 0) {
+                status = RANGE_UNREADABLE;
+            }
+            else {
+                file_size = file_stat.st_size;
+                offset = std::min(offset, file_size);
+                length = std::min(length, file_size - offset);
+            }
+            if (status != RANGE_OK)
+                offset = length = 0;
+
+            std::string reply;
+            reply += status;
+            put_varint(reply, file_size);
+            put_varint(reply, offset);
+            put_varint(reply, length);
+            std::string frame = make_frame(OP_RANGE_RESULT, reply);
+            if (!send_all(connection.socket_fd, frame.data(), frame.size()) || !send_file_range(connection.socket_fd, connection.file_fd, offset, length)) {
+                log(server_log, "client unresponsive", "closing connection", LOG_WARN);
+                return false;
+            }
+            return true;
+        }
+
+        // first is the first byte of the filename, already read to tell a legacy retrieval from a ranged one
+        void retrieve(int client_socket_fd, char first) {
             // recieve filename to download from peer client
             char buffer[MAX_FILENAME_SIZE];
-            if (recv(client_socket_fd, buffer, MAX_FILENAME_SIZE, 0) < 0) {
-                log(server_log, "client unresponsive", "closing connection");
+            buffer[0] = first;
+            if (!recv_all(client_socket_fd, buffer + 1, MAX_FILENAME_SIZE - 1)) {
+                log(server_log, "client unresponsive", "closing connection", LOG_WARN);
                 return;
             }
             
             // create full file path of peer server to send
+            std::string name(buffer, strnlen(buffer, MAX_FILENAME_SIZE));
             std::ostringstream filename;
             filename << std::string(files_directory_path);
-            filename << std::string(buffer);
+            filename << name;
 
-            int fd = open(filename.str().c_str(), O_RDONLY);
+            int fd = shared_file(name) ? open(filename.str().c_str(), O_RDONLY) : -1;
             if (fd == -1) {
                 // send message to peer client if file cannot be opened
-                if (send(client_socket_fd, "-1", MAX_STAT_MSG_SIZE, 0) < 0)
-                    log(server_log, "client unresponsive", "closing connection");
+                char file_size[MAX_STAT_MSG_SIZE] = "-1";
+                if (!send_all(client_socket_fd, file_size, sizeof(file_size)))
+                    log(server_log, "client unresponsive", "closing connection", LOG_WARN);
+                return;
             }
             else {
                 struct stat file_stat;
                 if (fstat(fd, &file_stat) < 0) {
                     // send message to peer client if file size cannot be determined
-                    if (send(client_socket_fd, "-2", MAX_STAT_MSG_SIZE, 0) < 0)
-                        log(server_log, "client unresponsive", "closing connection");
+                    char file_size[MAX_STAT_MSG_SIZE] = "-2";
+                    if (!send_all(client_socket_fd, file_size, sizeof(file_size)))
+                        log(server_log, "client unresponsive", "closing connection", LOG_WARN);
                 }
                 else {
                     char file_size[MAX_STAT_MSG_SIZE];
+                    bzero(file_size, MAX_STAT_MSG_SIZE);
                     sprintf(file_size, "%ld", file_stat.st_size);
 
                     //send file size to peer client
-                    if (send(client_socket_fd, file_size, sizeof(file_size), 0) < 0) {
-                        log(server_log, "client unresponsive", "closing connection");
+                    if (!send_all(client_socket_fd, file_size, sizeof(file_size))) {
+                        log(server_log, "client unresponsive", "closing connection", LOG_WARN);
+                        close(fd);
                         return;
                     }
 
-                    off_t offset = 0;
-                    int remaining_size = file_stat.st_size;
-                    int sent_size = 0;
-                    //send file in 4096 byte blocks until entire file sent
-                    while (((sent_size = sendfile(client_socket_fd, fd, &offset, MAX_MSG_SIZE)) > 0) && (remaining_size > 0))
-                        remaining_size -= sent_size;
+                    if (!send_file_range(client_socket_fd, fd, 0, file_stat.st_size))
+                        log(server_log, "client unresponsive", "closing connection", LOG_WARN);
                 }
             }
             close(fd);
         }
 
-        // read all files in peer's directory and save to files vector
-        std::vector<std::pair<std::string, time_t>> get_files() {
-            std::vector<std::pair<std::string, time_t>> tmp_files;
-            
-            if (auto directory = opendir(files_directory_path.c_str())) {
-                while (auto file = readdir(directory)) {
+        // downloads in progress, their progress sidecars and the hash cache are never offered to other peers
+        static bool is_private_file(const std::string &filename) {
+            for (const std::string suffix : {PARTIAL_SUFFIX, PARTIAL_SUFFIX PROGRESS_SUFFIX}) {
+                if (filename.size() > suffix.size() && filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0)
+                    return true;
+            }
+            return filename.compare(0, strlen(HASH_CACHE_NAME), HASH_CACHE_NAME) == 0;
+        }
+
+        // whether a filename asked for by another peer names a file this peer shares, rather than a path out of the
+        // files directory or one of the files kept next to the shared ones
+        static bool shared_file(const std::string &filename) {
+            return !filename.empty() && filename != "." && filename != ".." && filename.find('/') == std::string::npos && !is_private_file(filename);
+        }
+
+        static FileVersion file_version(const struct stat &file_stat) {
+            return FileVersion{(uint64_t)file_stat.st_ino, file_stat.st_mtim.tv_sec * 1000000000ll + file_stat.st_mtim.tv_nsec, (uint64_t)file_stat.st_size};
+        }
+
+        // content hash of a shared file, only read from disk if the file changed since it was last hashed
+        // returns 0 if the file could not be read
+        uint64_t content_hash(const std::string &filename, const std::function<void()> &progress=std::function<void()>()) {
+            int fd = open((files_directory_path + filename).c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat file_stat;
+            if (fd < 0)
+                return 0;
+            if (fstat(fd, &file_stat) < 0) {
+                close(fd);
+                return 0;
+            }
+            FileVersion version = file_version(file_stat);
+            {
+                std::lock_guard<std::mutex> guard(hash_m);
+                auto cached = hash_cache.find(version);
+                if (cached != hash_cache.end()) {
+                    file_versions[filename] = version;
+                    close(fd);
+                    return cached->second;
+                }
+            }
+
+            uint64_t hash;
+            bool ok = hash_file(fd, hash, progress);
+            close(fd);
+            if (!ok) {
+                log(client_log, "failed file read", "no content hash for \"" + filename + '\"', LOG_WARN);
+                return 0;
+            }
+            remember_hash(filename, version, hash);
+            return hash;
+        }
+
+        void remember_hash(const std::string &filename, const FileVersion &version, uint64_t hash) {
+            std::lock_guard<std::mutex> guard(hash_m);
+            hash_cache[version] = hash;
+            file_versions[filename] = version;
+            hash_cache_changed = true;
+        }
+
+        // a shared file that holds content with the given hash, empty if there is none
+        std::string local_copy(uint64_t hash) {
+            std::vector<std::pair<std::string, FileVersion>> candidates;
+            {
+                std::lock_guard<std::mutex> guard(hash_m);
+                for (auto &&file : file_versions) {
+                    auto cached = hash_cache.find(file.second);
+                    if (cached != hash_cache.end() && cached->second == hash)
+                        candidates.push_back(file);
+                }
+            }
+            // the file may have changed since it was hashed
+            for (auto &&candidate : candidates) {
+                struct stat file_stat;
+                if (stat((files_directory_path + candidate.first).c_str(), &file_stat) == 0 && file_version(file_stat) == candidate.second)
+                    return candidate.first;
+            }
+            return std::string();
+        }
+
+        void load_hash_cache() {
+            std::ifstream cache(files_directory_path + HASH_CACHE_NAME, std::ios::binary);
+            char magic[8];
+            if (!cache.read(magic, sizeof(magic)) || memcmp(magic, HASH_CACHE_MAGIC, sizeof(magic)) != 0)
+                return;
+            uint64_t record[4];
+            while (cache.read((char*)record, sizeof(record)))
+                hash_cache[FileVersion{record[0], (int64_t)record[1], record[2]}] = record[3];
+        }
+
+        // write the hashes of files still shared to the cache file, dropping every other version
+        void save_hash_cache() {
+            std::unordered_set<std::string> shared;
+            {
+                std::lock_guard<std::mutex> guard(files_m);
+                for (auto &&file : files)
+                    shared.insert(file.first);
+            }
+
+            std::string records = HASH_CACHE_MAGIC;
+            {
+                std::lock_guard<std::mutex> guard(hash_m);
+                if (!hash_cache_changed)
+                    return;
+                std::unordered_map<FileVersion, uint64_t, FileVersionHash> kept;
+                for (auto file = file_versions.begin(); file != file_versions.end();) {
+                    auto cached = hash_cache.find(file->second);
+                    if (!shared.count(file->first) || cached == hash_cache.end()) {
+                        file = file_versions.erase(file);
+                        continue;
+                    }
+                    kept.insert(*cached);
+                    file++;
+                }
+                for (auto &&entry : kept) {
+                    uint64_t record[4] = {entry.first.inode, (uint64_t)entry.first.modified, entry.first.size, entry.second};
+                    records.append((const char*)record, sizeof(record));
+                }
+                hash_cache.swap(kept);
+                hash_cache_changed = false;
+            }
+
+            // replace the cache in one rename so a crash never leaves half of it
+            std::string cache_path = files_directory_path + HASH_CACHE_NAME;
+            std::string tmp_path = cache_path + ".tmp";
+            int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            bool written = fd >= 0 && write(fd, records.data(), records.size()) == (ssize_t)records.size();
+            if (fd >= 0 && close(fd) < 0)
+                written = false;
+            if (!written || rename(tmp_path.c_str(), cache_path.c_str()) < 0) {
+                log(client_log, "failed hash cache write", "files will be hashed again on restart", LOG_WARN);
+                unlink(tmp_path.c_str());
+            }
+        }
+
+        // read all files in peer's directory once, without opening any of them
+        std::unordered_map<std::string, FileVersion> scan_files() {
+            std::unordered_map<std::string, FileVersion> tmp_files;
+
+            int directory_fd = open(files_directory_path.c_str(), O_RDONLY | O_DIRECTORY);
+            if (directory_fd < 0)
+                error("invalid directory");
+
+            char buffer[DIRENTS_BUFFER_SIZE];
+            long n;
+            while ((n = getdents64(directory_fd, buffer, sizeof(buffer))) > 0) {
+                for (long offset = 0; offset < n;) {
+                    struct dirent64 *file = (struct dirent64 *)(buffer + offset);
+                    offset += file->d_reclen;
+
                     //skip . and .. files and any directories
-                    if (!file->d_name || strcmp(file->d_name, ".") == 0 || strcmp(file->d_name, "..") == 0 || file->d_type == DT_DIR)
+                    if (strcmp(file->d_name, ".") == 0 || strcmp(file->d_name, "..") == 0 || file->d_type == DT_DIR)
                         continue;
-                    
-                    // get full file path
-                    std::ostringstream file_path;
-                    file_path << files_directory_path;
-                    file_path << file->d_name;
-                    
-                    int fd = open(file_path.str().c_str(), O_RDONLY);
-                    if (fd == -1) {
-                        //ignore file if unable to open
-                        log(client_log, "failed file open", "ignoring \"" + file_path.str() + '\"');
+                    if (is_private_file(file->d_name))
                         continue;
-                    }
-                    
+
                     struct stat file_stat;
-                    if (fstat(fd, &file_stat) < 0) {
+                    if (fstatat(directory_fd, file->d_name, &file_stat, 0) < 0) {
                         // ignore file if unable to file stats
-                        log(client_log, "failed file stat", "ignoring \"" + file_path.str() + '\"');
+                        log(client_log, "failed file stat", "ignoring \"" + files_directory_path + file->d_name + '\"', LOG_WARN);
                         continue;
                     }
-                    close(fd);
+                    if (S_ISDIR(file_stat.st_mode))
+                        continue;
+
+                    // save the filename and version to the files map, a rewrite within the same second still changes the version
+                    tmp_files[file->d_name] = file_version(file_stat);
+                }
+            }
+            close(directory_fd);
+
+            return tmp_files;
+        }
+
+        // record a change to the files map and wake the updater
+        void update_file(const std::string &filename, bool exists) {
+            if (is_private_file(filename))
+                return;
+            std::lock_guard<std::mutex> guard(files_m);
+            if (exists) {
+                struct stat file_stat;
+                std::string file_path = files_directory_path + filename;
+                if (stat(file_path.c_str(), &file_stat) < 0 || S_ISDIR(file_stat.st_mode))
+                    return;
+                files[filename] = file_version(file_stat);
+            }
+            else if (files.erase(filename) == 0) {
+                return;
+            }
+            files_changed = true;
+            files_cv.notify_all();
+        }
+
+        // replace the files map with a fresh scan, the updater is only woken if anything changed
+        void rescan_files() {
+            std::unordered_map<std::string, FileVersion> tmp_files = scan_files();
+            std::lock_guard<std::mutex> guard(files_m);
+            if (tmp_files == files)
+                return;
+            files = tmp_files;
+            files_changed = true;
+            files_cv.notify_all();
+        }
+
+        // keep the files map up to date from inotify events instead of rescanning the directory
+        // the watch was added before the first scan, so every change since then is queued
+        // without a working watch the directory is rescanned every RESCAN_INTERVAL seconds instead
+        void watch_files() {
+            alignas(struct inotify_event) char buffer[INOTIFY_BUFFER_SIZE];
+            while (inotify_fd >= 0) {
+                ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    close(inotify_fd);
+                    inotify_fd = -1;
+                    break;
+                }
+
+                for (char *p = buffer; p < buffer + n;) {
+                    struct inotify_event *event = (struct inotify_event *)p;
+                    p += sizeof(struct inotify_event) + event->len;
+
+                    if (event->mask & IN_Q_OVERFLOW) {
+                        // events were dropped so start over from a fresh scan
+                        rescan_files();
+                        continue;
+                    }
+                    if (!event->len || (event->mask & IN_ISDIR))
+                        continue;
+
+                    // files are only added once fully written or moved in, so partial downloads are never shared
+                    update_file(event->name, event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB));
+                }
+            }
+
+            log(client_log, "failed directory watch", "rescanning files every " + std::to_string(RESCAN_INTERVAL) + " seconds", LOG_WARN);
+            while (1) {
+                std::this_thread::sleep_for(std::chrono::seconds(RESCAN_INTERVAL));
+                rescan_files();
+            }
+        }
+
+        // size a socket buffer for bulk transfers, unless the kernel is left to tune it
+        void set_socket_buffer(int socket_fd, int option) {
+            if (config.socket_buffer > 0)
+                setsockopt(socket_fd, SOL_SOCKET, option, &config.socket_buffer, sizeof(config.socket_buffer));
+        }
+
+        // look up HOST once, getaddrinfo is thread-safe unlike the gethostbyname it replaces
+        void resolve_host() {
+            struct addrinfo hints, *result;
+            bzero((char *)&hints, sizeof(hints));
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            if (getaddrinfo(HOST, NULL, &hints, &result) != 0)
+                error("failed host lookup");
+            memcpy(&host_addr, result->ai_addr, sizeof(host_addr));
+            freeaddrinfo(result);
+        }
+
+        // create a connection to some server given a specific port, returns -1 if it cannot be reached
+        // index_server flag used for knowing which type of server to connect
+        int connect_server(int server_port, bool index_server=true) {
+            struct sockaddr_in addr = host_addr;
+            addr.sin_port = htons(server_port);
+
+            // open a socket for the new connection
+            int server_socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            // buffers are set before connecting so the window scale offered in the handshake matches them
+            if (!index_server)
+                set_socket_buffer(server_socket_fd, SO_RCVBUF);
+
+            // connect to the server
+            if (connect(server_socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                close(server_socket_fd);
+                return -1;
+            }
+            
+            return server_socket_fd;
+        }
+
+        // connect to an indexing server, negotiate the binary protocol and start reading its replies
+        // the peer server port is sent as the client id, returns nullptr if the server cannot be reached
+        std::shared_ptr<IndexServer> connect_index_server(int server_port) {
+            int server_socket_fd = connect_server(server_port);
+            if (server_socket_fd < 0)
+                return nullptr;
+            // requests are small and often pipelined, so send them without waiting on delayed acks
+            int nodelay = 1;
+            setsockopt(server_socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+            char handshake[sizeof(int) + sizeof(char) + sizeof(port)];
+            int magic = PROTOCOL_MAGIC;
+            memcpy(handshake, &magic, sizeof(magic));
+            handshake[sizeof(magic)] = PROTOCOL_VERSION;
+            memcpy(handshake + sizeof(magic) + sizeof(char), &port, sizeof(port));
+            char version;
+            if (!send_all(server_socket_fd, handshake, sizeof(handshake)) || !recv_all(server_socket_fd, &version, sizeof(version)) || version != PROTOCOL_VERSION) {
+                close(server_socket_fd);
+                return nullptr;
+            }
+
+            std::shared_ptr<IndexServer> server = std::make_shared<IndexServer>(server_port, server_socket_fd);
+            std::thread r_t(&Peer::read_server_replies, this, server);
+            r_t.detach();
+            return server;
+        }
+
+        // connection to the indexing server holding filename, nullptr if it is not connected
+        std::shared_ptr<IndexServer> index_server_for(const std::string &filename) {
+            std::lock_guard<std::mutex> guard(servers_m);
+            auto server = index_servers.find(partition_map->server_for(filename));
+            return server == index_servers.end() ? nullptr : server->second;
+        }
+
+        std::shared_ptr<IndexServer> index_server(int server_port) {
+            std::lock_guard<std::mutex> guard(servers_m);
+            auto server = index_servers.find(server_port);
+            return server == index_servers.end() ? nullptr : server->second;
+        }
+
+        // every connected indexing server, by port
+        std::vector<std::shared_ptr<IndexServer>> connected_servers() {
+            std::vector<std::shared_ptr<IndexServer>> servers;
+            {
+                std::lock_guard<std::mutex> guard(servers_m);
+                for (auto &&server : index_servers)
+                    servers.push_back(server.second);
+            }
+            std::sort(servers.begin(), servers.end(), [](const std::shared_ptr<IndexServer> &a, const std::shared_ptr<IndexServer> &b) {
+                return a->port < b->port;
+            });
+            return servers;
+        }
+
+        // request ids carry the port of the indexing server they were sent to, so a server that goes away only fails its own
+        // pending_m must be held
+        uint64_t new_request_id(const IndexServer &server) {
+            return next_request_id++ << REQUEST_SERVER_BITS | server.port;
+        }
+
+        // move the requests sent to the indexing server on server_port out of pending, pending_m must be held
+        template <typename T>
+        static void take_requests(std::unordered_map<uint64_t, T> &pending, int server_port, std::unordered_map<uint64_t, T> &taken) {
+            for (auto it = pending.begin(); it != pending.end();) {
+                if ((int)(it->first & ((1 << REQUEST_SERVER_BITS) - 1)) != server_port) {
+                    ++it;
+                    continue;
+                }
+                taken.insert(std::move(*it));
+                it = pending.erase(it);
+            }
+        }
+
+        // modified time in ns of the servers file, -1 if the servers are listed on the command line or the file is unreadable
+        int64_t servers_file_version() {
+            struct stat file_stat;
+            if (config.index_servers[0] != '@' || stat(config.index_servers.c_str() + 1, &file_stat) < 0)
+                return -1;
+            return file_stat.st_mtim.tv_sec * 1000000000ll + file_stat.st_mtim.tv_nsec;
+        }
+
+        // build the partition map from the configured indexing server ports, a servers file is only read again once it changed
+        // returns nullptr if the map stayed the same or the ports could not be read
+        std::shared_ptr<const PartitionMap> read_partition_map() {
+            std::string list = config.index_servers;
+            if (list[0] == '@') {
+                int64_t modified = servers_file_version();
+                if (modified < 0 || modified == servers_file_modified)
+                    return nullptr;
+                servers_file_modified = modified;
+                std::ifstream servers_file(list.substr(1));
+                std::ostringstream contents;
+                contents << servers_file.rdbuf();
+                list = contents.str();
+            }
+            else if (partition_map) {
+                return nullptr;
+            }
+
+            std::replace(list.begin(), list.end(), ',', ' ');
+            std::istringstream words(list);
+            std::string word;
+            std::vector<int> ports;
+            while (words >> word) {
+                int server_port = atoi(word.c_str());
+                if (server_port <= 0 || server_port > 65535) {
+                    log(client_log, "bad server list", "\"" + word + "\" is not a port, keeping the partition map", LOG_WARN);
+                    return nullptr;
+                }
+                ports.push_back(server_port);
+            }
+            if (ports.empty()) {
+                log(client_log, "bad server list", "no indexing servers listed, keeping the partition map", LOG_WARN);
+                return nullptr;
+            }
+            std::shared_ptr<const PartitionMap> map = std::make_shared<const PartitionMap>(ports);
+            if (partition_map && *map == *partition_map)
+                return nullptr;
+            return map;
+        }
+
+        // move to a changed partition map and reconnect to any server in it that went away, only called from the updater
+        // files follow the map on the sync right after, and servers dropped from it are disconnected so they forget this peer
+        void update_servers() {
+            std::shared_ptr<const PartitionMap> map = read_partition_map();
+            std::shared_ptr<const PartitionMap> old_map;
+            std::vector<int> missing;
+            {
+                std::lock_guard<std::mutex> guard(servers_m);
+                old_map = partition_map;
+                if (!map)
+                    map = partition_map;
+                for (int server_port : map->servers()) {
+                    auto server = index_servers.find(server_port);
+                    if (server == index_servers.end() || server->second->closed)
+                        missing.push_back(server_port);
+                }
+            }
+
+            std::unordered_set<int> connected;
+            std::vector<std::shared_ptr<IndexServer>> dropped;
+            std::vector<std::shared_ptr<IndexServer>> reconnected;
+            for (int server_port : missing) {
+                std::shared_ptr<IndexServer> server = connect_index_server(server_port);
+                if (server)
+                    reconnected.push_back(server);
+                else
+                    log(client_log, "server unreachable", "indexing server " + std::to_string(server_port) + " is tried again on the next sync", LOG_WARN);
+            }
+            if (map == old_map && reconnected.empty())
+                return;
+            {
+                std::lock_guard<std::mutex> guard(servers_m);
+                partition_map = map;
+                for (auto &&server : reconnected) {
+                    index_servers[server->port] = server;
+                    connected.insert(server->port);
+                }
+                for (auto it = index_servers.begin(); it != index_servers.end();) {
+                    if (std::binary_search(map->servers().begin(), map->servers().end(), it->first)) {
+                        ++it;
+                        continue;
+                    }
+                    dropped.push_back(it->second);
+                    it = index_servers.erase(it);
+                }
+            }
+            for (auto &&server : dropped) {
+                shutdown(server->socket_fd, SHUT_RDWR);
+                log(client_log, "server removed", "indexing server " + std::to_string(server->port) + " left the partition map");
+            }
+            for (int server_port : connected)
+                log(client_log, "server connected", "indexing server " + std::to_string(server_port));
+            if (map != old_map) {
+                // files that moved would only be invalidated by their new server, which never leased them
+                clear_search_cache();
+                log(client_log, "partition map changed", std::to_string(map->servers().size()) + " indexing server(s), files move on this sync");
+            }
+
+            // watches follow their files onto new servers and are sent again to servers that were reconnected
+            std::vector<std::string> watching;
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                watching.assign(watched_files.begin(), watched_files.end());
+            }
+            for (auto &&filename : watching) {
+                int old_port = old_map->server_for(filename), new_port = map->server_for(filename);
+                if (old_port == new_port && !connected.count(new_port))
+                    continue;
+                std::shared_ptr<IndexServer> old_server = index_server(old_port);
+                if (old_port != new_port && old_server)
+                    send_watch(*old_server, filename, false);
+                std::shared_ptr<IndexServer> new_server = index_server(new_port);
+                if (new_server)
+                    send_watch(*new_server, filename, true);
+            }
+        }
+
+        // an idle connection is only handed out while the other side has neither closed it nor sent anything
+        static bool connection_healthy(int socket_fd) {
+            char byte;
+            ssize_t n = recv(socket_fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+
+        // close idle connections past their TTL, connections_m must be held
+        void evict_idle_connections() {
+            std::chrono::steady_clock::time_point cutoff = std::chrono::steady_clock::now() - std::chrono::seconds(PEER_CONNECTION_TTL);
+            for (auto it = idle_connections.begin(); it != idle_connections.end();) {
+                std::vector<IdleConnection> &connections = it->second;
+                for (auto &&connection : connections) {
+                    if (connection.idle_since < cutoff) {
+                        close(connection.socket_fd);
+                        connection.socket_fd = -1;
+                    }
+                }
+                connections.erase(std::remove_if(connections.begin(), connections.end(), [](const IdleConnection &connection) {
+                    return connection.socket_fd < 0;
+                }), connections.end());
+                it = connections.empty() ? idle_connections.erase(it) : std::next(it);
+            }
+        }
+
+        // get a ranged connection to a peer server, reusing an idle one when there is a healthy one left
+        // returns -1 if the peer cannot be reached
+        int acquire_connection(int peer_port) {
+            {
+                std::lock_guard<std::mutex> guard(connections_m);
+                evict_idle_connections();
+                auto it = idle_connections.find(peer_port);
+                while (it != idle_connections.end() && !it->second.empty()) {
+                    // the most recently used connection is the least likely to have been closed
+                    int socket_fd = it->second.back().socket_fd;
+                    it->second.pop_back();
+                    if (connection_healthy(socket_fd)) {
+                        log(client_log, "connection reused", std::to_string(peer_port), LOG_DEBUG);
+                        return socket_fd;
+                    }
+                    close(socket_fd);
+                }
+            }
+
+            int peer_socket_fd = connect_server(peer_port, false);
+            if (peer_socket_fd < 0)
+                return -1;
+            // a stalled source times out so its chunks can move to the others
+            struct timeval timeout = {SWARM_SOURCE_TIMEOUT, 0};
+            setsockopt(peer_socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            // a failed send shows up as a failed request on the source
+            char marker = RANGE_REQUEST_MARKER;
+            send_all(peer_socket_fd, &marker, sizeof(marker));
+            return peer_socket_fd;
+        }
+
+        // keep a connection that finished its last range cleanly for the next download from the same peer
+        void release_connection(int peer_port, int socket_fd) {
+            std::lock_guard<std::mutex> guard(connections_m);
+            evict_idle_connections();
+            std::vector<IdleConnection> &connections = idle_connections[peer_port];
+            if (connections.size() >= MAX_IDLE_CONNECTIONS) {
+                close(socket_fd);
+                return;
+            }
+            connections.push_back({socket_fd, std::chrono::steady_clock::now()});
+        }
+
+        // hand a download source's connection back to the pool, or close it if it fell out of step
+        void release_source(SwarmSource &source) {
+            if (source.healthy && source.reader.buffered() == 0)
+                release_connection(source.port, source.socket_fd);
+            else
+                close(source.socket_fd);
+        }
+
+        // send a single frame to an indexing server
+        bool send_frame(IndexServer &server, const std::string &frame) {
+            std::lock_guard<std::mutex> guard(server.send_m);
+            return send_all(server.socket_fd, frame.data(), frame.size());
+        }
+
+        // append batch frames for a set of filenames, splitting large sets across several frames
+        // registrations also carry the content hash of every file
+        void put_batch(std::string &batch, uint8_t request, uint64_t generation, uint8_t flags, const std::vector<std::string> &filenames,
+                       const std::vector<uint64_t> &content_hashes=std::vector<uint64_t>()) {
+            for (size_t i = 0; i < filenames.size(); i += MAX_BATCH_SIZE) {
+                size_t chunk_end = std::min(filenames.size(), i + MAX_BATCH_SIZE);
+                std::vector<std::string> chunk(filenames.begin() + i, filenames.begin() + chunk_end);
+                std::string payload;
+                put_varint(payload, generation);
+                if (request == OP_REGISTER_MANY)
+                    // only the first frame of a replacing batch clears the old registrations
+                    payload += (char)((i == 0 ? flags : 0) | REGISTER_HASHED);
+                put_strings(payload, chunk);
+                if (request == OP_REGISTER_MANY)
+                    put_hashes(payload, std::vector<uint64_t>(content_hashes.begin() + i, content_hashes.begin() + chunk_end));
+                batch += make_frame(request, payload);
+            }
+        }
+
+        // keep the indexing servers in sync with the files directory
+        // every server is only told about the files the partition map puts on it, so when the map changes the files
+        // that moved are deregistered from their old server and registered with their new one on the same sync
+        // the upload load rides along with every sync
+        void register_files() {
+            UploadLoad load = sample_load();
+
+            while (1) {
+                resync_needed = false;
+                update_servers();
+                std::unordered_map<std::string, FileVersion> current_files;
+                {
+                    std::lock_guard<std::mutex> guard(files_m);
+                    current_files = files;
+                    files_changed = false;
+                }
+
+                std::shared_ptr<const PartitionMap> map;
+                std::vector<std::shared_ptr<IndexServer>> servers = connected_servers();
+                {
+                    std::lock_guard<std::mutex> guard(servers_m);
+                    map = partition_map;
+                }
+                std::unordered_map<int, std::unordered_map<std::string, FileVersion>> server_files;
+                for (auto &&file : current_files)
+                    server_files[map->server_for(file.first)].insert(file);
+
+                bool synced = false;
+                for (auto &&server : servers)
+                    synced = sync_server(*server, server_files[server->port], load) || synced;
+                if (synced)
+                    save_hash_cache();
+                last_sync = std::chrono::steady_clock::now();
+
+                // sleep until the watcher sees a change or a server asks for a resync
+                // an idle peer only checks in with the servers every SYNC_INTERVAL seconds, or sooner once its upload load
+                // or the servers file changed
+                UploadLoad reported = load;
+                std::unique_lock<std::mutex> guard(files_m);
+                while (1) {
+                    if (files_cv.wait_for(guard, std::chrono::seconds(LOAD_REPORT_INTERVAL), [this]() { return files_changed || resync_needed; })) {
+                        // give a burst of changes a moment to settle so it goes out as one batch
+                        guard.unlock();
+                        std::this_thread::sleep_for(std::chrono::milliseconds(SYNC_DEBOUNCE_MS));
+                        load = sample_load();
+                        break;
+                    }
+                    load = sample_load();
+                    if (!load.similar(reported) || std::chrono::steady_clock::now() - last_sync >= std::chrono::seconds(SYNC_INTERVAL) ||
+                        servers_file_version() != servers_file_modified)
+                        break;
+                }
+            }
+        }
+
+        // bring one indexing server up to date with its share of the files, returns false if it could not be reached
+        // only the difference since the last sync is sent, together with a generation number and file count
+        // the server checks against its own view and asks for a full resend if they drifted apart
+        // files are registered with their content hash, so a file modified since it was registered is sent again
+        bool sync_server(IndexServer &server, const std::unordered_map<std::string, FileVersion> &current_files, const UploadLoad &load) {
+            std::vector<std::string> added, removed;
+            uint8_t flags = 0;
+            if (server.drifted.exchange(false)) {
+                // resend the whole share in place of whatever the server has
+                flags = REGISTER_REPLACE;
+                for (auto &&file : current_files)
+                    added.push_back(file.first);
+            }
+            else {
+                for (auto &&file : current_files) {
+                    auto registered = server.registered_files.find(file.first);
+                    if (registered == server.registered_files.end() || !(registered->second == file.second))
+                        added.push_back(file.first);
+                }
+                for (auto &&file : server.registered_files) {
+                    if (!current_files.count(file.first))
+                        removed.push_back(file.first);
+                }
+            }
+            // the servers drop a peer they have not heard from for a while, and hashing a large share can take longer
+            std::vector<uint64_t> content_hashes;
+            std::function<void()> keep_alive = [this, &load]() { keep_servers_alive(load); };
+            for (auto &&filename : added) {
+                content_hashes.push_back(content_hash(filename, keep_alive));
+                keep_alive();
+            }
+
+            std::string batch;
+            if (flags || !added.empty() || !removed.empty()) {
+                server.generation++;
+                put_batch(batch, OP_REGISTER_MANY, server.generation, flags, added, content_hashes);
+                put_batch(batch, OP_DEREGISTER_MANY, server.generation, 0, removed);
+            }
+            batch += sync_frame(server.generation, current_files.size(), load);
+
+            // send the whole sync in a single write
+            if (!send_frame(server, batch)) {
+                log(client_log, "server unresponsive", "indexing server " + std::to_string(server.port) + " not synced", LOG_WARN);
+                return false;
+            }
+            server.registered_files = current_files;
+            log(client_log, "files synced", "server " + std::to_string(server.port) + " generation " + std::to_string(server.generation) + ": +" +
+                std::to_string(added.size()) + " -" + std::to_string(removed.size()) + " files, " + std::to_string(batch.size()) + " bytes in 1 send");
+            return true;
+        }
+
+        // frame closing a sync, the server checks the generation and file count against its own view
+        std::string sync_frame(uint64_t generation, size_t count, const UploadLoad &load) {
+            std::string payload;
+            put_varint(payload, generation);
+            put_varint(payload, count);
+            put_varint(payload, load.active);
+            put_varint(payload, load.throughput);
+            put_varint(payload, std::max(0l, config.upload_limit));
+            return make_frame(OP_SYNC, payload);
+        }
+
+        // while the updater is busy, tell every server the peer is still alive once LOAD_REPORT_INTERVAL seconds passed
+        // since the last sync, with a bare sync of what the server already has so it sees no drift
+        // only called from the updater thread
+        void keep_servers_alive(const UploadLoad &load) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now - last_sync < std::chrono::seconds(LOAD_REPORT_INTERVAL))
+                return;
+            for (auto &&server : connected_servers())
+                send_frame(*server, sync_frame(server->generation, server->registered_files.size(), load));
+            last_sync = now;
+        }
+
+        // upload load since the last sample, only called from the updater thread
+        UploadLoad sample_load() {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            uint64_t elapsed_ns = std::max<uint64_t>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(now - load_sampled).count());
+            uint64_t busy_ns = upload_busy_ns, uploaded = uploaded_bytes;
+            size_t queued;
+            {
+                std::lock_guard<std::mutex> guard(uploads_m);
+                queued = upload_queue.size();
+            }
+
+            UploadLoad load;
+            // a long upload still in progress has not added its time yet, so it is counted as it is now
+            load.active = std::max<uint64_t>(uploads_active, (busy_ns - load_sampled_busy_ns + elapsed_ns / 2) / elapsed_ns) + queued;
+            load.throughput = (uploaded - load_sampled_bytes) * 1000000000.0 / elapsed_ns;
+            load_sampled = now;
+            load_sampled_busy_ns = busy_ns;
+            load_sampled_bytes = uploaded;
+            return load;
+        }
+
+        // handle every frame sent by an indexing server
+        // search results are queued for the waiting request and sync results flag drift for the updater
+        void read_server_replies(std::shared_ptr<IndexServer> server) {
+            uint8_t opcode;
+            std::string reply;
+            while (server->reader.next(opcode, reply)) {
+                if (opcode == OP_SYNC_RESULT) {
+                    const char *pos = reply.data();
+                    const char *end = pos + reply.size();
+                    uint64_t generation;
+                    if (get_varint(pos, end, generation) && pos < end && *pos == SYNC_DRIFT) {
+                        log(client_log, "server drift", "resending all files of server " + std::to_string(server->port) + " after generation " +
+                            std::to_string(generation));
+                        std::lock_guard<std::mutex> guard(files_m);
+                        server->drifted = true;
+                        resync_needed = true;
+                        files_cv.notify_all();
+                    }
+                }
+                else if (opcode == OP_SEARCH_TAGGED_RESULT) {
+                    const char *pos = reply.data();
+                    const char *end = pos + reply.size();
+                    uint64_t request_id;
+                    SearchResult result;
+                    if (!get_varint(pos, end, request_id))
+                        continue;
+                    result.ok = get_ids(pos, end, result.client_ids);
+                    if (!result.ok || !get_hashes(pos, end, result.content_hashes) || result.content_hashes.size() != result.client_ids.size())
+                        result.content_hashes.assign(result.client_ids.size(), 0);
+                    complete_search(request_id, result);
+                }
+                else if (opcode == OP_SEARCH_LEASED_RESULT) {
+                    const char *pos = reply.data();
+                    const char *end = pos + reply.size();
+                    uint64_t request_id, lease_ms;
+                    SearchResult result;
+                    if (!get_varint(pos, end, request_id))
+                        continue;
+                    result.ok = get_varint(pos, end, lease_ms) && get_ids(pos, end, result.client_ids) && get_hashes(pos, end, result.content_hashes) &&
+                                result.content_hashes.size() == result.client_ids.size();
+                    std::pair<std::string, std::chrono::steady_clock::time_point> lease;
+                    bool leased = false;
+                    {
+                        std::lock_guard<std::mutex> guard(pending_m);
+                        auto pending_lease = pending_leases.find(request_id);
+                        if (pending_lease != pending_leases.end()) {
+                            lease = pending_lease->second;
+                            leased = true;
+                            pending_leases.erase(pending_lease);
+                        }
+                    }
+                    // the lease started once the server got the search, so counting from when it was sent errs on the safe side
+                    if (leased && result.ok && lease_ms > 0)
+                        cache_search(lease.first, result, lease.second + std::chrono::milliseconds(lease_ms));
+                    complete_search(request_id, result);
+                }
+                else if (opcode == OP_INVALIDATE) {
+                    const char *pos = reply.data();
+                    const char *end = pos + reply.size();
+                    std::string filename;
+                    if (get_string(pos, end, filename))
+                        uncache_search(filename);
+                }
+                else if (opcode == OP_STATS_RESULT) {
+                    const char *pos = reply.data();
+                    const char *end = pos + reply.size();
+                    uint64_t request_id;
+                    std::string report;
+                    if (!get_varint(pos, end, request_id))
+                        continue;
+                    get_string(pos, end, report);
+                    complete_stats(request_id, report);
+                }
+                else if (opcode == OP_SEARCH_MANY_RESULT) {
+                    const char *pos = reply.data();
+                    const char *end = pos + reply.size();
+                    uint64_t request_id, count;
+                    std::vector<SearchResult> results;
+                    if (!get_varint(pos, end, request_id))
+                        continue;
+                    if (get_varint(pos, end, count) && count <= MAX_BATCH_SIZE) {
+                        results.resize(count);
+                        for (auto &&result : results)
+                            result.ok = get_ids(pos, end, result.client_ids);
+                    }
+                    complete_batch(request_id, results);
+                }
+                else if (opcode == OP_SEARCH_PATTERN_RESULT) {
+                    const char *pos = reply.data();
+                    const char *end = pos + reply.size();
+                    uint64_t request_id, count;
+                    PatternPage page;
+                    if (!get_varint(pos, end, request_id))
+                        continue;
+                    page.ok = get_string(pos, end, page.cursor) && get_varint(pos, end, count);
+                    for (uint64_t i = 0; page.ok && i < count; i++) {
+                        page.files.emplace_back();
+                        page.ok = get_string(pos, end, page.files.back().first) && get_ids(pos, end, page.files.back().second);
+                    }
+                    complete_pattern(request_id, page);
+                }
+                else if (opcode == OP_WATCH_EVENT) {
+                    const char *pos = reply.data();
+                    const char *end = pos + reply.size();
+                    std::string filename;
+                    SearchResult result;
+                    if (!get_string(pos, end, filename) || !get_ids(pos, end, result.client_ids))
+                        continue;
+                    result.ok = true;
+                    if (!get_hashes(pos, end, result.content_hashes) || result.content_hashes.size() != result.client_ids.size())
+                        result.content_hashes.assign(result.client_ids.size(), 0);
+                    watch_event(filename, result);
+                }
+            }
+
+            log(client_log, "server unresponsive", "stopped reading replies from indexing server " + std::to_string(server->port), LOG_WARN);
+
+            // fail every search still waiting on this server
+            std::unordered_map<uint64_t, std::function<void(const SearchResult&)>> failed_searches;
+            std::unordered_map<uint64_t, std::shared_ptr<std::promise<std::string>>> failed_stats;
+            std::unordered_map<uint64_t, std::shared_ptr<std::promise<PatternPage>>> failed_patterns;
+            std::unordered_map<uint64_t, std::shared_ptr<std::promise<std::vector<SearchResult>>>> failed_batches;
+            std::unordered_map<uint64_t, std::pair<std::string, std::chrono::steady_clock::time_point>> failed_leases;
+            // no invalidations arrive anymore, so nothing cached can be trusted
+            clear_search_cache();
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                server->closed = true;
+                take_requests(pending_leases, server->port, failed_leases);
+                take_requests(pending_searches, server->port, failed_searches);
+                take_requests(pending_stats, server->port, failed_stats);
+                take_requests(pending_patterns, server->port, failed_patterns);
+                take_requests(pending_batches, server->port, failed_batches);
+            }
+            for (auto &&pending_search : failed_searches)
+                pending_search.second(SearchResult());
+            for (auto &&pending_stat : failed_stats)
+                pending_stat.second->set_value(std::string());
+            for (auto &&pending_pattern : failed_patterns)
+                pending_pattern.second->set_value(PatternPage());
+            for (auto &&pending_batch : failed_batches)
+                pending_batch.second->set_value(std::vector<SearchResult>());
+
+            // have the updater reconnect if the server is still in the partition map
+            std::lock_guard<std::mutex> guard(files_m);
+            resync_needed = true;
+            files_cv.notify_all();
+        }
+
+        // hand a search result to whoever is waiting on the request id
+        void complete_search(uint64_t request_id, const SearchResult &result) {
+            std::function<void(const SearchResult&)> callback;
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                auto pending_search = pending_searches.find(request_id);
+                if (pending_search == pending_searches.end())
+                    return;
+                callback = pending_search->second;
+                pending_searches.erase(pending_search);
+            }
+            callback(result);
+        }
+        
+        // hand a stats report to whoever is waiting on the request id
+        void complete_stats(uint64_t request_id, const std::string &report) {
+            std::shared_ptr<std::promise<std::string>> result;
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                auto pending_stat = pending_stats.find(request_id);
+                if (pending_stat == pending_stats.end())
+                    return;
+                result = pending_stat->second;
+                pending_stats.erase(pending_stat);
+            }
+            result->set_value(report);
+        }
+
+        // hand the results of a batch search to whoever is waiting on the request id
+        void complete_batch(uint64_t request_id, const std::vector<SearchResult> &results) {
+            std::shared_ptr<std::promise<std::vector<SearchResult>>> result;
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                auto pending_batch = pending_batches.find(request_id);
+                if (pending_batch == pending_batches.end())
+                    return;
+                result = pending_batch->second;
+                pending_batches.erase(pending_batch);
+            }
+            result->set_value(results);
+        }
+
+        // handle user interface for searching many filenames at once
+        // names are given on one line, and a name starting with '@' is a file listing more names, one per line
+        void batch_request() {
+            std::cout << "filenames (or @file): ";
+            std::string line;
+            std::cin >> std::ws;
+            std::getline(std::cin, line);
+            eval_log(client_log, search_request_counter, "batch request", "start");
+
+            std::vector<std::string> filenames;
+            std::istringstream words(line);
+            std::string word;
+            while (words >> word) {
+                if (word[0] != '@') {
+                    filenames.push_back(word);
+                    continue;
+                }
+                std::ifstream list(word.substr(1));
+                if (!list)
+                    std::cout << "\ncould not read file list \"" << word.substr(1) << "\": skipping it" << std::endl;
+                std::string filename;
+                while (list >> filename)
+                    filenames.push_back(filename);
+            }
+
+            std::vector<SearchResult> results = search_many(filenames);
+            std::ostringstream output;
+            output << '\n';
+            size_t found = 0, failed = 0;
+            for (size_t i = 0; i < filenames.size(); i++) {
+                output << '"' << filenames[i] << "\": ";
+                if (!results[i].ok) {
+                    output << "no reply\n";
+                    failed++;
+                    continue;
+                }
+                if (results[i].client_ids.empty()) {
+                    output << "not found\n";
+                    continue;
+                }
+                std::string delimiter;
+                for (auto &&client_id : results[i].client_ids) {
+                    output << delimiter << client_id;
+                    delimiter = ',';
+                }
+                output << '\n';
+                found++;
+            }
+            output << found << " of " << filenames.size() << " file(s) found\n";
+            std::cout << output.str() << std::endl;
+            if (failed > 0) {
+                std::cout << "unexpected connection issue: " << failed << " file(s) not searched\n" << std::endl;
+                log(client_log, "server unresponsive", "ignoring request", LOG_WARN);
+            }
+            eval_log(client_log, search_request_counter++, "batch request", "end");
+        }
+
+        // hand a pattern search page to whoever is waiting on the request id
+        void complete_pattern(uint64_t request_id, const PatternPage &page) {
+            std::shared_ptr<std::promise<PatternPage>> result;
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                auto pending_pattern = pending_patterns.find(request_id);
+                if (pending_pattern == pending_patterns.end())
+                    return;
+                result = pending_pattern->second;
+                pending_patterns.erase(pending_pattern);
+            }
+            result->set_value(page);
+        }
+
+        // handle user interface for finding every file that starts with a prefix or matches a glob pattern
+        // pages are printed as they arrive, so a large answer never has to be held at once
+        void pattern_request() {
+            std::cout << "pattern (prefix, or glob with * ? [...]): ";
+            std::string pattern;
+            std::cin >> pattern;
+            eval_log(client_log, search_request_counter, "pattern request", "start");
+            uint8_t mode = pattern.find_first_of("*?[") == std::string::npos ? PATTERN_PREFIX : PATTERN_GLOB;
 
-                    // save a pair of the filename and last modified date to the files vector if not already in there
-                    time_t modified_time = file_stat.st_mtim.tv_sec;
-                    std::pair<std::string, time_t> file_info = std::make_pair(file->d_name, modified_time);
-                    if(!(std::find(tmp_files.begin(), tmp_files.end(), file_info) != tmp_files.end()))
-                        tmp_files.push_back(file_info);
+            std::cout << '\n';
+            std::string cursor;
+            size_t found = 0;
+            bool ok;
+            do {
+                PatternPage page = pattern_search(mode, pattern, cursor);
+                ok = page.ok;
+                for (auto &&file : page.files) {
+                    std::ostringstream peers;
+                    std::string delimiter;
+                    for (auto &&client_id : file.second) {
+                        peers << delimiter << client_id;
+                        delimiter = ',';
+                    }
+                    std::cout << "\"" << file.first << "\": " << peers.str() << '\n';
                 }
-                closedir(directory);
-            }
-            else {
-                error("invalid directory");
+                found += page.files.size();
+                cursor = page.cursor;
+            } while (ok && !cursor.empty());
+
+            if (!ok) {
+                std::cout << "\nunexpected connection issue: search stopped after " << found << " file(s)\n" << std::endl;
+                log(client_log, "server unresponsive", "ignoring request", LOG_WARN);
             }
-            return tmp_files;
+            else if (found == 0)
+                std::cout << "no files match \"" << pattern << "\"\n" << std::endl;
+            else
+                std::cout << found << " file(s) match \"" << pattern << "\"\n" << std::endl;
+            eval_log(client_log, search_request_counter++, "pattern request", "end");
         }
 
-        // create a connection to some server given a specific port
-        // index_server flag used for knowing which type of server to connect
-        int connect_server(int server_port, bool index_server=true) {
-            struct sockaddr_in addr;
-            socklen_t addr_size = sizeof(addr);
-            bzero((char *)&addr, addr_size);
+        // handle user interface for requesting the stats report of every indexing server
+        void stats_request() {
+            std::vector<std::shared_ptr<IndexServer>> servers = connected_servers();
+            std::vector<std::future<std::string>> reports;
+            for (auto &&server : servers)
+                reports.push_back(stats(server));
+            if (servers.empty()) {
+                std::cout << "\nunexpected connection issue: no stats recieved\n" << std::endl;
+                log(client_log, "server unresponsive", "ignoring request", LOG_WARN);
+            }
+            for (size_t i = 0; i < servers.size(); i++) {
+                std::string report = reports[i].get();
+                if (servers.size() > 1)
+                    std::cout << "\nindexing server " << servers[i]->port << ':';
+                if (report.empty()) {
+                    std::cout << "\nunexpected connection issue: no stats recieved\n" << std::endl;
+                    log(client_log, "server unresponsive", "ignoring request", LOG_WARN);
+                }
+                else
+                    std::cout << '\n' << report << std::endl;
+            }
 
-            // open a socket for the new connection
-            struct hostent *server = gethostbyname(HOST);
-            int server_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+            std::lock_guard<std::mutex> guard(search_cache_m);
+            std::cout << "search cache: " << search_cache.size() << " results in " << search_cache_bytes << " bytes, " << search_cache_hits << " hit(s), "
+                      << search_cache_misses << " miss(es)\n" << std::endl;
+        }
 
-            addr.sin_family = AF_INET;
-            bcopy((char *)server->h_addr, (char *)&addr.sin_addr.s_addr, server->h_length);
-            addr.sin_port = htons(server_port);
-            
-            // connect to the server
-            if (connect(server_socket_fd, (struct sockaddr *)&addr, addr_size) < 0) {
-                // only exit program if failed to connect to indexing server
-                if (index_server)
-                    error("failed indexing server connection");
-                else {
-                    return -1;
-                }
+        // report a pushed change to a watched file's holders, events still in flight when the watch stopped are dropped
+        void watch_event(const std::string &filename, const SearchResult &result) {
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                if (!watched_files.count(filename))
+                    return;
+            }
+            std::ostringstream peers;
+            std::string delimiter;
+            for (auto &&client_id : result.client_ids) {
+                peers << delimiter << client_id;
+                delimiter = ',';
+            }
+            if (result.client_ids.empty()) {
+                std::cout << "\nwatched file \"" << filename << "\" no longer has any peers\n" << std::endl;
+                log(client_log, "watch event", "\"" + filename + "\" has no peers");
+            }
+            else {
+                std::cout << "\nwatched file \"" << filename << "\" is available from peer(s): " << peers.str() << '\n' << std::endl;
+                log(client_log, "watch event", "\"" + filename + "\" held by " + peers.str());
             }
-            
-            return server_socket_fd;
         }
 
-        void register_files(int server_socket_fd) {
-            int n;
-            char buffer[MAX_FILENAME_SIZE];
+        // handle user interface for watching a file, or for no longer watching one that already is
+        // instead of searching again until a file shows up, the indexing server says when a peer registers it
+        void watch_request() {
+            std::cout << "filename: ";
+            char filename[MAX_FILENAME_SIZE];
+            std::cin >> filename;
 
-            while (1) {
-                std::vector<std::pair<std::string, time_t>> tmp_files = get_files();
-                for(auto&& x: files) {
-                    char request = '1';
-                    // send a deregister request if a file is no longer in the files vector (or has been modified)
-                    if(!(std::find(tmp_files.begin(), tmp_files.end(), x) != tmp_files.end()))
-                        request = '2';
-                    
-                    // send a register request for any other files
-                    if (send(server_socket_fd, &request, sizeof(request), 0) < 0) {
-                        log(client_log, "server unresponsive", "ignoring request");
-                    }
-                    else {
-                        bzero(buffer, MAX_FILENAME_SIZE);
-                        strcpy(buffer, x.first.c_str());
-                        // register file with the indexing server
-                        if (send(server_socket_fd, buffer, sizeof(buffer), 0) < 0)
-                            log(client_log, "server unresponsive", "ignoring request");
-                    }
+            bool watching;
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                watching = watched_files.count(filename) > 0;
+                if (!watching && watched_files.size() >= MAX_WATCHES) {
+                    std::cout << "\nalready watching " << watched_files.size() << " files: stop watching one first\n" << std::endl;
+                    return;
                 }
-                // replace the old files vector with the new one
-                files = tmp_files;
-                // wait 5 seconds to update files list 
-                sleep(5);
             }
+            if (!watch(filename, !watching)) {
+                std::cout << "\nunexpected connection issue: watch not changed\n" << std::endl;
+                log(client_log, "server unresponsive", "ignoring request", LOG_WARN);
+            }
+            else if (watching)
+                std::cout << "\nstopped watching file \"" << filename << "\"\n" << std::endl;
+            else
+                std::cout << "\nwatching file \"" << filename << "\": you will be told when peers register it or the last one leaves\n" << std::endl;
         }
-        
+
         // handle user interface for sending a search request to the indexing server
-        void search_request(int server_socket_fd) {
+        void search_request() {
             std::cout << "filename: ";
             char filename[MAX_FILENAME_SIZE];
             std::cin >> filename;
             eval_log(client_log, search_request_counter, "search request", "start");
-            // send a search request to the indexing server
-            if (send(server_socket_fd, "3", sizeof(char), 0) < 0) {
+            // send a search request with the filename to the indexing server and wait for the list of peers with the file
+            // output appropriate message to peer client
+            SearchResult result = search(filename).get();
+            if (!result.ok) {
                 std::cout << "\nunexpected connection issue: no search performed\n" << std::endl;
-                log(client_log, "server unresponsive", "ignoring request");
+                log(client_log, "server unresponsive", "ignoring request", LOG_WARN);
             }
+            else if (result.client_ids.empty())
+                std::cout << "\nfile \"" << filename << "\" not found\n" << std::endl;
             else {
-                // send the filename to search to the indexing server
-                if (send(server_socket_fd, filename, sizeof(filename), 0) < 0) {
-                    std::cout << "\nunexpected connection issue: no search performed\n" << std::endl;
-                    log(client_log, "server unresponsive", "ignoring request");
-                }
-                else {
-                    // recieve list of peers with file from indexing server
-                    // output appropriate message to peer client
-                    char buffer[MAX_MSG_SIZE];
-                    if (recv(server_socket_fd, buffer, sizeof(buffer), 0) < 0) {
-                        std::cout << "\nunexpected connection issue: no search performed\n" << std::endl;
-                        log(client_log, "server unresponsive", "ignoring request");
-                    }
-                    else if (!buffer[0])
-                        std::cout << "\nfile \"" << filename << "\" not found\n" << std::endl;
-                    else
-                        std::cout << "\npeer(s) with file \"" << filename << "\": " << buffer << '\n' << std::endl;
+                std::ostringstream peers;
+                std::string delimiter;
+                for (auto &&client_id : result.client_ids) {
+                    peers << delimiter << client_id;
+                    delimiter = ',';
                 }
+                std::cout << "\npeer(s) with file \"" << filename << "\": " << peers.str() << '\n' << std::endl;
             }
             eval_log(client_log, search_request_counter++, "search request", "end");
         }
@@ -261,15 +1606,17 @@ class Peer {
             size_t extension_idx = filename.find_last_of('.');
             local_filename << filename.substr(0, extension_idx);
             // add the file origin if the file already exists in the local directory
-            if ((std::find_if(files.begin(), files.end(), [filename](const std::pair<std::string, int> &element){return element.first == filename;}) != files.end()))
+            std::unique_lock<std::mutex> guard(files_m);
+            if (files.count(filename))
                 local_filename << "-origin-" << peer;
+            guard.unlock();
             local_filename << filename.substr(extension_idx, filename.size() - extension_idx);
 
             return local_filename.str();
         }
         
         // handle user interface for sending a retrieve request to a peer server
-        void retrieve_request(int server_socket_fd) {
+        void retrieve_request() {
             std::cout << "peer: ";
             char peer[6];
             std::cin >> peer;
@@ -279,66 +1626,442 @@ class Peer {
                 std::cout << "\npeer '" << peer << "' is current client: no retreival performed\n" << std::endl;
                 return;
             }
-            // connect to the given peer server
-            int peer_socket_fd = connect_server(atoi(peer), false);
-            if (peer_socket_fd < 0) {
-                std::cout << "\npeer '" << peer << "' is not valid: no retreival performed\n" << std::endl;
-                log(client_log, "failed peer server connection", "ignoring request");
-                return;
-            }
-            
+
             eval_log(client_log, retrieve_request_counter, "retrieve request", "pause");
             std::cout << "filename: ";
             char filename[MAX_FILENAME_SIZE];
             std::cin >> filename;
+
+            // the index knows which content the peer registered, an unreachable index only skips the check
+            // a file the user just searched for is answered from the search cache, and any lookup that does go to the
+            // index stays out of the timed part of the request, so retrieve timings only cover the transfer
+            uint64_t expected_hash = 0;
+            SearchResult search_result = search(filename).get();
+            for (size_t i = 0; i < search_result.client_ids.size() && i < search_result.content_hashes.size(); i++) {
+                if (search_result.client_ids[i] == atoi(peer))
+                    expected_hash = search_result.content_hashes[i];
+            }
             eval_log(client_log, retrieve_request_counter, "retrieve request", "unpause");
-            if (send(peer_socket_fd, filename, sizeof(filename), 0) < 0) {
-                std::cout << "\nunexpected connection issue: no retreival performed\n" << std::endl;
-                log(client_log, "peer unresponsive", "ignoring request");
+
+            DownloadResult result = download(filename, std::vector<int>{atoi(peer)}, peer, expected_hash);
+            switch (result.status) {
+                case DownloadResult::NO_SOURCE:
+                    std::cout << "\npeer '" << peer << "' is not valid: no retreival performed\n" << std::endl;
+                    log(client_log, "failed peer server connection", "ignoring request", LOG_WARN);
+                    break;
+                case DownloadResult::BUSY:
+                    std::cout << "\npeer '" << peer << "' is too busy to send files: no retreival performed\n" << std::endl;
+                    break;
+                case DownloadResult::NOT_FOUND:
+                    std::cout << "\npeer '" << peer << "' does not have file \"" << filename << "\": no retreival performed\n" << std::endl;
+                    break;
+                case DownloadResult::UNREADABLE:
+                    std::cout << "\ncould not read file \"" << filename << "\"'s stats: no retreival performed\n" << std::endl;
+                    break;
+                case DownloadResult::FILE_ERROR:
+                    std::cout << "\nunable to create new file \"" << filename << "\": no retreival performed\n" << std::endl;
+                    log(client_log, "failed file open", "ignoring file", LOG_WARN);
+                    break;
+                case DownloadResult::FAILED:
+                    std::cout << "\nunexpected connection issue: download of \"" << filename << "\" stopped at " << result.completed << " of "
+                              << result.file_size << " bytes, retrieve it again to resume\n" << std::endl;
+                    log(client_log, "peer unresponsive", "ignoring request", LOG_WARN);
+                    break;
+                case DownloadResult::PRESENT:
+                    std::cout << "\nfile \"" << filename << "\" is already here as \"" << result.local_filename << "\": no retreival performed\n" << std::endl;
+                    break;
+                case DownloadResult::CORRUPT:
+                    std::cout << "\nfile \"" << filename << "\" from peer '" << peer << "' does not match its registered content: download discarded\n" << std::endl;
+                    log(client_log, "failed content check", "discarding download", LOG_WARN);
+                    break;
+                case DownloadResult::OK:
+                    std::cout << "\nfile \"" << filename << "\" downloaded as \"" << result.local_filename << "\"";
+                    if (result.resumed > 0)
+                        std::cout << " (resumed after " << result.resumed << " bytes)";
+                    std::cout << "\n" << std::endl;
+                    std::cout << "\ndislpay file '" << result.local_filename << "'\n. . .\n" << std::endl;
+                    log(client_log, "file download", "file download successful");
+                    break;
             }
-            else {
-                char buffer[MAX_STAT_MSG_SIZE];
-                // get the file size from the peer server
-                if (recv(peer_socket_fd, buffer, sizeof(buffer), 0) < 0) {
-                    std::cout << "\nunexpected connection issue: no retreival performed\n" << std::endl;
-                    log(client_log, "peer unresponsive", "ignoring request");
+            eval_log(client_log, retrieve_request_counter++, "retrieve request", "end");
+        }
+
+        // ask a source for a range of a file and read the reply header, the range's bytes follow on the connection
+        // returns the reply status, or -1 if the connection broke or the source did not send the range asked for
+        int request_range(SwarmSource &source, const std::string &filename, uint64_t offset, uint64_t length, uint64_t &file_size) {
+            std::string payload;
+            put_string(payload, filename);
+            put_varint(payload, offset);
+            put_varint(payload, length);
+            std::string frame = make_frame(OP_RANGE, payload);
+            // a busy source replies and closes before reading anything, so look for its reply even if sending failed
+            send_all(source.socket_fd, frame.data(), frame.size());
+
+            uint8_t opcode;
+            std::string reply;
+            if (!source.reader.next(opcode, reply) || opcode != OP_RANGE_RESULT || reply.empty())
+                return -1;
+            if (reply[0] != RANGE_OK)
+                return reply[0];
+            const char *pos = reply.data() + 1;
+            const char *end = reply.data() + reply.size();
+            uint64_t reply_offset, reply_length;
+            if (!get_varint(pos, end, file_size) || !get_varint(pos, end, reply_offset) || !get_varint(pos, end, reply_length))
+                return -1;
+            return reply_offset == offset && reply_length == length ? RANGE_OK : -1;
+        }
+
+        // take the next chunk for a source to fetch, waiting while every unfinished chunk already has two sources
+        // returns false once the whole file is done
+        bool next_chunk(SwarmDownload &swarm, size_t &chunk) {
+            std::unique_lock<std::mutex> guard(swarm.m);
+            while (swarm.done < swarm.chunks.size()) {
+                for (; swarm.next_pending < swarm.chunks.size(); swarm.next_pending++) {
+                    if (swarm.chunks[swarm.next_pending] == SwarmDownload::CHUNK_PENDING) {
+                        chunk = swarm.next_pending++;
+                        swarm.chunks[chunk] = SwarmDownload::CHUNK_ACTIVE;
+                        swarm.fetching[chunk]++;
+                        return true;
+                    }
+                }
+                // nothing left to hand out, so race a slower source for one of its chunks
+                for (size_t i = 0; i < swarm.chunks.size(); i++) {
+                    if (swarm.chunks[i] == SwarmDownload::CHUNK_ACTIVE && swarm.fetching[i] == 1) {
+                        chunk = i;
+                        swarm.fetching[chunk]++;
+                        return true;
+                    }
+                }
+                swarm.cv.wait(guard);
+            }
+            return false;
+        }
+
+        // a source is done with a chunk, a failed chunk goes back to pending unless another source still has it
+        // finished chunks are recorded in the progress sidecar right away so an interrupted download can resume
+        void finish_chunk(SwarmDownload &swarm, size_t chunk, bool ok) {
+            std::lock_guard<std::mutex> guard(swarm.m);
+            swarm.fetching[chunk]--;
+            if (ok && swarm.chunks[chunk] != SwarmDownload::CHUNK_DONE) {
+                swarm.chunks[chunk] = SwarmDownload::CHUNK_DONE;
+                swarm.done++;
+                swarm.progress[chunk / 8] |= 1 << (chunk % 8);
+                pwrite(swarm.progress_fd, &swarm.progress[chunk / 8], 1, PROGRESS_HEADER_SIZE + chunk / 8);
+            }
+            else if (!ok && swarm.chunks[chunk] == SwarmDownload::CHUNK_ACTIVE && swarm.fetching[chunk] == 0) {
+                swarm.chunks[chunk] = SwarmDownload::CHUNK_PENDING;
+                swarm.next_pending = std::min(swarm.next_pending, chunk);
+            }
+            swarm.cv.notify_all();
+        }
+
+        // write n bytes waiting in a source's pipe to the file at offset
+        bool drain_pipe(int file_fd, SwarmSource &source, uint64_t offset, size_t n, std::vector<char> &buffer) {
+            loff_t file_offset = offset;
+            while (n > 0) {
+                ssize_t moved;
+                if (source.splice_to_file) {
+                    moved = splice(source.pipe_fds[0], NULL, file_fd, &file_offset, n, SPLICE_F_MOVE);
+                    if (moved < 0 && errno == EINVAL) {
+                        source.splice_to_file = false;
+                        continue;
+                    }
                 }
                 else {
-                    int file_size = atoi(buffer);
-                    // handle message from peer server
-                    if (file_size == -1)
-                        std::cout << "\npeer '" << peer << "' does not have file \"" << filename << "\": no retreival performed\n" << std::endl;
-                    else if (file_size == -2)
-                        std::cout << "\ncould not read file \"" << filename << "\"'s stats: no retreival performed\n" << std::endl;
-                    else {
-                        // create pretty filename for outputting results to peer client
-                        std::string local_filename_path = resolve_filename(filename, peer);
-                        size_t filename_idx = local_filename_path.find_last_of('/');
-                        std::string local_filename = local_filename_path.substr(filename_idx+1, local_filename_path.size() - filename_idx);
-                        FILE *file = fopen(local_filename_path.c_str(), "w");
-                        if (file == NULL) {
-                            std::cout << "\nunable to create new file \"" << local_filename << "\": no retreival performed\n" << std::endl;
-                            log(client_log, "failed file open", "ignoring file");
-                        }
-                        else {
-                            char buffer_[MAX_MSG_SIZE];
-                            int remaining_size = file_size;
-                            int received_size;
-                            // write blocks recieved from peer server to new file
-                            while (((received_size = recv(peer_socket_fd, buffer_, sizeof(buffer_), 0)) > 0) && (remaining_size > 0)) {
-                                fwrite(buffer_, sizeof(char), received_size, file);
-                                remaining_size -= received_size;
-                            }
-                            fclose(file);
-                            std::cout << "\nfile \"" << filename << "\" downloaded as \"" << local_filename << "\"\n" << std::endl;
-                            std::cout << "\ndislpay file '" << local_filename << "'\n. . .\n" << std::endl;
-                            log(client_log, "file download", "file download successful");
-                        }
+                    moved = read(source.pipe_fds[0], buffer.data(), std::min(n, buffer.size()));
+                    if (moved > 0 && pwrite(file_fd, buffer.data(), moved, file_offset) != moved)
+                        return false;
+                    if (moved > 0)
+                        file_offset += moved;
+                }
+                if (moved < 0 && errno == EINTR)
+                    continue;
+                if (moved <= 0)
+                    return false;
+                n -= moved;
+            }
+            return true;
+        }
+
+        // move the bytes of a range from a source's connection into the file at offset
+        // whatever the frame reader already pulled in is written from its buffer, the rest is spliced from the
+        // socket through a pipe into the page cache without passing through user space, or copied through a
+        // large buffer when splicing is off
+        bool receive_range(int file_fd, SwarmSource &source, uint64_t offset, uint64_t length, std::vector<char> &buffer) {
+            uint64_t received = 0;
+            while (received < length) {
+                ssize_t n;
+                if (source.pipe_fds[0] >= 0 && source.reader.buffered() == 0) {
+                    n = splice(source.socket_fd, NULL, source.pipe_fds[1], NULL, std::min<uint64_t>(SPLICE_PIPE_SIZE, length - received), SPLICE_F_MOVE | SPLICE_F_MORE);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0 || !drain_pipe(file_fd, source, offset + received, n, buffer))
+                        return false;
+                }
+                else {
+                    n = source.reader.read_some(buffer.data(), std::min<uint64_t>(buffer.size(), length - received));
+                    if (n <= 0 || pwrite(file_fd, buffer.data(), n, offset + received) != n)
+                        return false;
+                }
+                received += n;
+            }
+            return true;
+        }
+
+        // fetch chunks from a single source until the download is done or the source fails
+        void fetch_chunks(SwarmDownload &swarm, SwarmSource &source) {
+            std::vector<char> buffer(DOWNLOAD_BUFFER_SIZE);
+            if (config.splice_downloads && pipe2(source.pipe_fds, O_CLOEXEC) == 0)
+                fcntl(source.pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+            size_t chunk;
+            while (next_chunk(swarm, chunk)) {
+                uint64_t offset = chunk * (uint64_t)SWARM_CHUNK_SIZE;
+                uint64_t length = std::min<uint64_t>(SWARM_CHUNK_SIZE, swarm.file_size - offset);
+                uint64_t file_size;
+                bool ok = request_range(source, swarm.filename, offset, length, file_size) == RANGE_OK && file_size == swarm.file_size;
+                // write each block where it belongs, chunks from different sources land in the same file at once
+                ok = ok && receive_range(swarm.file_fd, source, offset, length, buffer);
+                finish_chunk(swarm, chunk, ok);
+                if (!ok) {
+                    log(client_log, "peer unresponsive", "dropping download source " + std::to_string(source.port), LOG_WARN);
+                    source.healthy = false;
+                    break;
+                }
+                source.received += length;
+            }
+            if (source.pipe_fds[0] >= 0) {
+                close(source.pipe_fds[0]);
+                close(source.pipe_fds[1]);
+            }
+        }
+
+        // open the partial file and progress sidecar for a download, picking up the chunks an earlier attempt finished
+        // an earlier attempt is only trusted if it was for a file of the same size, otherwise it starts over
+        bool open_partial(SwarmDownload &swarm, const std::string &partial_path) {
+            std::string progress_path = partial_path + PROGRESS_SUFFIX;
+            size_t num_chunks = (swarm.file_size + SWARM_CHUNK_SIZE - 1) / SWARM_CHUNK_SIZE;
+            swarm.chunks.assign(num_chunks, SwarmDownload::CHUNK_PENDING);
+            swarm.fetching.assign(num_chunks, 0);
+            swarm.progress.assign((num_chunks + 7) / 8, 0);
+
+            char header[PROGRESS_HEADER_SIZE];
+            memcpy(header, PROGRESS_MAGIC, 8);
+            uint64_t chunk_size = SWARM_CHUNK_SIZE;
+            memcpy(header + 8, &swarm.file_size, sizeof(uint64_t));
+            memcpy(header + 16, &chunk_size, sizeof(uint64_t));
+
+            bool resume = false;
+            struct stat partial_stat;
+            swarm.progress_fd = open(progress_path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (swarm.progress_fd < 0)
+                return false;
+            char saved[PROGRESS_HEADER_SIZE];
+            if (pread(swarm.progress_fd, saved, sizeof(saved), 0) == sizeof(saved) && memcmp(saved, header, sizeof(header)) == 0 &&
+                stat(partial_path.c_str(), &partial_stat) == 0 && (uint64_t)partial_stat.st_size == swarm.file_size) {
+                resume = pread(swarm.progress_fd, &swarm.progress[0], swarm.progress.size(), PROGRESS_HEADER_SIZE) == (ssize_t)swarm.progress.size();
+            }
+
+            if (resume) {
+                for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+                    if (swarm.progress[chunk / 8] & (1 << (chunk % 8))) {
+                        swarm.chunks[chunk] = SwarmDownload::CHUNK_DONE;
+                        swarm.done++;
                     }
                 }
+                swarm.file_fd = open(partial_path.c_str(), O_WRONLY);
+                return swarm.file_fd >= 0;
             }
-            eval_log(client_log, retrieve_request_counter++, "retrieve request", "end");
-            close(peer_socket_fd);
+
+            // start over with an empty progress bitmap
+            std::fill(swarm.progress.begin(), swarm.progress.end(), 0);
+            std::string fresh(header, sizeof(header));
+            fresh.append(swarm.progress.begin(), swarm.progress.end());
+            if (ftruncate(swarm.progress_fd, 0) < 0 || pwrite(swarm.progress_fd, fresh.data(), fresh.size(), 0) != (ssize_t)fresh.size())
+                return false;
+            swarm.file_fd = open(partial_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (swarm.file_fd < 0)
+                return false;
+            // reserve the whole file up front so chunks can be written in any order without fragmenting it
+            // file systems without fallocate just get the size set, so blocks are allocated as chunks land
+            if (swarm.file_size > 0 && fallocate(swarm.file_fd, 0, 0, swarm.file_size) < 0)
+                ftruncate(swarm.file_fd, swarm.file_size);
+            return true;
+        }
+
+        // download a file in chunks from the given peers at once, one source works the same way as many
+        // the file is written to a partial file next to a progress sidecar and only renamed into place once complete,
+        // so a later download of the same file picks up where an interrupted one stopped
+        // with a known content hash nothing is fetched if a shared file already holds that content, and a finished
+        // download is only kept if it hashes to it
+        DownloadResult download(const std::string &filename, const std::vector<int> &holders, const std::string &origin, uint64_t expected_hash=0) {
+            DownloadResult result;
+            if (expected_hash) {
+                result.local_filename = local_copy(expected_hash);
+                if (!result.local_filename.empty()) {
+                    result.status = DownloadResult::PRESENT;
+                    return result;
+                }
+            }
+
+            std::vector<std::unique_ptr<SwarmSource>> sources;
+            for (auto &&holder : holders) {
+                if (sources.size() == MAX_SWARM_SOURCES)
+                    break;
+                int peer_socket_fd = acquire_connection(holder);
+                if (peer_socket_fd < 0)
+                    continue;
+                sources.emplace_back(new SwarmSource(holder, peer_socket_fd));
+            }
+
+            // learn the file size from the first source that has the file
+            SwarmDownload swarm;
+            swarm.filename = filename;
+            while (!sources.empty()) {
+                int status = request_range(*sources.front(), filename, 0, 0, swarm.file_size);
+                if (status == RANGE_OK)
+                    break;
+                if (status == RANGE_BUSY)
+                    result.status = DownloadResult::BUSY;
+                else if (status == RANGE_NOT_FOUND)
+                    result.status = DownloadResult::NOT_FOUND;
+                else if (status == RANGE_UNREADABLE)
+                    result.status = DownloadResult::UNREADABLE;
+                // a source without the file is still fine to reuse, a busy or broken one has closed
+                sources.front()->healthy = status == RANGE_NOT_FOUND || status == RANGE_UNREADABLE;
+                release_source(*sources.front());
+                sources.erase(sources.begin());
+            }
+            if (sources.empty())
+                return result;
+            result.file_size = swarm.file_size;
+
+            std::string partial_path = files_directory_path + filename + PARTIAL_SUFFIX;
+            if (!open_partial(swarm, partial_path)) {
+                if (swarm.progress_fd >= 0)
+                    close(swarm.progress_fd);
+                for (auto &&source : sources)
+                    release_source(*source);
+                result.status = DownloadResult::FILE_ERROR;
+                return result;
+            }
+            result.resumed = std::min<uint64_t>(swarm.done * (uint64_t)SWARM_CHUNK_SIZE, swarm.file_size);
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            std::vector<std::thread> fetchers;
+            for (auto &&source : sources)
+                fetchers.emplace_back(&Peer::fetch_chunks, this, std::ref(swarm), std::ref(*source));
+            for (auto &&fetcher : fetchers)
+                fetcher.join();
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            close(swarm.file_fd);
+            close(swarm.progress_fd);
+            for (auto &&source : sources) {
+                result.sources.emplace_back(source->port, source->received);
+                release_source(*source);
+            }
+
+            result.completed = std::min<uint64_t>(swarm.done * (uint64_t)SWARM_CHUNK_SIZE, swarm.file_size);
+            if (swarm.done < swarm.chunks.size()) {
+                // keep the partial file and its progress for the next attempt
+                result.status = DownloadResult::FAILED;
+                return result;
+            }
+
+            // hash what landed on disk, the chunks may have come from peers holding different versions
+            uint64_t hash = 0;
+            struct stat partial_stat;
+            int partial_fd = open(partial_path.c_str(), O_RDONLY | O_CLOEXEC);
+            bool hashed = partial_fd >= 0 && hash_file(partial_fd, hash) && fstat(partial_fd, &partial_stat) == 0;
+            if (partial_fd >= 0)
+                close(partial_fd);
+            if (!hashed) {
+                result.status = DownloadResult::FILE_ERROR;
+                return result;
+            }
+            if (expected_hash && hash != expected_hash) {
+                unlink(partial_path.c_str());
+                unlink((partial_path + PROGRESS_SUFFIX).c_str());
+                result.status = DownloadResult::CORRUPT;
+                return result;
+            }
+
+            std::string local_filename_path = resolve_filename(filename, origin);
+            if (rename(partial_path.c_str(), local_filename_path.c_str()) < 0) {
+                result.status = DownloadResult::FILE_ERROR;
+                return result;
+            }
+            unlink((partial_path + PROGRESS_SUFFIX).c_str());
+            result.local_filename = local_filename_path.substr(local_filename_path.find_last_of('/') + 1);
+            // rename keeps the inode and modification time, so the file is not hashed again when it is registered
+            remember_hash(result.local_filename, file_version(partial_stat), hash);
+            result.status = DownloadResult::OK;
+            return result;
+        }
+
+        // handle user interface for downloading a file from every peer that has it at once
+        void swarm_request() {
+            std::cout << "filename: ";
+            char filename[MAX_FILENAME_SIZE];
+            std::cin >> filename;
+            eval_log(client_log, retrieve_request_counter, "swarm request", "start");
+
+            SearchResult search_result = search(filename).get();
+            if (!search_result.ok) {
+                std::cout << "\nunexpected connection issue: no retreival performed\n" << std::endl;
+                log(client_log, "server unresponsive", "ignoring request", LOG_WARN);
+                eval_log(client_log, retrieve_request_counter++, "swarm request", "end");
+                return;
+            }
+            // chunks may only be mixed between holders of the same content, so the swarm goes with the content most
+            // holders registered. holders that registered no hash are only used if nobody did
+            std::unordered_map<uint64_t, int> content_counts;
+            uint64_t expected_hash = 0;
+            for (size_t i = 0; i < search_result.client_ids.size(); i++) {
+                uint64_t hash = search_result.content_hashes[i];
+                if (search_result.client_ids[i] != port && hash && ++content_counts[hash] > content_counts[expected_hash])
+                    expected_hash = hash;
+            }
+            std::vector<int> holders;
+            for (size_t i = 0; i < search_result.client_ids.size(); i++) {
+                if (search_result.client_ids[i] != port && search_result.content_hashes[i] == expected_hash)
+                    holders.push_back(search_result.client_ids[i]);
+            }
+            // holders come ranked by the indexing server with the least busy first, which already spreads concurrent swarms
+
+            DownloadResult result = download(filename, holders, "swarm", expected_hash);
+            if (result.status == DownloadResult::OK) {
+                uint64_t fetched = result.file_size - result.resumed;
+                std::ostringstream report;
+                report << "\nfile \"" << filename << "\" downloaded as \"" << result.local_filename << "\" from " << result.sources.size() << " peer(s): "
+                       << fetched << " bytes in " << result.seconds << "s (" << (result.seconds > 0 ? fetched / result.seconds / (1 << 20) : 0) << " MiB/s)";
+                if (result.resumed > 0)
+                    report << ", resumed after " << result.resumed << " bytes";
+                report << '\n';
+                for (auto &&source : result.sources)
+                    report << "    peer " << source.first << ": " << source.second << " bytes\n";
+                std::cout << report.str() << std::endl;
+                log(client_log, "file download", "swarm download of " + std::to_string(result.file_size) + " bytes from " + std::to_string(result.sources.size()) + " peer(s)");
+            }
+            else if (result.status == DownloadResult::FAILED) {
+                std::cout << "\nall peers sending file \"" << filename << "\" failed at " << result.completed << " of " << result.file_size
+                          << " bytes, retrieve it again to resume\n" << std::endl;
+                log(client_log, "peer unresponsive", "ignoring request", LOG_WARN);
+            }
+            else if (result.status == DownloadResult::FILE_ERROR) {
+                std::cout << "\nunable to create new file \"" << filename << "\": no retreival performed\n" << std::endl;
+                log(client_log, "failed file open", "ignoring file", LOG_WARN);
+            }
+            else if (result.status == DownloadResult::PRESENT) {
+                std::cout << "\nfile \"" << filename << "\" is already here as \"" << result.local_filename << "\": no retreival performed\n" << std::endl;
+            }
+            else if (result.status == DownloadResult::CORRUPT) {
+                std::cout << "\nfile \"" << filename << "\" does not match its registered content: download discarded\n" << std::endl;
+                log(client_log, "failed content check", "discarding download", LOG_WARN);
+            }
+            else {
+                std::cout << "\nno peer could send file \"" << filename << "\": no retreival performed\n" << std::endl;
+            }
+            eval_log(client_log, retrieve_request_counter++, "swarm request", "end");
         }
 
     public:
@@ -346,12 +2069,20 @@ class Peer {
         int port;
         int socket_fd;
 
-        Peer(std::string path, int custom_port) {
+        Peer(std::string path, const PeerConfig &peer_config) : config(peer_config) {
             files_directory_path = path;
             // add ending '/' if missing in path argument
             if (files_directory_path.back() != '/')
                 files_directory_path += '/';
-            files = get_files();
+            // start queuing changes before the first scan, so a file changed while the peer starts up is not missed
+            inotify_fd = inotify_init1(IN_CLOEXEC);
+            if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, files_directory_path.c_str(), WATCH_EVENTS) < 0) {
+                close(inotify_fd);
+                inotify_fd = -1;
+            }
+            files = scan_files();
+            load_hash_cache();
+            resolve_host();
 
             struct sockaddr_in addr;
             socklen_t addr_size = sizeof(addr);
@@ -360,11 +2091,16 @@ class Peer {
             addr.sin_family = AF_INET;
             addr.sin_addr.s_addr = INADDR_ANY;
             // if passing custom port as arg, use that instead of a random one (used for running analysis)
-            if (custom_port > 0) {
-                addr.sin_port = htons(custom_port);
+            if (config.port > 0) {
+                addr.sin_port = htons(config.port);
             }
 
             socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+            // allow a restarted peer to take its port back right away
+            int reuse = 1;
+            setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            // accepted connections inherit the send buffer used for uploads
+            set_socket_buffer(socket_fd, SO_SNDBUF);
 
             // bind socket to port to be used for peer server
             if (bind(socket_fd, (struct sockaddr*)&addr, addr_size) < 0)
@@ -378,45 +2114,361 @@ class Peer {
 
             // start logging for both peer client and peer server
             std::string log_name_prefix = "logs/peers/" + std::to_string(port);
-            server_log.open(log_name_prefix + "_server.log");
-            client_log.open(log_name_prefix + "_client.log");
+            logger.set_level(config.log_level);
+            logger.set_flush_interval(config.log_flush_ms);
+            server_log = logger.open(log_name_prefix + "_server.log");
+            client_log = logger.open(log_name_prefix + "_client.log");
+            logger.start();
         }
         
-        void run_client() {
-            int server_socket_fd = connect_server(INDEXING_SERVER_PORT);
+        // send a search to the indexing server holding filename without waiting for its reply
+        // any number of searches can be in flight on a connection and replies are matched by request id,
+        // callback runs on the reply reader thread so it should hand off anything slow
+        // with the search cache on, results are leased and a cached one is handed to callback right away on this thread
+        void search(const std::string &filename, std::function<void(const SearchResult&)> callback) {
+            SearchResult cached;
+            if (config.search_cache > 0 && cached_search(filename, cached)) {
+                callback(cached);
+                return;
+            }
+
+            std::shared_ptr<IndexServer> server = index_server_for(filename);
+            uint64_t request_id;
+            bool unreachable = false;
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                unreachable = !server || server->closed;
+                if (!unreachable) {
+                    request_id = new_request_id(*server);
+                    pending_searches[request_id] = callback;
+                    if (config.search_cache > 0)
+                        pending_leases[request_id] = std::make_pair(filename, std::chrono::steady_clock::now());
+                }
+            }
+            // like a completed search, the callback runs without pending_m held so it may start another search
+            if (unreachable) {
+                callback(SearchResult());
+                return;
+            }
+
+            std::string payload;
+            put_varint(payload, request_id);
+            put_string(payload, filename);
+            if (!send_frame(*server, make_frame(config.search_cache > 0 ? OP_SEARCH_LEASED : OP_SEARCH_TAGGED, payload))) {
+                {
+                    std::lock_guard<std::mutex> guard(pending_m);
+                    pending_leases.erase(request_id);
+                }
+                complete_search(request_id, SearchResult());
+            }
+        }
+
+        // look up a search result whose lease has not run out, marking it as the most recently used
+        bool cached_search(const std::string &filename, SearchResult &result) {
+            std::lock_guard<std::mutex> guard(search_cache_m);
+            auto cached = search_cache.find(filename);
+            if (cached == search_cache.end() || std::chrono::steady_clock::now() >= cached->second.expires) {
+                if (cached != search_cache.end())
+                    remove_cached(cached);
+                search_cache_misses++;
+                return false;
+            }
+            search_lru.splice(search_lru.begin(), search_lru, cached->second.lru);
+            result = cached->second.result;
+            search_cache_hits++;
+            return true;
+        }
+
+        // keep a leased search result, evicting the least recently used ones once the cache is over its size
+        void cache_search(const std::string &filename, const SearchResult &result, std::chrono::steady_clock::time_point expires) {
+            size_t bytes = SEARCH_CACHE_OVERHEAD + 2 * filename.size() + result.client_ids.size() * sizeof(int) + result.content_hashes.size() * sizeof(uint64_t);
+            if (bytes > config.search_cache)
+                return;
+            std::lock_guard<std::mutex> guard(search_cache_m);
+            auto cached = search_cache.find(filename);
+            if (cached != search_cache.end())
+                remove_cached(cached);
+            search_lru.push_front(filename);
+            search_cache[filename] = CachedSearch{result, expires, bytes, search_lru.begin()};
+            search_cache_bytes += bytes;
+            while (search_cache_bytes > config.search_cache)
+                remove_cached(search_cache.find(search_lru.back()));
+        }
+
+        void clear_search_cache() {
+            std::lock_guard<std::mutex> guard(search_cache_m);
+            search_cache.clear();
+            search_lru.clear();
+            search_cache_bytes = 0;
+        }
+
+        void uncache_search(const std::string &filename) {
+            std::lock_guard<std::mutex> guard(search_cache_m);
+            auto cached = search_cache.find(filename);
+            if (cached != search_cache.end())
+                remove_cached(cached);
+        }
+
+        // search_cache_m must be held
+        void remove_cached(std::unordered_map<std::string, CachedSearch>::iterator cached) {
+            search_cache_bytes -= cached->second.bytes;
+            search_lru.erase(cached->second.lru);
+            search_cache.erase(cached);
+        }
+
+        // send a search to the indexing server, the future becomes ready once the reply arrives
+        std::future<SearchResult> search(const std::string &filename) {
+            std::shared_ptr<std::promise<SearchResult>> result = std::make_shared<std::promise<SearchResult>>();
+            search(filename, [result](const SearchResult &search_result) { result->set_value(search_result); });
+            return result->get_future();
+        }
+
+        // send up to MAX_BATCH_SIZE filenames held by server in one search, the future holds a result per filename in the same order,
+        // or nothing if the server could not be reached
+        std::future<std::vector<SearchResult>> search_batch(std::shared_ptr<IndexServer> server, const std::vector<std::string> &filenames) {
+            std::shared_ptr<std::promise<std::vector<SearchResult>>> result = std::make_shared<std::promise<std::vector<SearchResult>>>();
+            uint64_t request_id;
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                if (server->closed) {
+                    result->set_value(std::vector<SearchResult>());
+                    return result->get_future();
+                }
+                request_id = new_request_id(*server);
+                pending_batches[request_id] = result;
+            }
+
+            std::string payload;
+            put_varint(payload, request_id);
+            put_strings(payload, filenames);
+            if (!send_frame(*server, make_frame(OP_SEARCH_MANY, payload)))
+                complete_batch(request_id, std::vector<SearchResult>());
+            return result->get_future();
+        }
+
+        // search any number of filenames, sending every batch to every server before waiting on the first reply
+        // results line up with filenames, with ok unset for any the server did not answer
+        std::vector<SearchResult> search_many(const std::vector<std::string> &filenames) {
+            std::shared_ptr<const PartitionMap> map;
+            std::unordered_map<int, std::shared_ptr<IndexServer>> servers;
+            {
+                std::lock_guard<std::mutex> guard(servers_m);
+                map = partition_map;
+                servers = index_servers;
+            }
+            // positions of the filenames each server holds
+            std::unordered_map<int, std::vector<size_t>> server_filenames;
+            for (size_t i = 0; i < filenames.size(); i++)
+                server_filenames[map->server_for(filenames[i])].push_back(i);
+
+            std::vector<std::pair<std::vector<size_t>, std::future<std::vector<SearchResult>>>> batches;
+            for (auto &&positions : server_filenames) {
+                auto server = servers.find(positions.first);
+                if (server == servers.end())
+                    continue;
+                for (size_t i = 0; i < positions.second.size(); i += MAX_BATCH_SIZE) {
+                    std::vector<size_t> batch(positions.second.begin() + i, positions.second.begin() + std::min(positions.second.size(), i + MAX_BATCH_SIZE));
+                    std::vector<std::string> batch_filenames;
+                    for (size_t position : batch)
+                        batch_filenames.push_back(filenames[position]);
+                    batches.emplace_back(batch, search_batch(server->second, batch_filenames));
+                }
+            }
+
+            std::vector<SearchResult> results(filenames.size());
+            for (auto &&batch : batches) {
+                std::vector<SearchResult> batch_results = batch.second.get();
+                if (batch_results.size() != batch.first.size())
+                    continue;
+                for (size_t i = 0; i < batch.first.size(); i++)
+                    results[batch.first[i]] = batch_results[i];
+            }
+            return results;
+        }
+
+        // ask an indexing server for one page of a pattern search, starting after cursor
+        std::future<PatternPage> pattern_search(std::shared_ptr<IndexServer> server, uint8_t mode, const std::string &pattern, const std::string &cursor) {
+            std::shared_ptr<std::promise<PatternPage>> result = std::make_shared<std::promise<PatternPage>>();
+            uint64_t request_id;
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                if (server->closed) {
+                    result->set_value(PatternPage());
+                    return result->get_future();
+                }
+                request_id = new_request_id(*server);
+                pending_patterns[request_id] = result;
+            }
+
+            std::string payload;
+            put_varint(payload, request_id);
+            payload += (char)mode;
+            put_string(payload, pattern);
+            put_string(payload, cursor);
+            put_varint(payload, 0);
+            if (!send_frame(*server, make_frame(OP_SEARCH_PATTERN, payload)))
+                complete_pattern(request_id, PatternPage());
+            return result->get_future();
+        }
+
+        // one page of a pattern search across every indexing server, starting after cursor
+        // each server pages through its own filenames, so the merged page ends where the first server that has more stopped,
+        // and the servers that got further are asked again from there
+        PatternPage pattern_search(uint8_t mode, const std::string &pattern, const std::string &cursor) {
+            std::vector<std::future<PatternPage>> requests;
+            for (auto &&server : connected_servers())
+                requests.push_back(pattern_search(server, mode, pattern, cursor));
+
+            PatternPage merged;
+            merged.ok = !requests.empty();
+            std::vector<PatternPage> pages;
+            for (auto &&request : requests) {
+                pages.push_back(request.get());
+                merged.ok = merged.ok && pages.back().ok;
+                const std::string &next = pages.back().cursor;
+                if (!next.empty() && (merged.cursor.empty() || next < merged.cursor))
+                    merged.cursor = next;
+            }
+            if (!merged.ok)
+                return merged;
+
+            for (auto &&page : pages) {
+                for (auto &&file : page.files) {
+                    if (merged.cursor.empty() || file.first <= merged.cursor)
+                        merged.files.push_back(std::move(file));
+                }
+            }
+            std::sort(merged.files.begin(), merged.files.end());
+            // peers still on an older partition map may have a file on another server for a moment
+            for (size_t i = 1; i < merged.files.size();) {
+                if (merged.files[i].first != merged.files[i - 1].first) {
+                    i++;
+                    continue;
+                }
+                std::vector<int> &holders = merged.files[i - 1].second;
+                for (int client_id : merged.files[i].second) {
+                    if (std::find(holders.begin(), holders.end(), client_id) == holders.end())
+                        holders.push_back(client_id);
+                }
+                merged.files.erase(merged.files.begin() + i);
+            }
+            return merged;
+        }
 
-            //send peer server port number to be used as client id in indexing server
-            if (send(server_socket_fd, &port, sizeof(port), 0) < 0)
-                error("server unreachable");
+        // start or stop watching a file, the indexing server holding it pushes changes to its holders until the watch stops
+        // returns false if the server could not be reached
+        bool watch(const std::string &filename, bool start) {
+            std::shared_ptr<IndexServer> server = index_server_for(filename);
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                if (!server || server->closed)
+                    return false;
+                // the watch is recorded first so an event pushed right after it is not dropped
+                if (start)
+                    watched_files.insert(filename);
+                else
+                    watched_files.erase(filename);
+            }
+
+            return send_watch(*server, filename, start);
+        }
+
+        bool send_watch(IndexServer &server, const std::string &filename, bool start) {
+            std::string payload;
+            put_string(payload, filename);
+            return send_frame(server, make_frame(start ? OP_WATCH : OP_UNWATCH, payload));
+        }
+
+        // ask an indexing server for its stats report, the future holds an empty report if the server could not be reached
+        std::future<std::string> stats(std::shared_ptr<IndexServer> server) {
+            std::shared_ptr<std::promise<std::string>> result = std::make_shared<std::promise<std::string>>();
+            uint64_t request_id;
+            {
+                std::lock_guard<std::mutex> guard(pending_m);
+                if (server->closed) {
+                    result->set_value(std::string());
+                    return result->get_future();
+                }
+                request_id = new_request_id(*server);
+                pending_stats[request_id] = result;
+            }
+
+            std::string payload;
+            put_varint(payload, request_id);
+            if (!send_frame(*server, make_frame(OP_STATS, payload)))
+                complete_stats(request_id, std::string());
+            return result->get_future();
+        }
+
+        void run_client() {
+            // connect to every indexing server in the partition map, each one gets its own reply reader
+            partition_map = read_partition_map();
+            if (!partition_map)
+                error("no indexing servers in \"" + config.index_servers + "\"");
+            for (int server_port : partition_map->servers()) {
+                std::shared_ptr<IndexServer> server = connect_index_server(server_port);
+                if (!server)
+                    error("failed indexing server connection");
+                index_servers[server_port] = server;
+            }
 
             //start thread for automatic files updater
-            std::thread t(&Peer::register_files, this, server_socket_fd);
+            std::thread t(&Peer::register_files, this);
             t.detach();
 
+            //start thread for watching the files directory
+            std::thread w_t(&Peer::watch_files, this);
+            w_t.detach();
+
             //continously prompt user for request
             while (1) {
                 std::string request;
-                std::cout << "request [(s)earch|(r)etrieve|(q)uit]: ";
-                std::cin >> request;
+                std::cout << "request [(s)earch|(b)atch search|(p)attern search|wat(c)h|(r)etrieve|s(w)arm retrieve|s(t)ats|(q)uit]: ";
+                // treat a closed stdin like a quit instead of prompting forever
+                if (!(std::cin >> request))
+                    request = "q";
 
                 switch (request[0]) {
                     case 's':
                     case 'S':
-                        search_request(server_socket_fd);
+                        search_request();
                         break;
                     case 'r':
                     case 'R':
-                        retrieve_request(server_socket_fd);
+                        retrieve_request();
+                        break;
+                    case 'w':
+                    case 'W':
+                        swarm_request();
+                        break;
+                    case 'b':
+                    case 'B':
+                        batch_request();
+                        break;
+                    case 'p':
+                    case 'P':
+                        pattern_request();
+                        break;
+                    case 'c':
+                    case 'C':
+                        watch_request();
+                        break;
+                    case 't':
+                    case 'T':
+                        stats_request();
                         break;
                     case 'q':
                     case 'Q':
-                        close(server_socket_fd);
+                        for (auto &&server : connected_servers())
+                            shutdown(server->socket_fd, SHUT_RDWR);
+                        logger.flush();
                         exit(0);
                         break;
                     case 'l':
                     case 'L':
                         // used for testing to see all registered files
-                        send(server_socket_fd, "4", sizeof(char), 0);
+                        for (auto &&server : connected_servers())
+                            send_frame(*server, make_frame(OP_PRINT_FILES_MAP));
                         break;
                     default:
                         std::cout << "\nunexpected request\n" << std::endl;
@@ -425,31 +2477,174 @@ class Peer {
             }
         }
 
-        void run_server() {
-            struct sockaddr_in addr;
-            socklen_t addr_size = sizeof(addr);
-            int client_socket_fd;
+        // hand a connection with a request waiting to the worker pool
+        // every request is admitted on its own, so a kept-alive connection is turned away like a new one once the
+        // workers are all serving and the queue is full
+        void queue_upload(UploadConnection *connection) {
+            {
+                std::lock_guard<std::mutex> guard(uploads_m);
+                if (uploads_active + upload_queue.size() < (size_t)config.upload_workers + config.upload_queue) {
+                    connection->busy = true;
+                    upload_queue.push_back(connection);
+                    uploads_cv.notify_one();
+                    return;
+                }
+            }
+            reject_upload(connection);
+        }
+
+        // close a connection whose request there is no room for
+        // a ranged client is told the server is busy so it moves on to its other sources, a legacy one only sees the
+        // connection close and a failed retrieval, as it has no reply that could say so
+        void reject_upload(UploadConnection *connection) {
+            char marker;
+            if (connection->ranged ||
+                (recv(connection->socket_fd, &marker, sizeof(marker), MSG_PEEK | MSG_DONTWAIT) == sizeof(marker) && marker == RANGE_REQUEST_MARKER)) {
+                std::string reply;
+                reply += (char)RANGE_BUSY;
+                put_varint(reply, 0);
+                put_varint(reply, 0);
+                put_varint(reply, 0);
+                std::string frame = make_frame(OP_RANGE_RESULT, reply);
+                send(connection->socket_fd, frame.data(), frame.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            }
+            log(server_log, "server busy", "rejected " + connection->identity, LOG_WARN);
+            close_upload(connection);
+        }
+
+        // the connection leaves the map before its socket is closed, so a new connection accepted on the same fd never finds it
+        void close_upload(UploadConnection *connection) {
+            std::unique_ptr<UploadConnection> closing;
+            {
+                std::lock_guard<std::mutex> guard(uploads_m);
+                auto open = upload_connections.find(connection->socket_fd);
+                if (open != upload_connections.end() && open->second.get() == connection) {
+                    closing = std::move(open->second);
+                    upload_connections.erase(open);
+                }
+            }
+            log(server_log, "client disconnected", connection->identity);
+            if (connection->file_fd >= 0)
+                close(connection->file_fd);
+            close(connection->socket_fd);
+        }
 
-            std::ostringstream client_identity;
+        // serve queued requests one at a time, so at most upload_workers uploads run at once
+        void upload_worker() {
             while (1) {
-                // listen for any peer connections to start file download
-                listen(socket_fd, 5);
+                UploadConnection *connection;
+                {
+                    std::unique_lock<std::mutex> guard(uploads_m);
+                    uploads_cv.wait(guard, [this]{ return !upload_queue.empty(); });
+                    connection = upload_queue.front();
+                    upload_queue.pop_front();
+                    // counted under the lock, so admission never sees a request in neither the queue nor a worker
+                    uploads_active++;
+                }
+
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                bool served = serve_upload(*connection);
+                uploads_active--;
+                upload_busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                if (!served) {
+                    close_upload(connection);
+                    continue;
+                }
 
-                if ((client_socket_fd = accept(socket_fd, (struct sockaddr*)&addr, &addr_size)) < 0) {
-                    // ignore any failed connections from peer clients
-                    log(server_log, "failed client connection", "ignoring connection");
+                if (connection->reader.buffered() > 0) {
+                    // the next request already arrived, so take turns with other connections instead of serving it now
+                    connection->last_active = std::chrono::steady_clock::now();
+                    queue_upload(connection);
                     continue;
                 }
+                // go back to waiting for the next request without holding a worker
+                std::lock_guard<std::mutex> guard(uploads_m);
+                connection->last_active = std::chrono::steady_clock::now();
+                connection->busy = false;
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                event.data.ptr = connection;
+                epoll_ctl(upload_epoll_fd, EPOLL_CTL_MOD, connection->socket_fd, &event);
+            }
+        }
+
+        // accept a peer client connection, its requests are admitted one at a time as they arrive
+        void accept_upload() {
+            struct sockaddr_in addr;
+            socklen_t addr_size = sizeof(addr);
+            int client_socket_fd = accept4(socket_fd, (struct sockaddr*)&addr, &addr_size, SOCK_CLOEXEC);
+            if (client_socket_fd < 0) {
+                // ignore any failed connections from peer clients
+                log(server_log, "failed client connection", "ignoring connection", LOG_WARN);
+                return;
+            }
+            std::string identity = std::string(inet_ntoa(addr.sin_addr)) + '@' + std::to_string(ntohs(addr.sin_port));
+            log(server_log, "client connected", identity);
+
+            // each range ends in a partial segment that should not wait for the previous one to be acked
+            int nodelay = 1;
+            setsockopt(client_socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            // a client that stalls in the middle of a request only holds a worker for so long
+            struct timeval timeout = {UPLOAD_REQUEST_TIMEOUT, 0};
+            setsockopt(client_socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+            UploadConnection *connection = new UploadConnection(client_socket_fd, identity);
+            connection->last_active = std::chrono::steady_clock::now();
+            std::lock_guard<std::mutex> guard(uploads_m);
+            upload_connections[client_socket_fd].reset(connection);
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+            event.data.ptr = connection;
+            epoll_ctl(upload_epoll_fd, EPOLL_CTL_ADD, client_socket_fd, &event);
+        }
+
+        // close kept-alive connections that have gone quiet
+        void close_idle_uploads() {
+            std::chrono::steady_clock::time_point cutoff = std::chrono::steady_clock::now() - std::chrono::seconds(UPLOAD_IDLE_TIMEOUT);
+            std::vector<UploadConnection*> idle;
+            {
+                std::lock_guard<std::mutex> guard(uploads_m);
+                for (auto &&entry : upload_connections) {
+                    if (!entry.second->busy && entry.second->last_active < cutoff)
+                        idle.push_back(entry.second.get());
+                }
+            }
+            for (auto &&connection : idle) {
+                epoll_ctl(upload_epoll_fd, EPOLL_CTL_DEL, connection->socket_fd, NULL);
+                close_upload(connection);
+            }
+        }
 
-                client_identity << inet_ntoa(addr.sin_addr) << '@' << ntohs(addr.sin_port);
-                log(server_log, "client connected", client_identity.str());
+        // accept connections and wait for requests on idle ones, handing each request to the worker pool
+        void run_server() {
+            if ((upload_epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+                error("failed epoll creation");
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = nullptr;
+            if (listen(socket_fd, config.upload_queue) < 0 || epoll_ctl(upload_epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) < 0)
+                error("failed to start peer server");
 
-                // start thread for performing file download
-                std::thread t(&Peer::handle_client_request, this, client_socket_fd);
-                t.detach(); // detaches thread and allows for next connection to be made without waiting
+            for (int i = 0; i < config.upload_workers; i++)
+                std::thread(&Peer::upload_worker, this).detach();
+
+            struct epoll_event events[MAX_UPLOAD_EVENTS];
+            std::chrono::steady_clock::time_point next_sweep = std::chrono::steady_clock::now();
+            while (1) {
+                int n = epoll_wait(upload_epoll_fd, events, MAX_UPLOAD_EVENTS, 1000);
+                if (n < 0 && errno != EINTR)
+                    error("failed epoll wait");
+                for (int i = 0; i < n; i++) {
+                    if (events[i].data.ptr == nullptr)
+                        accept_upload();
+                    else
+                        queue_upload(static_cast<UploadConnection*>(events[i].data.ptr));
+                }
 
-                client_identity.str("");
-                client_identity.clear();
+                if (std::chrono::steady_clock::now() >= next_sweep) {
+                    close_idle_uploads();
+                    next_sweep = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+                }
             }
         }
 
@@ -464,25 +2659,65 @@ class Peer {
 
         ~Peer() {
             close(socket_fd);
-            server_log.close();
-            client_log.close();
         }
 };
 
 
 int main(int argc, char *argv[]) {
+    PeerConfig config;
+    // uploads to a peer client that went away fail with EPIPE instead of killing the peer
+    signal(SIGPIPE, SIG_IGN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "l:f:u:b:cw:q:m:i:")) != -1) {
+        switch (opt) {
+            case 'l':
+                if (!parse_log_level(optarg, config.log_level)) {
+                    std::cerr << "log level must be one of debug, info, warn or error" << std::endl;
+                    exit(0);
+                }
+                break;
+            case 'f':
+                config.log_flush_ms = atoi(optarg);
+                break;
+            case 'u':
+                config.upload_limit = atol(optarg) * 1024;
+                break;
+            case 'b':
+                config.socket_buffer = atoi(optarg) * 1024;
+                break;
+            case 'c':
+                config.splice_downloads = false;
+                break;
+            case 'w':
+                config.upload_workers = std::max(1, atoi(optarg));
+                break;
+            case 'q':
+                config.upload_queue = std::max(1, atoi(optarg));
+                break;
+            case 'm':
+                config.search_cache = std::max(0, atoi(optarg)) * 1024;
+                break;
+            case 'i':
+                config.index_servers = optarg;
+                break;
+            default:
+                std::cerr << "usage: " << argv[0] << " [-l log level] [-f log flush interval ms] [-u upload limit KiB/s] [-b socket buffer KiB] [-c] [-w upload workers] [-q upload queue] [-m search cache KiB] [-i indexing server ports or @file] path [port]" << std::endl;
+                exit(0);
+        }
+    }
+
     // require directory path to be passed as arg
-    if (argc < 2) {
-        std::cerr << "usage: " << argv[0] << " path" << std::endl;
+    if (argc - optind < 1) {
+        std::cerr << "usage: " << argv[0] << " [-l log level] [-f log flush interval ms] [-u upload limit KiB/s] [-b socket buffer KiB] [-c] [-w upload workers] [-q upload queue] [-m search cache KiB] [-i indexing server ports or @file] path [port]" << std::endl;
         exit(0);
     }
     
-    int port = 0;
-    if (argc == 3) {
-        port = atoi(argv[2]);
+    if (argc - optind == 2) {
+        config.port = atoi(argv[optind + 1]);
     }
 
-    Peer peer(argv[1], port);
+    Peer peer(argv[optind], config);
     peer.run();
 
     return 0;
@@ -0,0 +1,323 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+
+// binary protocol spoken between peer clients and the indexing server
+//
+// a peer opens the connection with PROTOCOL_MAGIC in place of the 4 byte client id used by legacy
+// peers, followed by the highest protocol version it speaks (1 byte) and its client id (4 bytes)
+// the server answers with the version it accepted (1 byte), after which every message is a frame:
+//
+//     [varint body length][opcode (1 byte)][payload]
+//
+// strings are sent as a varint length followed by the raw bytes and peer id lists as a varint count
+// followed by one varint per id, so a short filename or a single holder costs only a few bytes
+// content hash lists are a varint count followed by one 8 byte little endian hash per entry, 0 for unknown
+//
+// tagged requests carry a request id chosen by the peer that is echoed back in the reply, so a peer may
+// keep many of them in flight on one connection and the server may answer them in any order
+//
+// a peer may also watch filenames, after which the server pushes OP_WATCH_EVENT frames unprompted on the same
+// connection, interleaved with the replies to its requests
+//
+// a leased search lets a peer keep the result: until the lease runs out the server pushes OP_INVALIDATE for the
+// filename as soon as its holders change, which also ends the lease. the invalidation for a lease is never sent
+// before the reply that granted it
+//
+// peer servers accept the same frames for ranged downloads. a downloading peer opens the connection with
+// RANGE_REQUEST_MARKER in place of the first byte of a legacy 256 byte filename, then sends any number of
+// OP_RANGE frames, each answered with an OP_RANGE_RESULT frame followed by the raw bytes of the range
+#define PROTOCOL_MAGIC 0x32505043 // never a valid port, so it cannot be mistaken for a legacy client id
+#define PROTOCOL_VERSION 2
+#define MAX_FRAME_SIZE (16 << 20) // frames larger than this are treated as a broken connection
+
+enum Opcode : uint8_t {
+    OP_REGISTER = 1, // string filename
+    OP_DEREGISTER = 2, // string filename
+    OP_SEARCH = 3, // string filename, answered with OP_SEARCH_RESULT
+    OP_PRINT_FILES_MAP = 4, // no payload
+    OP_REGISTER_MANY = 5, // varint generation, flags (1 byte), varint count, count strings,
+                          // then with REGISTER_HASHED a content hash list in the same order
+    OP_DEREGISTER_MANY = 6, // varint generation, varint count, count strings
+    OP_SYNC = 7, // varint generation, varint number of files registered, answered with OP_SYNC_RESULT, optionally followed by
+                 // the peer's upload load: varint uploads in progress, varint bytes per second sent lately, varint upload limit (0 for none)
+    OP_SEARCH_TAGGED = 8, // varint request id, string filename, answered with OP_SEARCH_TAGGED_RESULT
+    OP_STATS = 9, // varint request id, answered with OP_STATS_RESULT
+    OP_SEARCH_PATTERN = 0x0A, // varint request id, mode (1 byte), string pattern, string cursor, varint page size,
+                              // answered with OP_SEARCH_PATTERN_RESULT
+    OP_SEARCH_MANY = 0x0B, // varint request id, varint count, count strings, answered with OP_SEARCH_MANY_RESULT
+    OP_WATCH = 0x0C, // string filename, answered with an OP_WATCH_EVENT right away if the file already has peers
+    OP_UNWATCH = 0x0D, // string filename
+    OP_SEARCH_LEASED = 0x0E, // varint request id, string filename, answered with OP_SEARCH_LEASED_RESULT
+    OP_RANGE = 0x10, // string filename, varint offset, varint length, answered with OP_RANGE_RESULT
+
+    OP_SEARCH_RESULT = 0x83, // peer id list
+    OP_SYNC_RESULT = 0x87, // varint generation, status (1 byte)
+    OP_SEARCH_TAGGED_RESULT = 0x88, // varint request id, peer id list, content hash list with one hash per peer
+    OP_STATS_RESULT = 0x89, // varint request id, string report
+    OP_SEARCH_PATTERN_RESULT = 0x8A, // varint request id, string next cursor, varint count, count (string filename, peer id list)
+    OP_SEARCH_MANY_RESULT = 0x8B, // varint request id, varint count, count peer id lists in the order the filenames were sent
+    OP_WATCH_EVENT = 0x8C, // string filename, peer id list, content hash list, pushed whenever a peer registers a watched file
+                           // or changes its content, and with an empty peer id list once the last peer leaves
+    OP_INVALIDATE = 0x8D, // string filename, pushed to every peer holding a lease on the file when its holders change
+    OP_SEARCH_LEASED_RESULT = 0x8E, // varint request id, varint lease ms, peer id list, content hash list with one hash per peer
+                                    // a lease of 0 means the result may not be kept
+    OP_RANGE_RESULT = 0x90, // status (1 byte), varint file size, varint offset, varint length, then length raw bytes
+};
+
+// OP_REGISTER_MANY flags
+#define REGISTER_REPLACE 0x01 // drop every file previously registered by the peer before registering these
+#define REGISTER_HASHED 0x02 // the filenames are followed by their content hashes
+
+// OP_SYNC_RESULT status
+#define SYNC_OK 0
+#define SYNC_DRIFT 1 // the server's view differs from the peer's, the peer should resend its full file list
+
+#define MAX_BATCH_SIZE 4096 // filenames per OP_REGISTER_MANY/OP_DEREGISTER_MANY/OP_SEARCH_MANY frame
+#define MAX_WATCHES 4096 // filenames one connection may watch at once, a connection asking for more is dropped
+#define SEARCH_LEASE_MS 30000 // how long a leased search result stays valid unless invalidated first
+#define MAX_LEASES 65536 // leases one connection may hold at once, later leased searches are answered with a lease of 0
+
+// OP_SEARCH_PATTERN mode
+#define PATTERN_PREFIX 0 // filenames starting with the pattern
+#define PATTERN_GLOB 1 // filenames matching the pattern, with '*', '?' and '[...]' wildcards
+
+// a pattern search is answered a page at a time. the first request sends an empty cursor and every later
+// one sends the cursor from the previous reply, until a reply comes back with an empty cursor. a page may
+// hold fewer files than asked for, even none, when the server stopped early to keep the page small
+#define PATTERN_PAGE_SIZE 256 // most files in one page, and the page size used when a request asks for 0
+#define PATTERN_PAGE_BYTES 65536 // a page stops growing once its files and peer ids take this many bytes
+
+#define RANGE_REQUEST_MARKER 0x00 // first byte of a ranged download, a legacy filename never starts with it
+
+// OP_RANGE_RESULT status
+#define RANGE_OK 0
+#define RANGE_NOT_FOUND 1
+#define RANGE_UNREADABLE 2
+#define RANGE_BUSY 3 // sent unprompted before a peer server closes a connection it has no room to serve
+
+
+inline void put_varint(std::string &buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer += (char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer += (char)value;
+}
+
+inline bool get_varint(const char *&pos, const char *end, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        uint8_t byte = *pos++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+inline void put_string(std::string &buffer, const std::string &value) {
+    put_varint(buffer, value.size());
+    buffer += value;
+}
+
+inline bool get_string(const char *&pos, const char *end, std::string &value) {
+    uint64_t size;
+    if (!get_varint(pos, end, size) || size > (uint64_t)(end - pos))
+        return false;
+    value.assign(pos, size);
+    pos += size;
+    return true;
+}
+
+inline void put_strings(std::string &buffer, const std::vector<std::string> &values) {
+    put_varint(buffer, values.size());
+    for (auto &&value : values)
+        put_string(buffer, value);
+}
+
+inline bool get_strings(const char *&pos, const char *end, std::vector<std::string> &values) {
+    uint64_t count;
+    if (!get_varint(pos, end, count) || count > (uint64_t)(end - pos))
+        return false;
+    values.resize(count);
+    for (auto &&value : values) {
+        if (!get_string(pos, end, value))
+            return false;
+    }
+    return true;
+}
+
+inline void put_ids(std::string &buffer, const std::vector<int> &ids) {
+    put_varint(buffer, ids.size());
+    for (auto &&id : ids)
+        put_varint(buffer, (uint32_t)id);
+}
+
+inline bool get_ids(const char *&pos, const char *end, std::vector<int> &ids) {
+    uint64_t count, id;
+    if (!get_varint(pos, end, count) || count > (uint64_t)(end - pos))
+        return false;
+    ids.clear();
+    ids.reserve(count);
+    for (uint64_t i = 0; i < count; i++) {
+        if (!get_varint(pos, end, id))
+            return false;
+        ids.push_back((int)id);
+    }
+    return true;
+}
+
+inline void put_hashes(std::string &buffer, const std::vector<uint64_t> &hashes) {
+    put_varint(buffer, hashes.size());
+    for (auto &&hash : hashes) {
+        for (int i = 0; i < 8; i++)
+            buffer += (char)(hash >> (8 * i));
+    }
+}
+
+inline bool get_hashes(const char *&pos, const char *end, std::vector<uint64_t> &hashes) {
+    uint64_t count;
+    if (!get_varint(pos, end, count) || count > (uint64_t)(end - pos) / 8)
+        return false;
+    hashes.assign(count, 0);
+    for (auto &&hash : hashes) {
+        for (int i = 0; i < 8; i++)
+            hash |= (uint64_t)(uint8_t)*pos++ << (8 * i);
+    }
+    return true;
+}
+
+// build a complete frame for an opcode and its already encoded payload
+inline std::string make_frame(uint8_t opcode, const std::string &payload=std::string()) {
+    std::string frame;
+    put_varint(frame, payload.size() + 1);
+    frame += (char)opcode;
+    frame += payload;
+    return frame;
+}
+
+// try to take one frame from buffer starting at pos
+// returns 1 and advances pos if a whole frame was available, 0 if more bytes are needed and -1 if the frame is invalid
+inline int parse_frame(const std::string &buffer, size_t &pos, uint8_t &opcode, std::string &payload) {
+    const char *start = buffer.data() + pos;
+    const char *end = buffer.data() + buffer.size();
+    const char *p = start;
+    uint64_t size;
+    if (!get_varint(p, end, size))
+        return (end - start) >= 10 ? -1 : 0;
+    if (size == 0 || size > MAX_FRAME_SIZE)
+        return -1;
+    if ((uint64_t)(end - p) < size)
+        return 0;
+    opcode = *p;
+    payload.assign(p + 1, size - 1);
+    pos += (p - start) + size;
+    return 1;
+}
+
+// send the whole buffer, retrying on partial writes
+inline bool send_all(int socket_fd, const void *data, size_t size) {
+    const char *p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(socket_fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// recieve exactly size bytes, retrying on short reads
+inline bool recv_all(int socket_fd, void *data, size_t size) {
+    char *p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = recv(socket_fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+// buffered reader for frames on a blocking socket
+class FrameReader {
+    private:
+        int socket_fd;
+        std::string buffer;
+        size_t pos = 0;
+
+    public:
+        FrameReader(int fd=-1) : socket_fd(fd) {}
+
+        // bytes read past the last frame that have not been handed out yet
+        size_t buffered() const {
+            return buffer.size() - pos;
+        }
+
+        // copy out bytes that were read past the last frame, or recieve new ones if none are buffered
+        // used for raw data that follows a frame, returns 0 once the connection is closed
+        ssize_t read_some(void *data, size_t size) {
+            if (pos < buffer.size()) {
+                size_t n = std::min(size, buffer.size() - pos);
+                memcpy(data, buffer.data() + pos, n);
+                pos += n;
+                if (pos == buffer.size()) {
+                    buffer.clear();
+                    pos = 0;
+                }
+                return n;
+            }
+            while (1) {
+                ssize_t n = recv(socket_fd, data, size, 0);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                return n;
+            }
+        }
+
+        // block until a whole frame arrives, returns false if the connection broke or sent garbage
+        bool next(uint8_t &opcode, std::string &payload) {
+            char chunk[4096];
+            while (1) {
+                int parsed = parse_frame(buffer, pos, opcode, payload);
+                if (parsed < 0)
+                    return false;
+                if (parsed > 0) {
+                    if (pos == buffer.size()) {
+                        buffer.clear();
+                        pos = 0;
+                    }
+                    return true;
+                }
+
+                ssize_t n = recv(socket_fd, chunk, sizeof(chunk), 0);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    return false;
+                buffer.erase(0, pos);
+                pos = 0;
+                buffer.append(chunk, n);
+            }
+        }
+};
+
+#endif
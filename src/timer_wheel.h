@@ -0,0 +1,97 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+
+#define TIMER_WHEEL_BITS 6 // each level has 1 << TIMER_WHEEL_BITS slots
+#define TIMER_WHEEL_LEVELS 4 // levels of slots, each covering TIMER_WHEEL_BITS more bits of a deadline
+
+
+// hierarchical timing wheel, timers are values due at a tick
+// level 0 has a slot per tick and every higher level a slot per full turn of the level below, so a timer is kept at
+// the level of the highest digit its deadline differs from the current tick in. whenever the lower levels finish a
+// turn the next slot of the level above is spread over them, so adding a timer and handling it on every tick it is
+// moved costs O(1) no matter how many are pending, and each timer is moved at most once per level
+// timers cannot be cancelled, whoever gets one back checks whether it still matters and adds it again if it was pushed back
+template <typename T>
+class TimerWheel {
+    private:
+        struct Timer {
+            uint64_t deadline;
+            T value;
+        };
+
+        static const uint64_t SLOTS = 1ull << TIMER_WHEEL_BITS;
+        static const uint64_t MASK = SLOTS - 1;
+
+        std::vector<std::vector<Timer>> slots; // level 0 slots first
+        uint64_t current = 0; // last tick handled
+        size_t pending = 0;
+
+        // timers further out than the top level can reach sit in its slots until the turn their deadline is in
+        void place(Timer timer) {
+            uint64_t differ = timer.deadline ^ current;
+            int level = differ == 0 ? 0 : (63 - __builtin_clzll(differ)) / TIMER_WHEEL_BITS;
+            if (level >= TIMER_WHEEL_LEVELS)
+                level = TIMER_WHEEL_LEVELS - 1;
+            slots[level * SLOTS + ((timer.deadline >> (level * TIMER_WHEEL_BITS)) & MASK)].push_back(std::move(timer));
+        }
+
+    public:
+        TimerWheel() : slots(TIMER_WHEEL_LEVELS * SLOTS) {}
+
+        // add a timer due at deadline, one already due comes back on the next tick
+        void add(uint64_t deadline, T value) {
+            pending++;
+            place(Timer{std::max(deadline, current + 1), std::move(value)});
+        }
+
+        // handle every tick up to and including now, appending the values of the timers that came due
+        void advance(uint64_t now, std::vector<T> &due) {
+            while (current < now) {
+                current++;
+                // spread the slots whose turn just started over the levels below, highest first so a timer can
+                // fall through several levels at once
+                for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+                    if (current & ((1ull << (level * TIMER_WHEEL_BITS)) - 1))
+                        continue;
+                    std::vector<Timer> cascade;
+                    cascade.swap(slots[level * SLOTS + ((current >> (level * TIMER_WHEEL_BITS)) & MASK)]);
+                    for (auto &&timer : cascade)
+                        place(std::move(timer));
+                }
+
+                std::vector<Timer> &slot = slots[current & MASK];
+                for (size_t i = 0; i < slot.size();) {
+                    // a timer cascaded ahead of a deadline past the top level goes around again
+                    if (slot[i].deadline > current) {
+                        Timer timer = std::move(slot[i]);
+                        slot[i] = std::move(slot.back());
+                        slot.pop_back();
+                        place(std::move(timer));
+                        continue;
+                    }
+                    due.push_back(std::move(slot[i].value));
+                    pending--;
+                    i++;
+                }
+                slot.clear();
+            }
+        }
+
+        uint64_t now() const {
+            return current;
+        }
+
+        size_t size() const {
+            return pending;
+        }
+};
+
+#endif